@@ -97,28 +97,43 @@ struct block_processor
 {
     struct bz3_state *bzip3;
     size_t blocksize;
+    VALUE cache;
 };
 
 #define BLOCK_PROCESSOR_FREE_BLOCK(P)                                   \
         if ((P)->bzip3) {                                               \
-            bz3_free((P)->bzip3);                                       \
+            aux_bz3_free((P)->bzip3, (uint32_t)(P)->blocksize);         \
         }                                                               \
 
-#define BLOCK_PROCESSOR_VALUE_FOREACH(DEF)
+#define BLOCK_PROCESSOR_VALUE_FOREACH(DEF)                              \
+        DEF(cache)                                                      \
 
 AUX_DEFINE_TYPED_DATA(block_processor, block_processor_allocate, BLOCK_PROCESSOR_FREE_BLOCK, BLOCK_PROCESSOR_VALUE_FOREACH)
 
 /*
- *  @overload initialize(blocksize)
+ *  @overload initialize(blocksize, cache: nil)
+ *
+ *  @param  cache       [Bzip3::BlockCache, nil]
+ *      与えると、同じ内容のブロックの圧縮と伸長を省いてキャッシュから結果を複写します。
  */
 static VALUE
-block_processor_initialize(VALUE self, VALUE blocksize)
+block_processor_initialize(int argc, VALUE argv[], VALUE self)
 {
+    VALUE blocksize, opts;
+    rb_scan_args(argc, argv, "1:", &blocksize, &opts);
+
+    enum { numkw = 1 };
+    ID idtab[numkw] = { rb_intern("cache") };
+    union { struct { VALUE cache; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
     struct block_processor *p = get_block_processor_ptr(self);
     if (p->bzip3 != NULL) {
         rb_raise(rb_eTypeError, "wrong re-initializing - %" PRIsVALUE, self);
     }
 
+    extbzip3_get_cache(kw.cache);
+    p->cache = (RB_UNDEF_P(kw.cache) ? Qnil : kw.cache);
     p->blocksize = NUM2UINT(blocksize);
 
     if (p->blocksize < AUX_BZIP3_BLOCKSIZE_MIN) {
@@ -139,59 +154,355 @@ block_processor_blocksize(VALUE self)
     return SIZET2NUM(get_block_processor(self)->blocksize);
 }
 
-static VALUE
-block_processor_decode(VALUE self, VALUE src, VALUE dest, VALUE originalsize)
+struct block_processor_args
 {
-    rb_check_type(src, RUBY_T_STRING);
-    rb_check_type(dest, RUBY_T_STRING);
+    struct block_processor *p;
+    VALUE src, dest, originalsize;
+};
 
-    struct block_processor *p = get_block_processor(self);
+static VALUE
+block_processor_decode_main(VALUE arg)
+{
+    struct block_processor_args *args = (struct block_processor_args *)arg;
+    struct block_processor *p = args->p;
 
-    size_t origsize = NUM2SIZET(originalsize);
+    size_t origsize = NUM2SIZET(args->originalsize);
     if (origsize > (size_t)p->blocksize) {
-        rb_raise(rb_eRuntimeError, "originalsize too big - %" PRIsVALUE, originalsize);
+        rb_raise(rb_eRuntimeError, "originalsize too big - %" PRIsVALUE, args->originalsize);
     }
 
-    size_t srclen = RSTRING_LEN(src);
+    // src と dest が同じ String の場合、dest の準備で内容が失われたり再配置されたりするため、先に元の内容を保持しておく
+    VALUE srcobj = (args->src == args->dest ? aux_str_pin(args->src) : args->src);
+
     size_t destcapa = bz3_bound((uint32_t)origsize);
-    rb_str_modify(dest);
-    rb_str_set_len(dest, 0);
-    rb_str_modify_expand(dest, destcapa);
+    size_t needsize = destcapa;
+    char *dest = aux_dest_prepare(args->dest, &destcapa);
+
+    const char *src;
+    size_t srclen;
+    aux_src_bytes(srcobj, &src, &srclen);
+
+    if (destcapa < needsize || destcapa < srclen) {
+        rb_raise(rb_eRuntimeError, "dest too small - #<%" PRIsVALUE ":0x%" PRIxVALUE "> (expect %" PRIuSIZE " bytes or more)",
+                 rb_class_of(args->dest), args->dest, (needsize > srclen ? needsize : srclen));
+    }
 
-    memmove(RSTRING_PTR(dest), RSTRING_PTR(src), srclen);
-    int32_t ret = aux_bz3_decode_block_nogvl(p->bzip3, RSTRING_PTR(dest), srclen, NUM2UINT(originalsize));
+    memmove(dest, src, srclen);
+    RB_GC_GUARD(srcobj);
+    int32_t ret = aux_bz3_decode_block_cached_nogvl(extbzip3_get_cache(p->cache), p->bzip3, dest, srclen, origsize);
     extbzip3_check_error(ret);
 
-    rb_str_set_len(dest, ret);
+    return aux_dest_finish(args->dest, ret);
+}
+
+/*
+ *  @overload decode(src, dest, originalsize)
+ *
+ *  @param  src         [String, IO::Buffer]
+ *  @param  dest        [String, IO::Buffer]
+ *      IO::Buffer の場合は `bz3_bound(originalsize)` バイト以上の大きさが必要です。
+ *  @param  originalsize [Integer]
+ *  @return [String, IO::Buffer]
+ *      dest. If dest is IO::Buffer, returns a slice of it covering the written bytes.
+ */
+static VALUE
+block_processor_decode(VALUE self, VALUE src, VALUE dest, VALUE originalsize)
+{
+    aux_check_dest(dest);
+
+    struct block_processor_args args = { get_block_processor(self), src, dest, originalsize };
 
-    return dest;
+    return aux_io_buffer_locked_call(src, dest, block_processor_decode_main, (VALUE)&args);
 }
 
 static VALUE
-block_processor_encode(VALUE self, VALUE src, VALUE dest)
+block_processor_encode_main(VALUE arg)
 {
-    rb_check_type(src, RUBY_T_STRING);
-    rb_check_type(dest, RUBY_T_STRING);
+    struct block_processor_args *args = (struct block_processor_args *)arg;
+    struct block_processor *p = args->p;
 
-    struct block_processor *p = get_block_processor(self);
+    // src と dest が同じ String の場合、dest の準備で内容が失われたり再配置されたりするため、先に元の内容を保持しておく
+    VALUE srcobj = (args->src == args->dest ? aux_str_pin(args->src) : args->src);
+
+    const char *src;
+    size_t srclen;
+    aux_src_bytes(srcobj, &src, &srclen);
 
-    size_t srclen = RSTRING_LEN(src);
     if (srclen > p->blocksize) {
-        rb_raise(rb_eRuntimeError, "src too big - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(src), src);
+        rb_raise(rb_eRuntimeError, "src too big - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(args->src), args->src);
     }
 
     size_t destcapa = bz3_bound((uint32_t)srclen);
-    rb_str_modify(dest);
-    rb_str_set_len(dest, 0);
-    rb_str_modify_expand(dest, (uint32_t)destcapa);
+    size_t needsize = destcapa;
+    char *dest = aux_dest_prepare(args->dest, &destcapa);
+    if (destcapa < needsize) {
+        rb_raise(rb_eRuntimeError, "dest too small - #<%" PRIsVALUE ":0x%" PRIxVALUE "> (expect %" PRIuSIZE " bytes or more)",
+                 rb_class_of(args->dest), args->dest, needsize);
+    }
+
+    aux_src_bytes(srcobj, &src, &srclen);
+    memmove(dest, src, srclen);
+    RB_GC_GUARD(srcobj);
+    int32_t ret = aux_bz3_encode_block_cached_nogvl(extbzip3_get_cache(p->cache), (uint32_t)p->blocksize, p->bzip3, dest, srclen);
+    extbzip3_check_error(ret);
+
+    return aux_dest_finish(args->dest, ret);
+}
+
+/*
+ *  @overload encode(src, dest)
+ *
+ *  @param  src         [String, IO::Buffer]
+ *  @param  dest        [String, IO::Buffer]
+ *      IO::Buffer の場合は `bz3_bound(src.bytesize)` バイト以上の大きさが必要です。
+ *  @return [String, IO::Buffer]
+ *      dest. If dest is IO::Buffer, returns a slice of it covering the written bytes.
+ */
+static VALUE
+block_processor_encode(VALUE self, VALUE src, VALUE dest)
+{
+    aux_check_dest(dest);
+
+    struct block_processor_args args = { get_block_processor(self), src, dest, Qnil };
+
+    return aux_io_buffer_locked_call(src, dest, block_processor_encode_main, (VALUE)&args);
+}
+
+struct block_processor_inplace_args
+{
+    struct block_processor *p;
+    VALUE buf, size, originalsize;
+};
+
+static char *
+block_processor_inplace_prepare(VALUE buf, VALUE size, size_t need, size_t *len)
+{
+    if (rb_type_p(buf, RUBY_T_STRING)) {
+        *len = RSTRING_LEN(buf);
+
+        if (!RB_NIL_P(size)) {
+            size_t len1 = NUM2SIZET(size);
+            if (len1 > *len) {
+                rb_raise(rb_eArgError, "size too big - %" PRIsVALUE " (expect ..%" PRIuSIZE ")", size, *len);
+            }
+            *len = len1;
+        }
+
+        rb_str_modify(buf);
+        rb_str_modify_expand(buf, (need > *len ? need - *len : 0));
+
+        return RSTRING_PTR(buf);
+    } else if (aux_io_buffer_p(buf)) {
+        if (RB_NIL_P(size)) {
+            rb_raise(rb_eArgError, "need size for IO::Buffer");
+        }
+
+        *len = NUM2SIZET(size);
+
+        size_t capa = SIZE_MAX;
+        char *ptr = aux_dest_prepare(buf, &capa);
+        if (capa < *len || capa < need) {
+            rb_raise(rb_eRuntimeError, "buffer too small - #<%" PRIsVALUE ":0x%" PRIxVALUE "> (expect %" PRIuSIZE " bytes or more)",
+                     rb_class_of(buf), buf, (need > *len ? need : *len));
+        }
+
+        return ptr;
+    } else {
+        aux_raise_not_string_or_buffer(buf);
+    }
+}
+
+static VALUE
+block_processor_encode_inplace_main(VALUE arg)
+{
+    struct block_processor_inplace_args *args = (struct block_processor_inplace_args *)arg;
+    struct block_processor *p = args->p;
+
+    size_t len = (rb_type_p(args->buf, RUBY_T_STRING) ? (size_t)RSTRING_LEN(args->buf) : 0);
+    if (!RB_NIL_P(args->size)) {
+        len = NUM2SIZET(args->size);
+    }
+
+    if (len > p->blocksize) {
+        rb_raise(rb_eRuntimeError, "src too big - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(args->buf), args->buf);
+    }
+
+    char *ptr = block_processor_inplace_prepare(args->buf, args->size, bz3_bound(len), &len);
+    int32_t ret = aux_bz3_encode_block_cached_nogvl(extbzip3_get_cache(p->cache), (uint32_t)p->blocksize, p->bzip3, ptr, len);
+    extbzip3_check_error(ret);
+
+    return aux_dest_finish(args->buf, ret);
+}
+
+/*
+ *  @overload encode!(buf, size = nil)
+ *
+ *  buf の先頭 size バイトをその場で圧縮します。
+ *
+ *  buf が String の場合、必要に応じて `bz3_bound(size)` バイトまで容量を拡張します。
+ *  buf が IO::Buffer の場合は size が必須で、`bz3_bound(size)` バイト以上の大きさが必要です。
+ *
+ *  @param  buf         [String, IO::Buffer]
+ *  @param  size        [Integer, nil]  size of data in buf (default: `buf.bytesize`)
+ *  @return [String, IO::Buffer]
+ *      buf. If buf is IO::Buffer, returns a slice of it covering the compressed bytes.
+ */
+static VALUE
+block_processor_encode_inplace(int argc, VALUE argv[], VALUE self)
+{
+    struct block_processor_inplace_args args = { get_block_processor(self), Qnil, Qnil, Qnil };
+    rb_scan_args(argc, argv, "11", &args.buf, &args.size);
+
+    return aux_io_buffer_locked_call(args.buf, Qnil, block_processor_encode_inplace_main, (VALUE)&args);
+}
+
+static VALUE
+block_processor_decode_inplace_main(VALUE arg)
+{
+    struct block_processor_inplace_args *args = (struct block_processor_inplace_args *)arg;
+    struct block_processor *p = args->p;
 
-    memmove(RSTRING_PTR(dest), RSTRING_PTR(src), srclen);
-    int32_t ret = aux_bz3_encode_block_nogvl(p->bzip3, RSTRING_PTR(dest), (int32_t)srclen);
+    size_t origsize = NUM2SIZET(args->originalsize);
+    if (origsize > (size_t)p->blocksize) {
+        rb_raise(rb_eRuntimeError, "originalsize too big - %" PRIsVALUE, args->originalsize);
+    }
+
+    size_t len;
+    char *ptr = block_processor_inplace_prepare(args->buf, args->size, bz3_bound(origsize), &len);
+    int32_t ret = aux_bz3_decode_block_cached_nogvl(extbzip3_get_cache(p->cache), p->bzip3, ptr, len, origsize);
     extbzip3_check_error(ret);
 
-    rb_str_set_len(dest, ret);
+    return aux_dest_finish(args->buf, ret);
+}
+
+/*
+ *  @overload decode!(buf, originalsize, size = nil)
+ *
+ *  buf の先頭 size バイトをその場で伸長します。
+ *
+ *  buf が String の場合、必要に応じて `bz3_bound(originalsize)` バイトまで容量を拡張します。
+ *  buf が IO::Buffer の場合は size が必須で、`bz3_bound(originalsize)` バイト以上の大きさが必要です。
+ *
+ *  @param  buf         [String, IO::Buffer]
+ *  @param  originalsize [Integer]
+ *  @param  size        [Integer, nil]  size of data in buf (default: `buf.bytesize`)
+ *  @return [String, IO::Buffer]
+ *      buf. If buf is IO::Buffer, returns a slice of it covering the decompressed bytes.
+ */
+static VALUE
+block_processor_decode_inplace(int argc, VALUE argv[], VALUE self)
+{
+    struct block_processor_inplace_args args = { get_block_processor(self), Qnil, Qnil, Qnil };
+    rb_scan_args(argc, argv, "21", &args.buf, &args.originalsize, &args.size);
+
+    return aux_io_buffer_locked_call(args.buf, Qnil, block_processor_decode_inplace_main, (VALUE)&args);
+}
+
+struct block_processor_encode_blocks_entry
+{
+    VALUE srcobj, destobj;      /* スタックか一時バッファに置くことで、GC の移動から保護する */
+    const char *src;
+    char *dest;
+    int32_t len;
+    int32_t ret;
+};
+
+struct block_processor_encode_blocks_nogvl
+{
+    struct bz3_state *bz3;
+    struct extbzip3_cache *cache;
+    uint32_t blocksize;
+    struct block_processor_encode_blocks_entry *entries;
+    long num;
+};
+
+static void *
+block_processor_encode_blocks_nogvl(void *opaque)
+{
+    struct block_processor_encode_blocks_nogvl *p = (struct block_processor_encode_blocks_nogvl *)opaque;
+
+    for (long i = 0; i < p->num; i++) {
+        struct block_processor_encode_blocks_entry *e = &p->entries[i];
+        memcpy(e->dest, e->src, e->len);
+        e->ret = aux_bz3_encode_block_cached(p->cache, p->blocksize, p->bz3, e->dest, e->len);
+
+        if (e->ret < 0) {
+            return (void *)(intptr_t)i;
+        }
+    }
+
+    return (void *)(intptr_t)-1;
+}
+
+/*
+ *  @overload encode_blocks(srcs)
+ *
+ *  複数のブロックをまとめて圧縮します。
+ *
+ *  すべてのブロックを一度の GVL の解放で処理するため、小さなブロックを多数扱う場合の呼び出しごとの負荷を減らせます。
+ *
+ *  @param  srcs        [Array<String>]
+ *  @return [Array<String>]     compressed blocks
+ */
+static VALUE
+block_processor_encode_blocks(VALUE self, VALUE srcs)
+{
+    struct block_processor *p = get_block_processor(self);
+
+    VALUE ary = rb_check_array_type(srcs);
+    if (RB_NIL_P(ary)) {
+        rb_raise(rb_eTypeError, "wrong argument type %" PRIsVALUE " (expected Array)", rb_obj_class(srcs));
+    }
+    srcs = rb_ary_dup(ary);
+
+    long num = RARRAY_LEN(srcs);
+    VALUE dests = rb_ary_new_capa(num);
+    VALUE tmp;
+    struct block_processor_encode_blocks_entry *entries = ALLOCV_N(struct block_processor_encode_blocks_entry, tmp, num);
+
+    for (long i = 0; i < num; i++) {
+        VALUE src = RARRAY_AREF(srcs, i);
+        rb_check_type(src, RUBY_T_STRING);
+        src = aux_str_pin(src);
+        RARRAY_ASET(srcs, i, src);
+
+        size_t srclen = RSTRING_LEN(src);
+        if (srclen > p->blocksize) {
+            rb_raise(rb_eRuntimeError, "src too big - #<%" PRIsVALUE ":0x%" PRIxVALUE "> (at %ld)", rb_class_of(src), src, i);
+        }
+
+        VALUE dest = rb_str_buf_new(bz3_bound(srclen));
+        rb_ary_push(dests, dest);
+
+        entries[i].srcobj = src;
+        entries[i].destobj = dest;
+        entries[i].len = (int32_t)srclen;
+        entries[i].ret = 0;
+    }
+
+    // 埋め込み文字列は途中の GC で移動することがあるため、すべての文字列を作り終えてからポインタを取り出す
+    for (long i = 0; i < num; i++) {
+        entries[i].src = RSTRING_PTR(entries[i].srcobj);
+        entries[i].dest = RSTRING_PTR(entries[i].destobj);
+    }
+
+    struct block_processor_encode_blocks_nogvl args = { p->bzip3, extbzip3_get_cache(p->cache), (uint32_t)p->blocksize, entries, num };
+    long failed = (long)(intptr_t)aux_call_without_gvl(block_processor_encode_blocks_nogvl, &args);
+
+    if (failed >= 0) {
+        int32_t ret = entries[failed].ret;
+        ALLOCV_END(tmp);
+        extbzip3_check_error(ret);
+    }
+
+    for (long i = 0; i < num; i++) {
+        rb_str_set_len(RARRAY_AREF(dests, i), entries[i].ret);
+    }
+
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(srcs);
 
-    return dest;
+    return dests;
 }
 
 static void
@@ -199,10 +510,13 @@ init_processor(VALUE bzip3_module)
 {
     VALUE block_processor_class = rb_define_class_under(bzip3_module, "BlockProcessor", rb_cObject);
     rb_define_alloc_func(block_processor_class, block_processor_allocate);
-    rb_define_method(block_processor_class, "initialize", block_processor_initialize, 1);
+    rb_define_method(block_processor_class, "initialize", block_processor_initialize, -1);
     rb_define_method(block_processor_class, "blocksize", block_processor_blocksize, 0);
     rb_define_method(block_processor_class, "decode", block_processor_decode, 3);
     rb_define_method(block_processor_class, "encode", block_processor_encode, 2);
+    rb_define_method(block_processor_class, "decode!", block_processor_decode_inplace, -1);
+    rb_define_method(block_processor_class, "encode!", block_processor_encode_inplace, -1);
+    rb_define_method(block_processor_class, "encode_blocks", block_processor_encode_blocks, 1);
 }
 
 EXTBZIP3_API void
@@ -217,4 +531,16 @@ Init_extbzip3(void)
     init_processor(bzip3_module);
     extbzip3_init_decoder(bzip3_module);
     extbzip3_init_encoder(bzip3_module);
+    extbzip3_init_pool(bzip3_module);
+    extbzip3_init_verify(bzip3_module);
+    extbzip3_init_estimate(bzip3_module);
+    extbzip3_init_copy(bzip3_module);
+    extbzip3_init_memory(bzip3_module);
+    extbzip3_init_file(bzip3_module);
+    extbzip3_init_scan(bzip3_module);
+    extbzip3_init_executor(bzip3_module);
+    extbzip3_init_bundled(bzip3_module);
+    extbzip3_init_idle(bzip3_module);
+    extbzip3_init_stat(bzip3_module);
+    extbzip3_init_cache(bzip3_module);
 }
@@ -11,6 +11,16 @@
 #include <limits.h>
 #include <stdlib.h>
 
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+# include <ruby/io/buffer.h>
+# define AUX_IO_BUFFER_SUPPORT 1
+#endif
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+# define EXTBZIP3_POOL_SUPPORT 1
+#endif
+
 #define RDOCFAKE(...)
 
 #if RUBY_API_VERSION_CODE >= 20700
@@ -22,6 +32,12 @@
 #define AUX_DEFINE_TYPED_DATA_GC_MARK(FIELD) rb_gc_mark_movable(_data_ptr->FIELD);
 #define AUX_DEFINE_TYPED_DATA_GC_MOVE(FIELD) _data_ptr->FIELD = rb_gc_location(_data_ptr->FIELD);
 
+/*
+ * get_<PREFIX>() が初期化済みとみなす条件です。
+ * bzip3 の状態を遅延して確保する場合は、AUX_DEFINE_TYPED_DATA の前で定義し直してください。
+ */
+#define AUX_DEFINE_TYPED_DATA_INITIALIZED_P(P) ((P)->bzip3 != NULL)
+
 #define AUX_DEFINE_TYPED_DATA(PREFIX, ALLOC_NAME, FREE_BLOCK, GC_VALUE) \
         static void                                                     \
         PREFIX ## _free(void *ptr)                                      \
@@ -91,7 +107,7 @@
         {                                                               \
             struct PREFIX *p = get_ ## PREFIX ## _ptr(obj);             \
                                                                         \
-            if (!p->bzip3) {                                            \
+            if (!AUX_DEFINE_TYPED_DATA_INITIALIZED_P(p)) {              \
                 rb_raise(rb_eArgError, "wrong initialized - %" PRIsVALUE, obj); \
             }                                                           \
                                                                         \
@@ -101,27 +117,233 @@
 
 void extbzip3_init_decoder(VALUE bzip3_module);
 void extbzip3_init_encoder(VALUE bzip3_module);
+void extbzip3_init_pool(VALUE bzip3_module);
+void extbzip3_init_verify(VALUE bzip3_module);
+void extbzip3_init_estimate(VALUE bzip3_module);
+void extbzip3_init_copy(VALUE bzip3_module);
+void extbzip3_init_memory(VALUE bzip3_module);
+void extbzip3_init_file(VALUE bzip3_module);
+void extbzip3_init_scan(VALUE bzip3_module);
+void extbzip3_init_executor(VALUE bzip3_module);
+void extbzip3_init_bundled(VALUE bzip3_module);
+void extbzip3_init_idle(VALUE bzip3_module);
+void extbzip3_init_stat(VALUE bzip3_module);
+void extbzip3_init_cache(VALUE bzip3_module);
+
+/*
+ * 圧縮結果と伸長結果のブロックキャッシュ (extbzip3_cache.c)
+ *
+ * extbzip3_cache_key、extbzip3_cache_fetch、extbzip3_cache_store は GVL を手放した状態からも呼び出せます。
+ */
+
+enum {
+    EXTBZIP3_CACHE_ENCODED = 1, /* 圧縮前のブロックをキーにして、圧縮後のブロックを保持します */
+    EXTBZIP3_CACHE_DECODED = 2, /* 圧縮後のブロックをキーにして、伸長後のブロックを保持します */
+};
+
+/*
+ * これより小さいブロックはキャッシュしません。
+ * キーの計算と登録の手間が、圧縮や伸長をし直す手間を上回るためです。
+ */
+#define EXTBZIP3_CACHE_MIN_BLOCK 64
+
+struct extbzip3_cache;
+
+struct extbzip3_cache_key
+{
+    uint64_t hash;
+    uint32_t crc;
+    uint32_t size;
+    uint32_t param;             /* ENCODED ではブロックサイズ、DECODED では伸長後の大きさ */
+    int kind;
+};
+
+struct extbzip3_cache *extbzip3_get_cache(VALUE obj);
+void extbzip3_cache_key(struct extbzip3_cache_key *key, int kind, uint32_t param, const void *buf, size_t len);
+int32_t extbzip3_cache_fetch(struct extbzip3_cache *cache, const struct extbzip3_cache_key *key, void *dest, size_t destsize);
+void extbzip3_cache_store(struct extbzip3_cache *cache, const struct extbzip3_cache_key *key, const void *value, size_t len);
+
+/*
+ * bz3_state が使用するメモリの予算 (extbzip3_memory.c)
+ *
+ * reserve と release は GVL を持たないスレッドからも呼び出せます。
+ * acquire は GVL が必要で、予算に空きが出来るまで待機し、それでも足りなければ例外を発生させます。
+ */
+int extbzip3_memory_reserve(size_t size);
+void extbzip3_memory_release(size_t size);
+void extbzip3_memory_acquire(size_t size);
+
+/*
+ * 使われていない Encoder や Decoder の解放 (extbzip3_idle.c)
+ *
+ * 構造体に埋め込み、extbzip3_idle_register で登録します。timeout が nil なら登録簿には載りませんが、
+ * extbzip3_idle_trim による個別の解放は出来ます。
+ * 処理中は extbzip3_idle_call を介して呼び出し、解放されないようにします。
+ */
+struct extbzip3_idle
+{
+    struct extbzip3_idle *prev, *next;
+    void (*trim)(struct extbzip3_idle *idle);
+    double timeout;
+    double lastuse;
+    int busy;
+};
+
+double extbzip3_idle_now(void);
+void extbzip3_idle_register(struct extbzip3_idle *idle, VALUE timeout, void (*trim)(struct extbzip3_idle *idle));
+void extbzip3_idle_unregister(struct extbzip3_idle *idle);
+VALUE extbzip3_idle_call(struct extbzip3_idle *idle, VALUE (*func)(VALUE), VALUE arg);
+int extbzip3_idle_trim(struct extbzip3_idle *idle);
+size_t extbzip3_idle_trim_expired(void);
+
+#define EXTBZIP3_THREADS_MAX 256
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+/*
+ * プロセス全体で共有する実行器 (extbzip3_executor.c)
+ */
+
+/*
+ * fork の前に実行器が取得するミューテックスです (extbzip3_lock_init で登録します)。
+ *
+ * ワーカースレッドが短い間だけ持つロック (仕事、プール、BlockCache など) に使い、
+ * fork した瞬間に他のスレッドが持っていたために、子プロセスで解放されなくなることを防ぎます。
+ * cond は子プロセスで初期化し直す、mutex と組で使う条件変数です (NULL 可)。
+ * atfork_child は子プロセスでロックを解放した後に呼ばれます (NULL 可、extbzip3_lock_init の後で設定します)。
+ */
+struct extbzip3_lock
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t *cond;
+    void (*atfork_child)(struct extbzip3_lock *lock);
+    struct extbzip3_lock *prev;
+    struct extbzip3_lock *next;
+};
+
+void extbzip3_lock_init(struct extbzip3_lock *lock, pthread_cond_t *cond);
+void extbzip3_lock_destroy(struct extbzip3_lock *lock);
+
+struct extbzip3_task
+{
+    struct extbzip3_task *next;
+    void *(*func)(void *arg);
+    void *arg;
+    void *ret;
+    int done;
+    int detached;               /* 真の場合、実行器は func を呼び出した後で task に触れません */
+    void (*cancel)(void *arg);  /* 実行されずに待ち行列から取り除かれた場合に呼び出されます (NULL 可) */
+    pthread_cond_t *cond;       /* 完了を知らせる条件変数 (extbzip3_executor_call が使います) */
+};
+
+/*
+ * 呼び出し側ごとの仕事の待ち行列です。実行器はこの単位で順番に仕事を取り出します。
+ * extbzip3_queue_init 以外のメンバーは実行器が管理します。
+ */
+struct extbzip3_queue
+{
+    struct extbzip3_task *head;
+    struct extbzip3_task *tail;
+    struct extbzip3_queue *next;
+    size_t count;
+    size_t capacity;            /* 0 は無制限で、実行器の queue_depth にも含まれません */
+    int running;
+    int limit;                  /* 同時に実行する仕事の上限 */
+    int linked;
+    int closed;
+    unsigned long generation;
+    void (*orphan)(struct extbzip3_queue *q);   /* extbzip3_queue_abandon を参照 */
+};
+
+void extbzip3_executor_prepare(void);
+unsigned long extbzip3_executor_generation(void);
+void *extbzip3_executor_call(void *(*func)(void *), void *arg, rb_unblock_function_t *ubf, void *ubfarg);
+void extbzip3_queue_init(struct extbzip3_queue *q, int limit, size_t capacity);
+int extbzip3_queue_push(struct extbzip3_queue *q, struct extbzip3_task *task, const int *interrupted);
+void extbzip3_queue_interrupt(int *interrupted);
+void extbzip3_queue_close(struct extbzip3_queue *q);
+void extbzip3_queue_abandon(struct extbzip3_queue *q, void (*orphan)(struct extbzip3_queue *q));
+
+# define aux_call_without_gvl(func, arg) extbzip3_executor_call((func), (arg), NULL, NULL)
+# define aux_call_without_gvl_ubf(func, arg, ubf, ubfarg) extbzip3_executor_call((func), (arg), (ubf), (ubfarg))
+#else
+# define aux_call_without_gvl(func, arg) rb_thread_call_without_gvl((func), (arg), NULL, NULL)
+# define aux_call_without_gvl_ubf(func, arg, ubf, ubfarg) rb_thread_call_without_gvl((func), (arg), (ubf), (ubfarg))
+#endif // EXTBZIP3_POOL_SUPPORT
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+/*
+ * 共有の実行器の上で、作業領域を持ち回りで使ってブロックを処理します (extbzip3_pool.c)
+ */
+
+enum {
+    EXTBZIP3_JOB_ENCODE = 1,    /* buf をその場で圧縮します */
+    EXTBZIP3_JOB_DECODE = 2,    /* buf をその場で伸長します */
+    EXTBZIP3_JOB_VERIFY = 3,    /* src をワーカーの作業領域へ伸長し、結果を捨てます */
+};
+
+struct extbzip3_pool;
+struct extbzip3_job;
+
+struct extbzip3_job *extbzip3_job_new(int type, const void *src, size_t len, size_t bufsize, size_t origsize);
+struct extbzip3_job *extbzip3_job_new_ref(int type, const void *src, size_t len, size_t origsize);
+void extbzip3_job_release(struct extbzip3_job *job);
+int extbzip3_job_done_p(struct extbzip3_job *job);
+int32_t extbzip3_job_wait(struct extbzip3_job *job);
+int32_t extbzip3_job_join(struct extbzip3_job *job);
+uint8_t *extbzip3_job_buffer(struct extbzip3_job *job);
+const uint8_t *extbzip3_job_result(struct extbzip3_job *job);
+
+struct extbzip3_pool *extbzip3_pool_new(uint32_t blocksize, int nthreads, size_t capacity);
+void extbzip3_pool_push(struct extbzip3_pool *pool, struct extbzip3_job *job);
+void extbzip3_pool_shutdown(struct extbzip3_pool *pool);
+void extbzip3_pool_free(struct extbzip3_pool *pool);
+void extbzip3_pool_discard(struct extbzip3_pool *pool);
+size_t extbzip3_pool_memsize(const struct extbzip3_pool *pool);
+uint32_t extbzip3_pool_blocksize(const struct extbzip3_pool *pool);
+int extbzip3_pool_threads(const struct extbzip3_pool *pool);
+int extbzip3_pool_closed_p(const struct extbzip3_pool *pool);
+int extbzip3_default_threads(void);
+#endif // EXTBZIP3_POOL_SUPPORT
+
+/*
+ * 処理される前に取り消された仕事の結果です (libbzip3 の BZ3_ERR_* とは重なりません)。
+ */
+#define EXTBZIP3_ERR_CANCELED (-64)
+
+static inline const char *
+aux_bz3_error_name(int status)
+{
+    switch (status) {
+    case EXTBZIP3_ERR_CANCELED:
+        return "EXTBZIP3_ERR_CANCELED";
+    case BZ3_ERR_OUT_OF_BOUNDS:
+        return "BZ3_ERR_OUT_OF_BOUNDS";
+    case BZ3_ERR_BWT:
+        return "BZ3_ERR_BWT";
+    case BZ3_ERR_CRC:
+        return "BZ3_ERR_CRC";
+    case BZ3_ERR_MALFORMED_HEADER:
+        return "BZ3_ERR_MALFORMED_HEADER";
+    case BZ3_ERR_TRUNCATED_DATA:
+        return "BZ3_ERR_TRUNCATED_DATA";
+    case BZ3_ERR_DATA_TOO_BIG:
+        return "BZ3_ERR_DATA_TOO_BIG";
+    case BZ3_ERR_INIT:
+        return "BZ3_ERR_INIT";
+    default:
+        return NULL;
+    }
+}
 
 static inline void
 extbzip3_check_error(int status)
 {
     if (status < BZ3_OK) {
-        switch (status) {
-        case BZ3_ERR_OUT_OF_BOUNDS:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_OUT_OF_BOUNDS");
-        case BZ3_ERR_BWT:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_BWT");
-        case BZ3_ERR_CRC:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_CRC");
-        case BZ3_ERR_MALFORMED_HEADER:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_MALFORMED_HEADER");
-        case BZ3_ERR_TRUNCATED_DATA:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_TRUNCATED_DATA");
-        case BZ3_ERR_DATA_TOO_BIG:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_DATA_TOO_BIG");
-        case BZ3_ERR_INIT:
-            rb_raise(rb_eRuntimeError, "%s", "BZ3_ERR_INIT");
-        default:
+        const char *name = aux_bz3_error_name(status);
+
+        if (name) {
+            rb_raise(rb_eRuntimeError, "%s", name);
+        } else {
             rb_raise(rb_eRuntimeError, "unknown error (code: %d)", status);
         }
     }
@@ -153,8 +375,22 @@ aux_conv_to_format(VALUE o)
     }
 }
 
+/*
+ * bz3_new が確保する作業領域の大きさの概算です。
+ *
+ * 入出力の交換領域 (bz3_bound) と SAIS 用の int32_t 配列、LZP 辞書、文脈モデルの状態からなります。
+ */
+static inline size_t
+aux_bz3_footprint(uint32_t blocksize)
+{
+    return bz3_bound(blocksize) + (size_t)blocksize * 4 + (5 << 18);
+}
+
+/*
+ * 予算を確保済みの前提で bz3_state を確保します。失敗した場合は予算を返却してから例外を発生させます。
+ */
 static inline struct bz3_state *
-aux_bz3_new(uint32_t blocksize)
+aux_bz3_new_reserved(uint32_t blocksize)
 {
     struct bz3_state *p = bz3_new(blocksize);
 
@@ -163,6 +399,7 @@ aux_bz3_new(uint32_t blocksize)
         p = bz3_new(blocksize);
 
         if (!p) {
+            extbzip3_memory_release(aux_bz3_footprint(blocksize));
             rb_raise(rb_eNoMemError, "probabry out of memory");
         }
     }
@@ -170,6 +407,46 @@ aux_bz3_new(uint32_t blocksize)
     return p;
 }
 
+static inline struct bz3_state *
+aux_bz3_new(uint32_t blocksize)
+{
+    extbzip3_memory_acquire(aux_bz3_footprint(blocksize));
+
+    return aux_bz3_new_reserved(blocksize);
+}
+
+/*
+ * aux_bz3_new と同じですが、メモリの予算が足りない場合はブロックサイズを半分ずつ小さくして確保を試みます。
+ * どの大きさでも足りなければ、最小のブロックサイズで予算に空きが出来るのを待ちます。
+ * 確保できたブロックサイズを *blocksize に格納します。
+ *
+ * ブロックサイズを呼び出し側が自由に決められる場合 (圧縮) にだけ使えます。
+ */
+static inline struct bz3_state *
+aux_bz3_new_shrinkable(uint32_t *blocksize)
+{
+    for (uint32_t size = *blocksize; size > AUX_BZIP3_BLOCKSIZE_MIN; size /= 2) {
+        if (extbzip3_memory_reserve(aux_bz3_footprint(size))) {
+            *blocksize = size;
+
+            return aux_bz3_new_reserved(size);
+        }
+    }
+
+    *blocksize = AUX_BZIP3_BLOCKSIZE_MIN;
+
+    return aux_bz3_new(*blocksize);
+}
+
+static inline void
+aux_bz3_free(struct bz3_state *bz3, uint32_t blocksize)
+{
+    if (bz3) {
+        bz3_free(bz3);
+        extbzip3_memory_release(aux_bz3_footprint(blocksize));
+    }
+}
+
 static inline uint32_t
 aux_conv_to_blocksize(VALUE obj)
 {
@@ -189,6 +466,27 @@ aux_conv_to_blocksize(VALUE obj)
     }
 }
 
+static inline int
+aux_conv_to_threads(VALUE obj)
+{
+    if (RB_NIL_OR_UNDEF_P(obj)) {
+#ifdef EXTBZIP3_POOL_SUPPORT
+        return extbzip3_default_threads();
+#else
+        return 1;
+#endif
+    } else {
+        int threads = NUM2INT(obj);
+
+        if (threads < 1 || threads > EXTBZIP3_THREADS_MAX) {
+            rb_raise(rb_eArgError, "out of range for threads (expect 1..%d, but given %d)",
+                     EXTBZIP3_THREADS_MAX, threads);
+        }
+
+        return threads;
+    }
+}
+
 static inline VALUE
 aux_str_new_recycle(VALUE str, size_t capa)
 {
@@ -203,6 +501,216 @@ aux_str_new_recycle(VALUE str, size_t capa)
     return str;
 }
 
+/*
+ * 作業用の文字列を空にして、確保している領域を手放します。
+ */
+static inline VALUE
+aux_str_release(VALUE str)
+{
+    if (rb_type_p(str, RUBY_T_STRING)) {
+        rb_str_resize(str, 0);
+    }
+
+    return str;
+}
+
+static inline int
+aux_io_buffer_p(VALUE obj)
+{
+#ifdef AUX_IO_BUFFER_SUPPORT
+    return RTEST(rb_obj_is_kind_of(obj, rb_cIOBuffer));
+#else
+    return 0;
+#endif
+}
+
+RBEXT_NORETURN static void
+aux_raise_not_string_or_buffer(VALUE obj)
+{
+    rb_raise(rb_eTypeError, "wrong argument type %" PRIsVALUE " (expected String or IO::Buffer)",
+             rb_obj_class(obj));
+}
+
+/*
+ * String または IO::Buffer から読み込み用のメモリ領域を取り出します。
+ */
+static inline void
+aux_src_bytes(VALUE src, const char **ptr, size_t *len)
+{
+    if (rb_type_p(src, RUBY_T_STRING)) {
+        *ptr = RSTRING_PTR(src);
+        *len = RSTRING_LEN(src);
+#ifdef AUX_IO_BUFFER_SUPPORT
+    } else if (aux_io_buffer_p(src)) {
+        const void *base;
+        rb_io_buffer_get_bytes_for_reading(src, &base, len);
+        *ptr = (const char *)base;
+#endif
+    } else {
+        aux_raise_not_string_or_buffer(src);
+    }
+}
+
+static inline void
+aux_check_dest(VALUE dest)
+{
+    if (!rb_type_p(dest, RUBY_T_STRING) && !aux_io_buffer_p(dest)) {
+        aux_raise_not_string_or_buffer(dest);
+    }
+}
+
+/*
+ * String または IO::Buffer を書き込み先として準備します。
+ *
+ * String の場合は capa バイトを確保します。
+ * IO::Buffer の場合は大きさを変えず、capa をバッファの大きさに制限します。
+ */
+static inline char *
+aux_dest_prepare(VALUE dest, size_t *capa)
+{
+    if (rb_type_p(dest, RUBY_T_STRING)) {
+        rb_str_modify(dest);
+        rb_str_set_len(dest, 0);
+        rb_str_modify_expand(dest, *capa);
+
+        return RSTRING_PTR(dest);
+#ifdef AUX_IO_BUFFER_SUPPORT
+    } else if (aux_io_buffer_p(dest)) {
+        void *base;
+        size_t size;
+        rb_io_buffer_get_bytes_for_writing(dest, &base, &size);
+
+        if (*capa > size) {
+            *capa = size;
+        }
+
+        return (char *)base;
+#endif
+    } else {
+        aux_raise_not_string_or_buffer(dest);
+    }
+}
+
+/*
+ * 書き込み先を len バイトで確定します。
+ *
+ * IO::Buffer の場合は書き込んだ範囲のスライスを返します。
+ */
+static inline VALUE
+aux_dest_finish(VALUE dest, size_t len)
+{
+    if (rb_type_p(dest, RUBY_T_STRING)) {
+        rb_str_set_len(dest, len);
+
+        return dest;
+    } else {
+        VALUE args[2] = { INT2FIX(0), SIZET2NUM(len) };
+
+        return rb_funcallv(dest, rb_intern("slice"), 2, args);
+    }
+}
+
+struct aux_io_buffer_locked_call
+{
+    VALUE bufs[2];
+    int numlocked;
+    VALUE (*func)(VALUE);
+    VALUE arg;
+};
+
+static inline VALUE
+aux_io_buffer_locked_call_main(VALUE arg)
+{
+    struct aux_io_buffer_locked_call *p = (struct aux_io_buffer_locked_call *)arg;
+
+#ifdef AUX_IO_BUFFER_SUPPORT
+    for (; p->numlocked < 2 && !RB_NIL_P(p->bufs[p->numlocked]); p->numlocked++) {
+        rb_io_buffer_lock(p->bufs[p->numlocked]);
+    }
+#endif
+
+    return p->func(p->arg);
+}
+
+static inline VALUE
+aux_io_buffer_locked_call_ensure(VALUE arg)
+{
+    struct aux_io_buffer_locked_call *p = (struct aux_io_buffer_locked_call *)arg;
+
+#ifdef AUX_IO_BUFFER_SUPPORT
+    while (p->numlocked > 0) {
+        rb_io_buffer_unlock(p->bufs[--p->numlocked]);
+    }
+#endif
+
+    return Qnil;
+}
+
+/*
+ * obj1 と obj2 のうち IO::Buffer であるものをロックしてから func を呼び出します。
+ *
+ * GVL を手放している間に IO::Buffer が解放されたり大きさが変わったりしないようにします。
+ */
+static inline VALUE
+aux_io_buffer_locked_call(VALUE obj1, VALUE obj2, VALUE (*func)(VALUE), VALUE arg)
+{
+    struct aux_io_buffer_locked_call locks = { { Qnil, Qnil }, 0, func, arg };
+    int n = 0;
+
+    if (aux_io_buffer_p(obj1)) {
+        locks.bufs[n++] = obj1;
+    }
+
+    if (obj2 != obj1 && aux_io_buffer_p(obj2)) {
+        locks.bufs[n++] = obj2;
+    }
+
+    if (n == 0) {
+        return func(arg);
+    }
+
+    return rb_ensure(aux_io_buffer_locked_call_main, (VALUE)&locks,
+                     aux_io_buffer_locked_call_ensure, (VALUE)&locks);
+}
+
+/*
+ * GVL を手放して読み込む String を、共有の凍結した複製に置き換えます。
+ * 元の String が他のスレッドから書き換えられても、複製の内容はそのまま残ります (内容の複写は通常行われません)。
+ */
+static inline VALUE
+aux_str_pin(VALUE str)
+{
+    if (rb_type_p(str, RUBY_T_STRING) && !RB_OBJ_FROZEN(str)) {
+        return rb_str_new_frozen(str);
+    }
+
+    return str;
+}
+
+static inline VALUE
+aux_str_locked_call_ensure(VALUE str)
+{
+    rb_str_unlocktmp(str);
+
+    return Qnil;
+}
+
+/*
+ * str が String の場合は、func を呼び出している間だけ書き換えをロックします。
+ * GVL を手放して直接書き込んでいる間に、他のスレッドが大きさを変えたりしないようにします。
+ */
+static inline VALUE
+aux_str_locked_call(VALUE str, VALUE (*func)(VALUE), VALUE arg)
+{
+    if (!rb_type_p(str, RUBY_T_STRING)) {
+        return func(arg);
+    }
+
+    rb_str_locktmp(str);
+
+    return rb_ensure(func, arg, aux_str_locked_call_ensure, str);
+}
+
 static inline uint32_t
 loadu32le(const void *buf)
 {
@@ -225,6 +733,131 @@ storeu32le(void *buf, uint32_t n)
     p[3] = (n >> 24) & 0xff;
 }
 
+/*
+ * ストリームヘッダ (シグネチャ、ブロックサイズ、フレーム形式の場合はブロック数) を調べます。
+ * len は読み込めたヘッダの長さです。
+ *
+ * 正しければ 0 を、len が 0 (入力の終端) なら 1 を、異常があれば BZ3_ERR_MALFORMED_HEADER を返します。
+ */
+static inline int
+aux_bzip3_check_stream_header(const void *header, size_t len, int format, uint32_t *blocksize, uint32_t *blockcount)
+{
+    const char *p = (const char *)header;
+    size_t headersize = (format == AUX_BZIP3_V1_FRAME_FORMAT ? 13 : 9);
+
+    if (len == 0) {
+        return 1;
+    }
+
+    if (len < headersize || memcmp(p, aux_bzip3_signature, 5) != 0) {
+        return BZ3_ERR_MALFORMED_HEADER;
+    }
+
+    *blocksize = loadu32le(p + 5);
+    if (*blocksize < AUX_BZIP3_BLOCKSIZE_MIN || *blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
+        return BZ3_ERR_MALFORMED_HEADER;
+    }
+
+    if (blockcount) {
+        *blockcount = (format == AUX_BZIP3_V1_FRAME_FORMAT ? loadu32le(p + 9) : 0);
+    }
+
+    return 0;
+}
+
+/*
+ * ブロックサイズ blocksize のストリームのブロックヘッダとして、packedsize と originsize が正しいかを返します。
+ */
+static inline int
+aux_bzip3_block_header_p(uint32_t packedsize, uint32_t originsize, uint32_t blocksize)
+{
+    return originsize <= blocksize && packedsize <= bz3_bound(originsize) && packedsize >= 8;
+}
+
+/*
+ * String、IO::Buffer または `read(size, buf)` に応答するオブジェクトから順に読み込みます。
+ *
+ * ptr が NULL でなければ、ptr と len が指すメモリから読み込みます。
+ * そうでなければ src の `read` を呼び出し、readbuf へ読み込みます (tmpbuf は `read` に渡す作業用の文字列です)。
+ */
+struct aux_reader
+{
+    VALUE src;
+    const char *ptr;            /* String または IO::Buffer の場合 */
+    size_t len;
+    VALUE readbuf;              /* IO の場合 */
+    VALUE tmpbuf;
+    uint64_t offset;
+};
+
+/*
+ * 入力から size バイトを読み込み、その先頭を *ptr に格納します。
+ * 戻り値は実際に読み込めたバイト数です。
+ */
+static inline size_t
+aux_reader_read(struct aux_reader *r, size_t size, const char **ptr)
+{
+    size_t n;
+
+    if (r->ptr) {
+        n = r->len - (size_t)r->offset;
+        if (n > size) {
+            n = size;
+        }
+
+        *ptr = r->ptr + r->offset;
+    } else {
+        rb_str_set_len(r->readbuf, 0);
+
+        while ((size_t)RSTRING_LEN(r->readbuf) < size) {
+            VALUE args[2] = { SIZET2NUM(size - RSTRING_LEN(r->readbuf)), r->tmpbuf };
+            VALUE ret = rb_funcallv(r->src, rb_intern("read"), 2, args);
+
+            if (RB_NIL_P(ret)) {
+                break;
+            }
+
+            rb_check_type(ret, RUBY_T_STRING);
+            size_t len = RSTRING_LEN(ret);
+            if (len == 0) {
+                break;
+            } else if (len > size - (size_t)RSTRING_LEN(r->readbuf)) {
+                rb_raise(rb_eRuntimeError, "read too much - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(r->src), r->src);
+            }
+
+            rb_str_cat(r->readbuf, RSTRING_PTR(ret), RSTRING_LEN(ret));
+        }
+
+        n = RSTRING_LEN(r->readbuf);
+        *ptr = RSTRING_PTR(r->readbuf);
+    }
+
+    r->offset += n;
+
+    return n;
+}
+
+/*
+ * ストリームヘッダを読み込み、aux_bzip3_check_stream_header で調べます。
+ * pre には、ブロックヘッダとして先に読み込んでいたヘッダの先頭 prelen バイト (8 バイト以下) を与えます。
+ */
+static inline int
+aux_reader_read_header(struct aux_reader *r, int format, const char *pre, size_t prelen, uint32_t *blocksize, uint32_t *blockcount)
+{
+    size_t headersize = (format == AUX_BZIP3_V1_FRAME_FORMAT ? 13 : 9);
+    char header[13];
+    const char *ptr;
+
+    if (prelen > 0) {
+        memcpy(header, pre, prelen);
+    }
+
+    size_t n = aux_reader_read(r, headersize - prelen, &ptr);
+    memcpy(header + prelen, ptr, n);
+
+    return aux_bzip3_check_stream_header(header, prelen + n, format, blocksize, blockcount);
+}
+
 struct aux_bz3_decode_block_nogvl_main
 {
     struct bz3_state *bz3;
@@ -248,7 +881,7 @@ aux_bz3_decode_block_nogvl(struct bz3_state *bz3, void *buf, size_t buflen, size
     }
 
     struct aux_bz3_decode_block_nogvl_main args = { bz3, (uint8_t *)buf, (int32_t)buflen, (int32_t)originsize };
-    return (int32_t)(intptr_t)rb_thread_call_without_gvl(aux_bz3_decode_block_nogvl_main, &args, NULL, NULL);
+    return (int32_t)(intptr_t)aux_call_without_gvl(aux_bz3_decode_block_nogvl_main, &args);
 }
 
 struct aux_bz3_encode_block_nogvl_main
@@ -265,6 +898,19 @@ aux_bz3_encode_block_nogvl_main(void *opaque)
     return (void *)(intptr_t)bz3_encode_block(p->bz3, p->buf, p->buflen);
 }
 
+/*
+ * GVL を手放した状態から呼び出すための、aux_bz3_encode_block_nogvl と同じ圧縮処理です。
+ */
+static inline int32_t
+aux_bz3_encode_block_raw(struct bz3_state *bz3, void *buf, size_t buflen)
+{
+    if (buflen > INT32_MAX) {
+        return BZ3_ERR_DATA_TOO_BIG;
+    }
+
+    return bz3_encode_block(bz3, (uint8_t *)buf, (int32_t)buflen);
+}
+
 static inline int32_t
 aux_bz3_encode_block_nogvl(struct bz3_state *bz3, void *buf, size_t buflen)
 {
@@ -273,7 +919,112 @@ aux_bz3_encode_block_nogvl(struct bz3_state *bz3, void *buf, size_t buflen)
     }
 
     struct aux_bz3_encode_block_nogvl_main args = { bz3, (uint8_t *)buf, (int32_t)buflen };
-    return (int32_t)(intptr_t)rb_thread_call_without_gvl(aux_bz3_encode_block_nogvl_main, &args, NULL, NULL);
+    return (int32_t)(intptr_t)aux_call_without_gvl(aux_bz3_encode_block_nogvl_main, &args);
+}
+
+/*
+ * cache にあればそれを使う aux_bz3_encode_block_raw です。cache が NULL の場合はそのまま圧縮します。
+ *
+ * buf は bz3_bound(buflen) バイト以上の大きさが必要です。
+ */
+static inline int32_t
+aux_bz3_encode_block_cached(struct extbzip3_cache *cache, uint32_t blocksize, struct bz3_state *bz3, void *buf, size_t buflen)
+{
+    if (cache == NULL || buflen < EXTBZIP3_CACHE_MIN_BLOCK || buflen > INT32_MAX) {
+        return aux_bz3_encode_block_raw(bz3, buf, buflen);
+    }
+
+    struct extbzip3_cache_key key;
+    extbzip3_cache_key(&key, EXTBZIP3_CACHE_ENCODED, blocksize, buf, buflen);
+
+    int32_t ret = extbzip3_cache_fetch(cache, &key, buf, bz3_bound(buflen));
+    if (ret >= 0) {
+        return ret;
+    }
+
+    ret = bz3_encode_block(bz3, (uint8_t *)buf, (int32_t)buflen);
+    if (ret >= 0) {
+        extbzip3_cache_store(cache, &key, buf, ret);
+    }
+
+    return ret;
+}
+
+/*
+ * cache にあればそれを使う bz3_decode_block です。cache が NULL の場合はそのまま伸長します。
+ *
+ * buf は originsize バイト以上の大きさが必要です。
+ */
+static inline int32_t
+aux_bz3_decode_block_cached(struct extbzip3_cache *cache, struct bz3_state *bz3, void *buf, size_t buflen, size_t originsize)
+{
+    if (cache == NULL || buflen < EXTBZIP3_CACHE_MIN_BLOCK || buflen > INT32_MAX || originsize > INT32_MAX) {
+        return bz3_decode_block(bz3, (uint8_t *)buf, (int32_t)buflen, (int32_t)originsize);
+    }
+
+    struct extbzip3_cache_key key;
+    extbzip3_cache_key(&key, EXTBZIP3_CACHE_DECODED, (uint32_t)originsize, buf, buflen);
+
+    int32_t ret = extbzip3_cache_fetch(cache, &key, buf, originsize);
+    if (ret >= 0) {
+        return ret;
+    }
+
+    ret = bz3_decode_block(bz3, (uint8_t *)buf, (int32_t)buflen, (int32_t)originsize);
+    if (ret >= 0) {
+        extbzip3_cache_store(cache, &key, buf, ret);
+    }
+
+    return ret;
+}
+
+struct aux_bz3_cached_block_nogvl_main
+{
+    struct extbzip3_cache *cache;
+    struct bz3_state *bz3;
+    void *buf;
+    size_t buflen;
+    uint32_t param;             /* 圧縮ではブロックサイズ、伸長では伸長後の大きさ */
+};
+
+static inline void *
+aux_bz3_encode_block_cached_nogvl_main(void *opaque)
+{
+    struct aux_bz3_cached_block_nogvl_main *p = (struct aux_bz3_cached_block_nogvl_main *)opaque;
+    return (void *)(intptr_t)aux_bz3_encode_block_cached(p->cache, p->param, p->bz3, p->buf, p->buflen);
+}
+
+static inline void *
+aux_bz3_decode_block_cached_nogvl_main(void *opaque)
+{
+    struct aux_bz3_cached_block_nogvl_main *p = (struct aux_bz3_cached_block_nogvl_main *)opaque;
+    return (void *)(intptr_t)aux_bz3_decode_block_cached(p->cache, p->bz3, p->buf, p->buflen, p->param);
+}
+
+static inline int32_t
+aux_bz3_encode_block_cached_nogvl(struct extbzip3_cache *cache, uint32_t blocksize, struct bz3_state *bz3, void *buf, size_t buflen)
+{
+    if (cache == NULL) {
+        return aux_bz3_encode_block_nogvl(bz3, buf, buflen);
+    }
+
+    struct aux_bz3_cached_block_nogvl_main args = { cache, bz3, buf, buflen, blocksize };
+    return (int32_t)(intptr_t)aux_call_without_gvl(aux_bz3_encode_block_cached_nogvl_main, &args);
+}
+
+static inline int32_t
+aux_bz3_decode_block_cached_nogvl(struct extbzip3_cache *cache, struct bz3_state *bz3, void *buf, size_t buflen, size_t originsize)
+{
+    if (cache == NULL) {
+        return aux_bz3_decode_block_nogvl(bz3, buf, buflen, originsize);
+    }
+
+    if (buflen > INT32_MAX || originsize > INT32_MAX) {
+        return BZ3_ERR_DATA_TOO_BIG;
+    }
+
+    struct aux_bz3_cached_block_nogvl_main args = { cache, bz3, buf, buflen, (uint32_t)originsize };
+    return (int32_t)(intptr_t)aux_call_without_gvl(aux_bz3_decode_block_cached_nogvl_main, &args);
 }
 
 #endif // EXTBZIP3_H
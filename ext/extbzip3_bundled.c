@@ -0,0 +1,139 @@
+#include "extbzip3.h"
+
+/*
+ * 同梱した libbzip3 の実行時の切り替えです。
+ *
+ * --with-bundled-bzip3 で AVX2 向けのビルドも作った場合 (EXTBZIP3_BZ3_DISPATCH)、
+ * 最初の呼び出しで CPU を調べて、基準のビルドと AVX2 向けのビルドのどちらかを選びます。
+ * bz3_state は選んだビルドの関数にだけ渡されるため、途中で切り替わることはありません。
+ */
+
+#if defined(EXTBZIP3_BUNDLED_BZIP3) && defined(EXTBZIP3_BZ3_DISPATCH)
+
+#define BUNDLED_DECLARE(P)                                                                      \
+        const char *P ## _bz3_version(void);                                                    \
+        int8_t P ## _bz3_last_error(struct bz3_state *state);                                   \
+        const char *P ## _bz3_strerror(struct bz3_state *state);                                \
+        struct bz3_state *P ## _bz3_new(int32_t block_size);                                    \
+        void P ## _bz3_free(struct bz3_state *state);                                           \
+        size_t P ## _bz3_bound(size_t input_size);                                              \
+        int32_t P ## _bz3_encode_block(struct bz3_state *state, uint8_t *buffer, int32_t size); \
+        int32_t P ## _bz3_decode_block(struct bz3_state *state, uint8_t *buffer, int32_t size, int32_t orig_size); \
+
+BUNDLED_DECLARE(extbzip3_base)
+BUNDLED_DECLARE(extbzip3_avx2)
+
+struct bundled_impl
+{
+    const char *name;
+    const char *(*version)(void);
+    int8_t (*last_error)(struct bz3_state *state);
+    const char *(*strerror)(struct bz3_state *state);
+    struct bz3_state *(*new_state)(int32_t block_size);
+    void (*free_state)(struct bz3_state *state);
+    size_t (*bound)(size_t input_size);
+    int32_t (*encode_block)(struct bz3_state *state, uint8_t *buffer, int32_t size);
+    int32_t (*decode_block)(struct bz3_state *state, uint8_t *buffer, int32_t size, int32_t orig_size);
+};
+
+#define BUNDLED_IMPL(NAME, P)                                                   \
+        {                                                                       \
+            NAME,                                                               \
+            P ## _bz3_version, P ## _bz3_last_error, P ## _bz3_strerror,        \
+            P ## _bz3_new, P ## _bz3_free, P ## _bz3_bound,                     \
+            P ## _bz3_encode_block, P ## _bz3_decode_block,                     \
+        }                                                                       \
+
+static const struct bundled_impl bundled_base = BUNDLED_IMPL("bundled", extbzip3_base);
+static const struct bundled_impl bundled_avx2 = BUNDLED_IMPL("bundled-avx2", extbzip3_avx2);
+static const struct bundled_impl *bundled_current;
+
+static const struct bundled_impl *
+bundled_select(void)
+{
+    const struct bundled_impl *impl = __atomic_load_n(&bundled_current, __ATOMIC_ACQUIRE);
+
+    if (impl == NULL) {
+        const char *e = getenv("RUBY_EXTBZIP3_DISABLE_AVX2");
+
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && !(e && strtol(e, NULL, 10) > 0)) {
+            impl = &bundled_avx2;
+        } else {
+            impl = &bundled_base;
+        }
+
+        __atomic_store_n(&bundled_current, impl, __ATOMIC_RELEASE);
+    }
+
+    return impl;
+}
+
+const char *
+bz3_version(void)
+{
+    return bundled_select()->version();
+}
+
+int8_t
+bz3_last_error(struct bz3_state *state)
+{
+    return bundled_select()->last_error(state);
+}
+
+const char *
+bz3_strerror(struct bz3_state *state)
+{
+    return bundled_select()->strerror(state);
+}
+
+struct bz3_state *
+bz3_new(int32_t block_size)
+{
+    return bundled_select()->new_state(block_size);
+}
+
+void
+bz3_free(struct bz3_state *state)
+{
+    bundled_select()->free_state(state);
+}
+
+size_t
+bz3_bound(size_t input_size)
+{
+    return bundled_select()->bound(input_size);
+}
+
+int32_t
+bz3_encode_block(struct bz3_state *state, uint8_t *buffer, int32_t size)
+{
+    return bundled_select()->encode_block(state, buffer, size);
+}
+
+int32_t
+bz3_decode_block(struct bz3_state *state, uint8_t *buffer, int32_t size, int32_t orig_size)
+{
+    return bundled_select()->decode_block(state, buffer, size, orig_size);
+}
+
+# define BUNDLED_BUILD (bundled_select()->name)
+#elif defined(EXTBZIP3_BUNDLED_BZIP3)
+# define BUNDLED_BUILD "bundled"
+#else
+# define BUNDLED_BUILD "system"
+#endif
+
+void
+extbzip3_init_bundled(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    /*
+     * 使用している libbzip3 のビルドです。
+     *
+     * "system" はシステムのライブラリを、"bundled" は同梱したソースからのビルドを、
+     * "bundled-avx2" は同梱したソースからの AVX2 向けのビルドを実行時に選んだことを表します。
+     */
+    rb_define_const(bzip3_module, "LIBRARY_BUILD", rb_obj_freeze(rb_str_new_cstr(BUNDLED_BUILD)));
+}
@@ -0,0 +1,30 @@
+#ifndef EXTBZIP3_BUNDLED_H
+#define EXTBZIP3_BUNDLED_H 1
+
+/*
+ * 同梱した libbzip3 を異なる最適化で複数回コンパイルするために、公開関数の名前を付け替えます。
+ *
+ * 取り込む前に EXTBZIP3_BZ3_PREFIX を定義してください。
+ * 例えば extbzip3_avx2 とすると bz3_new は extbzip3_avx2_bz3_new になります。
+ */
+
+#define EXTBZIP3_BZ3_NAME(N)            EXTBZIP3_BZ3_NAME_1(EXTBZIP3_BZ3_PREFIX, N)
+#define EXTBZIP3_BZ3_NAME_1(P, N)       EXTBZIP3_BZ3_NAME_2(P, N)
+#define EXTBZIP3_BZ3_NAME_2(P, N)       P ## _ ## N
+
+#define bz3_version                             EXTBZIP3_BZ3_NAME(bz3_version)
+#define bz3_last_error                          EXTBZIP3_BZ3_NAME(bz3_last_error)
+#define bz3_strerror                            EXTBZIP3_BZ3_NAME(bz3_strerror)
+#define bz3_new                                 EXTBZIP3_BZ3_NAME(bz3_new)
+#define bz3_free                                EXTBZIP3_BZ3_NAME(bz3_free)
+#define bz3_bound                               EXTBZIP3_BZ3_NAME(bz3_bound)
+#define bz3_compress                            EXTBZIP3_BZ3_NAME(bz3_compress)
+#define bz3_decompress                          EXTBZIP3_BZ3_NAME(bz3_decompress)
+#define bz3_min_memory_needed                   EXTBZIP3_BZ3_NAME(bz3_min_memory_needed)
+#define bz3_encode_block                        EXTBZIP3_BZ3_NAME(bz3_encode_block)
+#define bz3_decode_block                        EXTBZIP3_BZ3_NAME(bz3_decode_block)
+#define bz3_encode_blocks                       EXTBZIP3_BZ3_NAME(bz3_encode_blocks)
+#define bz3_decode_blocks                       EXTBZIP3_BZ3_NAME(bz3_decode_blocks)
+#define bz3_orig_size_sufficient_for_decode     EXTBZIP3_BZ3_NAME(bz3_orig_size_sufficient_for_decode)
+
+#endif // EXTBZIP3_BUNDLED_H
@@ -0,0 +1,17 @@
+/*
+ * 同梱した libbzip3 の AVX2 向けのビルドです。
+ *
+ * extconf.rb はこのファイルだけを -mavx2 -mbmi2 でコンパイルします。
+ * どちらのビルドを使うかは実行時に extbzip3_bundled.c が決めます。
+ */
+
+#include "extconf.h"
+
+#if defined(EXTBZIP3_BUNDLED_BZIP3) && defined(EXTBZIP3_BZ3_DISPATCH)
+# define EXTBZIP3_BZ3_PREFIX extbzip3_avx2
+# include "extbzip3_bundled.h"
+# ifndef VERSION
+#  define VERSION EXTBZIP3_BUNDLED_BZIP3_VERSION
+# endif
+# include "libbz3.c"
+#endif
@@ -0,0 +1,18 @@
+/*
+ * 同梱した libbzip3 の基準となる (CPU 拡張命令を仮定しない) ビルドです。
+ *
+ * extconf.rb に --with-bundled-bzip3 を与えた場合だけ中身があります。
+ */
+
+#include "extconf.h"
+
+#ifdef EXTBZIP3_BUNDLED_BZIP3
+# ifdef EXTBZIP3_BZ3_DISPATCH
+#  define EXTBZIP3_BZ3_PREFIX extbzip3_base
+#  include "extbzip3_bundled.h"
+# endif
+# ifndef VERSION
+#  define VERSION EXTBZIP3_BUNDLED_BZIP3_VERSION
+# endif
+# include "libbz3.c"
+#endif
@@ -0,0 +1,593 @@
+#include "extbzip3.h"
+
+/*
+ * Bzip3::BlockCache の実装です。
+ *
+ * ブロックの内容のハッシュ値 (XXH64 と CRC32C) と大きさをキーにして、
+ * 圧縮前のブロックから圧縮後のブロックを、圧縮後のブロックから伸長後のブロックを引けるようにします。
+ * 合計の大きさが capacity を超える場合は、最も長く使われていないものから捨てます。
+ *
+ * 参照と登録は GVL を手放した状態からも行われるため、ロックで保護します。
+ * 値の複写もロックを持ったまま行い、複写中に捨てられないようにします。
+ */
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define CRC32C_SSE42 1
+#endif
+
+static VALUE block_cache_class;
+
+struct cache_entry
+{
+    struct cache_entry *chain;  /* 同じバケットの次の項目 */
+    struct cache_entry *prev;   /* 最近使われた順の双方向リスト */
+    struct cache_entry *next;
+    struct extbzip3_cache_key key;
+    size_t size;
+    char value[];
+};
+
+struct extbzip3_cache
+{
+    struct extbzip3_lock lock;
+    struct cache_entry **buckets;
+    size_t nbuckets;            /* 2 の累乗 */
+    struct cache_entry lru;     /* lru.next が最も最近使われた項目 */
+    size_t count;
+    size_t used;
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#define CACHE_ENTRY_COST(E) (sizeof(struct cache_entry) + (E)->size)
+
+/* XXH64 */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+xxh_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh_read64(const uint8_t *p)
+{
+    return (uint64_t)loadu32le(p) | ((uint64_t)loadu32le(p + 4) << 32);
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t
+xxh64(const void *input, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)input;
+    const uint8_t *const end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const uint8_t *const limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, xxh_read64(p));
+            v2 = xxh64_round(v2, xxh_read64(p + 8));
+            v3 = xxh64_round(v3, xxh_read64(p + 16));
+            v4 = xxh64_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)loadu32le(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* CRC-32C (反転なし) */
+
+static uint32_t crc32c_table[256];
+
+static uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    for (; len > 0; len--, p++) {
+        crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+# ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t n;
+        memcpy(&n, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, n);
+    }
+    crc = (uint32_t)crc64;
+# endif
+
+    for (; len > 0; len--, p++) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+
+    return crc;
+}
+#endif
+
+/*
+ * 利用可能であれば SSE4.2 の crc32 命令を使います。
+ */
+static uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len) = crc32c_sw;
+
+static void
+crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+
+        for (int j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+        }
+
+        crc32c_table[i] = c;
+    }
+
+#ifdef CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32c_sse42;
+    }
+#endif
+}
+
+void
+extbzip3_cache_key(struct extbzip3_cache_key *key, int kind, uint32_t param, const void *buf, size_t len)
+{
+    key->hash = xxh64(buf, len, 0);
+    key->crc = crc32c(0, buf, len);
+    key->size = (uint32_t)len;
+    key->param = param;
+    key->kind = kind;
+}
+
+static inline int
+cache_key_equal(const struct extbzip3_cache_key *a, const struct extbzip3_cache_key *b)
+{
+    return a->hash == b->hash && a->crc == b->crc && a->size == b->size && a->param == b->param && a->kind == b->kind;
+}
+
+static inline void
+cache_lru_unlink(struct cache_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static inline void
+cache_lru_push(struct extbzip3_cache *c, struct cache_entry *e)
+{
+    e->prev = &c->lru;
+    e->next = c->lru.next;
+    c->lru.next->prev = e;
+    c->lru.next = e;
+}
+
+static struct cache_entry **
+cache_find_slot(struct extbzip3_cache *c, const struct extbzip3_cache_key *key)
+{
+    struct cache_entry **slot = &c->buckets[key->hash & (c->nbuckets - 1)];
+
+    for (; *slot; slot = &(*slot)->chain) {
+        if (cache_key_equal(&(*slot)->key, key)) {
+            break;
+        }
+    }
+
+    return slot;
+}
+
+static void
+cache_remove(struct extbzip3_cache *c, struct cache_entry *e)
+{
+    struct cache_entry **slot = cache_find_slot(c, &e->key);
+    *slot = e->chain;
+    cache_lru_unlink(e);
+    c->count--;
+    c->used -= CACHE_ENTRY_COST(e);
+    free(e);
+}
+
+static void
+cache_clear(struct extbzip3_cache *c)
+{
+    while (c->lru.next != &c->lru) {
+        cache_remove(c, c->lru.next);
+    }
+}
+
+static void
+cache_grow(struct extbzip3_cache *c)
+{
+    size_t nbuckets = c->nbuckets * 2;
+    struct cache_entry **buckets = (struct cache_entry **)calloc(nbuckets, sizeof(*buckets));
+
+    if (buckets == NULL) {
+        return; // 連鎖が長くなるだけなので、そのまま続ける
+    }
+
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        struct cache_entry *e = c->buckets[i];
+
+        while (e) {
+            struct cache_entry *chain = e->chain;
+            struct cache_entry **slot = &buckets[e->key.hash & (nbuckets - 1)];
+            e->chain = *slot;
+            *slot = e;
+            e = chain;
+        }
+    }
+
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = nbuckets;
+}
+
+int32_t
+extbzip3_cache_fetch(struct extbzip3_cache *c, const struct extbzip3_cache_key *key, void *dest, size_t destsize)
+{
+    int32_t ret = -1;
+
+    pthread_mutex_lock(&c->lock.mutex);
+
+    struct cache_entry *e = *cache_find_slot(c, key);
+    if (e && e->size <= destsize) {
+        memcpy(dest, e->value, e->size);
+        ret = (int32_t)e->size;
+        cache_lru_unlink(e);
+        cache_lru_push(c, e);
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+
+    pthread_mutex_unlock(&c->lock.mutex);
+
+    return ret;
+}
+
+void
+extbzip3_cache_store(struct extbzip3_cache *c, const struct extbzip3_cache_key *key, const void *value, size_t len)
+{
+    if (sizeof(struct cache_entry) + len > c->capacity) {
+        return;
+    }
+
+    struct cache_entry *e = (struct cache_entry *)malloc(sizeof(struct cache_entry) + len);
+    if (e == NULL) {
+        return;
+    }
+
+    e->chain = NULL;
+    e->key = *key;
+    e->size = len;
+    memcpy(e->value, value, len);
+
+    pthread_mutex_lock(&c->lock.mutex);
+
+    struct cache_entry **slot = cache_find_slot(c, key);
+    if (*slot) {
+        // 他のスレッドが同じブロックを先に登録していた
+        pthread_mutex_unlock(&c->lock.mutex);
+        free(e);
+
+        return;
+    }
+
+    while (c->used + CACHE_ENTRY_COST(e) > c->capacity && c->lru.prev != &c->lru) {
+        cache_remove(c, c->lru.prev);
+    }
+
+    slot = cache_find_slot(c, key);
+    *slot = e;
+    cache_lru_push(c, e);
+    c->count++;
+    c->used += CACHE_ENTRY_COST(e);
+
+    if (c->count > c->nbuckets) {
+        cache_grow(c);
+    }
+
+    pthread_mutex_unlock(&c->lock.mutex);
+}
+
+static void
+block_cache_free(void *ptr)
+{
+    struct extbzip3_cache *c = (struct extbzip3_cache *)ptr;
+
+    if (c->buckets) {
+        cache_clear(c);
+        free(c->buckets);
+        extbzip3_lock_destroy(&c->lock);
+    }
+
+    xfree(c);
+}
+
+static size_t
+block_cache_memsize(const void *ptr)
+{
+    const struct extbzip3_cache *c = (const struct extbzip3_cache *)ptr;
+
+    return sizeof(*c) + c->nbuckets * sizeof(struct cache_entry *) + c->used;
+}
+
+static const rb_data_type_t block_cache_type = {
+    "extbzip3:block_cache",
+    {
+        NULL,
+        block_cache_free,
+        block_cache_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+block_cache_allocate(VALUE mod)
+{
+    return rb_data_typed_object_zalloc(mod, sizeof(struct extbzip3_cache), &block_cache_type);
+}
+
+static struct extbzip3_cache *
+get_block_cache(VALUE obj)
+{
+    struct extbzip3_cache *c = (struct extbzip3_cache *)rb_check_typeddata(obj, &block_cache_type);
+
+    if (!c->buckets) {
+        rb_raise(rb_eTypeError, "wrong initialized object - %" PRIsVALUE, obj);
+    }
+
+    return c;
+}
+
+struct extbzip3_cache *
+extbzip3_get_cache(VALUE obj)
+{
+    if (RB_NIL_OR_UNDEF_P(obj)) {
+        return NULL;
+    }
+
+    return get_block_cache(obj);
+}
+
+/*
+ *  @overload initialize(capacity = (64 << 20))
+ *
+ *  @param  capacity    [Integer]
+ *      保持するブロックの合計の大きさの上限 (バイト数) です。
+ */
+static VALUE
+block_cache_initialize(int argc, VALUE argv[], VALUE self)
+{
+    VALUE capacity;
+    rb_scan_args(argc, argv, "01", &capacity);
+
+    struct extbzip3_cache *c = (struct extbzip3_cache *)rb_check_typeddata(self, &block_cache_type);
+    if (c->buckets) {
+        rb_raise(rb_eTypeError, "wrong re-initializing - %" PRIsVALUE, self);
+    }
+
+    c->capacity = (RB_NIL_P(capacity) ? (64 << 20) : NUM2SIZET(capacity));
+    c->nbuckets = 64;
+    c->buckets = (struct cache_entry **)calloc(c->nbuckets, sizeof(struct cache_entry *));
+    if (c->buckets == NULL) {
+        rb_memerror();
+    }
+
+    c->lru.prev = c->lru.next = &c->lru;
+    extbzip3_lock_init(&c->lock, NULL);
+
+    return self;
+}
+
+static VALUE
+block_cache_capacity(VALUE self)
+{
+    return SIZET2NUM(get_block_cache(self)->capacity);
+}
+
+/*
+ *  @overload bytesize
+ *
+ *  @return [Integer]   保持しているブロックの合計の大きさ (管理領域を含む)
+ */
+static VALUE
+block_cache_bytesize(VALUE self)
+{
+    struct extbzip3_cache *c = get_block_cache(self);
+
+    pthread_mutex_lock(&c->lock.mutex);
+    size_t used = c->used;
+    pthread_mutex_unlock(&c->lock.mutex);
+
+    return SIZET2NUM(used);
+}
+
+/*
+ *  @overload size
+ *
+ *  @return [Integer]   保持しているブロックの数
+ */
+static VALUE
+block_cache_size(VALUE self)
+{
+    struct extbzip3_cache *c = get_block_cache(self);
+
+    pthread_mutex_lock(&c->lock.mutex);
+    size_t count = c->count;
+    pthread_mutex_unlock(&c->lock.mutex);
+
+    return SIZET2NUM(count);
+}
+
+static VALUE
+block_cache_hits(VALUE self)
+{
+    struct extbzip3_cache *c = get_block_cache(self);
+
+    pthread_mutex_lock(&c->lock.mutex);
+    uint64_t hits = c->hits;
+    pthread_mutex_unlock(&c->lock.mutex);
+
+    return ULL2NUM(hits);
+}
+
+static VALUE
+block_cache_misses(VALUE self)
+{
+    struct extbzip3_cache *c = get_block_cache(self);
+
+    pthread_mutex_lock(&c->lock.mutex);
+    uint64_t misses = c->misses;
+    pthread_mutex_unlock(&c->lock.mutex);
+
+    return ULL2NUM(misses);
+}
+
+/*
+ *  @overload clear
+ *
+ *  保持しているブロックをすべて捨てます。hits と misses は変わりません。
+ *
+ *  @return [BlockCache]    self
+ */
+static VALUE
+block_cache_clear(VALUE self)
+{
+    struct extbzip3_cache *c = get_block_cache(self);
+
+    pthread_mutex_lock(&c->lock.mutex);
+    cache_clear(c);
+    pthread_mutex_unlock(&c->lock.mutex);
+
+    return self;
+}
+
+void
+extbzip3_init_cache(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    crc32c_init();
+
+    block_cache_class = rb_define_class_under(bzip3_module, "BlockCache", rb_cObject);
+    rb_define_alloc_func(block_cache_class, block_cache_allocate);
+    rb_define_method(block_cache_class, "initialize", block_cache_initialize, -1);
+    rb_define_method(block_cache_class, "capacity", block_cache_capacity, 0);
+    rb_define_method(block_cache_class, "bytesize", block_cache_bytesize, 0);
+    rb_define_method(block_cache_class, "size", block_cache_size, 0);
+    rb_define_method(block_cache_class, "hits", block_cache_hits, 0);
+    rb_define_method(block_cache_class, "misses", block_cache_misses, 0);
+    rb_define_method(block_cache_class, "clear", block_cache_clear, 0);
+}
+
+#else // EXTBZIP3_POOL_SUPPORT
+
+void
+extbzip3_cache_key(struct extbzip3_cache_key *key, int kind, uint32_t param, const void *buf, size_t len)
+{
+}
+
+int32_t
+extbzip3_cache_fetch(struct extbzip3_cache *c, const struct extbzip3_cache_key *key, void *dest, size_t destsize)
+{
+    return -1;
+}
+
+void
+extbzip3_cache_store(struct extbzip3_cache *c, const struct extbzip3_cache_key *key, const void *value, size_t len)
+{
+}
+
+struct extbzip3_cache *
+extbzip3_get_cache(VALUE obj)
+{
+    if (RB_NIL_OR_UNDEF_P(obj)) {
+        return NULL;
+    }
+
+    rb_raise(rb_eNotImpError, "Bzip3::BlockCache is not supported on this platform");
+}
+
+void
+extbzip3_init_cache(VALUE bzip3_module)
+{
+}
+
+#endif // EXTBZIP3_POOL_SUPPORT
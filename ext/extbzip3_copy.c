@@ -0,0 +1,840 @@
+#include "extbzip3.h"
+#include <errno.h>
+
+#if defined(HAVE_RB_IO_DESCRIPTOR) && defined(HAVE_POLL_H)
+# include <ruby/io.h>
+# include <unistd.h>
+# include <poll.h>
+# include <signal.h>
+# define COPY_FD_SUPPORT 1
+/* 書き込みスレッドの write(2) を中断させるシグナル (既定の動作は無視なので、他に送られても害がない) */
+# define COPY_WAKEUP_SIGNAL SIGURG
+#endif
+
+/*
+ * Bzip3.copy_stream の実装です。
+ *
+ * 読み込み、圧縮または伸長、書き込みをそれぞれ並行して進めます。
+ *
+ *  - 読み込みは呼び出したスレッドが行います。
+ *    src がファイル記述子を持つ IO であれば、GVL を手放して直接 read(2) します。
+ *  - 圧縮・伸長はワーカースレッド (extbzip3_pool) が行います。
+ *  - 書き込みは dst がファイル記述子を持つ IO であれば専用のネイティブスレッドが、
+ *    そうでなければ呼び出したスレッドが GVL を持ったまま `dst.write` を呼び出して行います。
+ *    ネイティブスレッドの write(2) は、中断する時に COPY_WAKEUP_SIGNAL を送って EINTR で戻らせます
+ *    (dst のファイル記述子のフラグは他のプロセスと共有されるため、非ブロッキングにはしません)。
+ *
+ * 各段の間のキューは有限で、入力の大きさにかかわらず使用するメモリ量は一定です。
+ */
+
+enum {
+    COPY_ENCODE = 1,
+    COPY_DECODE = 2,
+};
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+struct copy_slot
+{
+    struct extbzip3_job *job;
+    uint32_t origsize;
+};
+#endif
+
+struct copy
+{
+    VALUE src;
+    VALUE dst;
+    VALUE readbuf;
+    int srcfd;                  /* -1 の場合は src.read を使う */
+    int dstfd;                  /* -1 の場合は dst.write を使う */
+    int mode;
+    int concat;
+    int nthreads;
+    uint32_t blocksize;         /* COPY_ENCODE ではブロックサイズ、COPY_DECODE では最大ブロックサイズ */
+    uint8_t *stage;
+    uint64_t readsize;
+    uint64_t writesize;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    struct extbzip3_pool *pool;
+    struct extbzip3_job *pending;
+    struct copy_slot *ring;
+    size_t capa;
+    size_t head;
+    size_t count;
+
+    /* dstfd に書き込むスレッド */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int writer_started;
+    int writer_done;
+    int finish;
+    int abort;
+    int werror;
+    int werrno;
+#else
+    struct bz3_state *bzip3;
+#endif
+
+    uint32_t statesize;
+};
+
+#ifdef COPY_FD_SUPPORT
+struct copy_io
+{
+    int fd;
+    void *ptr;
+    size_t len;
+    ssize_t ret;
+    int err;
+};
+
+static void *
+copy_read_nogvl(void *opaque)
+{
+    struct copy_io *io = (struct copy_io *)opaque;
+    io->ret = read(io->fd, io->ptr, io->len);
+    io->err = errno;
+
+    return NULL;
+}
+
+static void *
+copy_write_nogvl(void *opaque)
+{
+    struct copy_io *io = (struct copy_io *)opaque;
+    io->ret = write(io->fd, io->ptr, io->len);
+    io->err = errno;
+
+    return NULL;
+}
+#endif
+
+/*
+ * io が直接読み書きしてよいファイル記述子を持っていればそれを、そうでなければ -1 を返します。
+ *
+ * 読み込み側は IO オブジェクトの内部バッファにデータが残っている場合は -1 を返します。
+ */
+static int
+copy_fd(VALUE io, int writable)
+{
+#ifdef COPY_FD_SUPPORT
+    if (!RB_TYPE_P(io, RUBY_T_FILE)) {
+        return -1;
+    }
+
+    if (writable) {
+        io = rb_io_get_write_io(io);
+        rb_io_flush(io);
+
+        return rb_io_descriptor(io);
+    } else {
+        rb_io_t *fptr;
+        RB_IO_POINTER(io, fptr);
+        rb_io_check_byte_readable(fptr);
+
+        return (rb_io_read_pending(fptr) ? -1 : rb_io_descriptor(io));
+    }
+#else
+    return -1;
+#endif
+}
+
+/*
+ * src から size バイトを読み込みます。戻り値が size より小さい場合は入力の終端に達しています。
+ */
+static size_t
+copy_read(struct copy *c, void *buf, size_t size)
+{
+    size_t n = 0;
+
+#ifdef COPY_FD_SUPPORT
+    if (c->srcfd >= 0) {
+        while (n < size) {
+            struct copy_io io = { c->srcfd, (char *)buf + n, size - n, 0, 0 };
+            rb_thread_call_without_gvl(copy_read_nogvl, &io, RUBY_UBF_IO, NULL);
+
+            if (io.ret > 0) {
+                n += io.ret;
+            } else if (io.ret == 0) {
+                break;
+            } else if (io.err == EAGAIN || io.err == EWOULDBLOCK) {
+                rb_thread_wait_fd(c->srcfd);
+            } else if (io.err != EINTR) {
+                errno = io.err;
+                rb_sys_fail("read");
+            }
+        }
+
+        c->readsize += n;
+
+        return n;
+    }
+#endif
+
+    while (n < size) {
+        VALUE args[2] = { SIZET2NUM(size - n), c->readbuf };
+        VALUE ret = rb_funcallv(c->src, rb_intern("read"), 2, args);
+
+        if (RB_NIL_P(ret)) {
+            break;
+        }
+
+        rb_check_type(ret, RUBY_T_STRING);
+        size_t len = RSTRING_LEN(ret);
+        if (len == 0) {
+            break;
+        } else if (len > size - n) {
+            rb_raise(rb_eRuntimeError, "read too much - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(c->src), c->src);
+        }
+
+        memcpy((char *)buf + n, RSTRING_PTR(ret), len);
+        n += len;
+    }
+
+    c->readsize += n;
+
+    return n;
+}
+
+static void
+copy_write(struct copy *c, const void *buf, size_t size)
+{
+#ifdef COPY_FD_SUPPORT
+    if (c->dstfd >= 0) {
+        size_t n = 0;
+
+        while (n < size) {
+            struct copy_io io = { c->dstfd, (char *)buf + n, size - n, 0, 0 };
+            rb_thread_call_without_gvl(copy_write_nogvl, &io, RUBY_UBF_IO, NULL);
+
+            if (io.ret >= 0) {
+                n += io.ret;
+            } else if (io.err == EAGAIN || io.err == EWOULDBLOCK) {
+                rb_thread_fd_writable(c->dstfd);
+            } else if (io.err != EINTR) {
+                errno = io.err;
+                rb_sys_fail("write");
+            }
+        }
+
+        c->writesize += size;
+
+        return;
+    }
+#endif
+
+    rb_funcall(c->dst, rb_intern("write"), 1, rb_str_new((const char *)buf, size));
+    c->writesize += size;
+}
+
+static void
+copy_write_block(struct copy *c, const uint8_t *buf, int32_t size, uint32_t origsize)
+{
+    if (c->mode == COPY_ENCODE) {
+        char header[8];
+        storeu32le(header, size);
+        storeu32le(header + 4, origsize);
+        copy_write(c, header, sizeof(header));
+    }
+
+    copy_write(c, buf, size);
+}
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+
+#ifdef COPY_FD_SUPPORT
+static int
+copy_writer_write(struct copy *c, const uint8_t *p, size_t size)
+{
+    while (size > 0) {
+        if (__atomic_load_n(&c->abort, __ATOMIC_RELAXED)) {
+            return ECANCELED;
+        }
+
+        ssize_t ret = write(c->dstfd, p, size);
+
+        if (ret >= 0) {
+            p += ret;
+            size -= ret;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd = { c->dstfd, POLLOUT, 0 };
+            poll(&pfd, 1, 100); // 中断の要求を確認するため、時間を区切って待つ
+        } else if (errno != EINTR) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+static void
+copy_wakeup_handler(int sig)
+{
+    // write(2) を EINTR で戻らせるだけ
+}
+
+static void *
+copy_writer_main(void *opaque)
+{
+    struct copy *c = (struct copy *)opaque;
+    int32_t error = 0;
+    int err = 0;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, COPY_WAKEUP_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    while (!error && !err) {
+        pthread_mutex_lock(&c->mutex);
+        while (c->count == 0 && !c->finish && !c->abort) {
+            pthread_cond_wait(&c->cond, &c->mutex);
+        }
+
+        if (c->abort || c->count == 0) {
+            pthread_mutex_unlock(&c->mutex);
+            break;
+        }
+
+        struct copy_slot slot = c->ring[c->head];
+        c->ring[c->head].job = NULL;
+        c->head = (c->head + 1) % c->capa;
+        c->count--;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+
+        int32_t ret = extbzip3_job_join(slot.job);
+
+        if (ret < 0) {
+            error = ret;
+        } else {
+            if (c->mode == COPY_ENCODE) {
+                uint8_t header[8];
+                storeu32le(header, ret);
+                storeu32le(header + 4, slot.origsize);
+                err = copy_writer_write(c, header, sizeof(header));
+            }
+
+            if (!err) {
+                err = copy_writer_write(c, extbzip3_job_result(slot.job), ret);
+            }
+
+            if (!err) {
+                c->writesize += (c->mode == COPY_ENCODE ? 8 : 0) + ret;
+            }
+        }
+
+        extbzip3_job_release(slot.job);
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    c->werror = error;
+    c->werrno = err;
+    c->writer_done = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+
+    return NULL;
+}
+#endif // COPY_FD_SUPPORT
+
+struct copy_waiter
+{
+    struct copy *c;
+    int until_done;
+    int interrupted;
+};
+
+static void *
+copy_wait_nogvl(void *opaque)
+{
+    struct copy_waiter *w = (struct copy_waiter *)opaque;
+    struct copy *c = w->c;
+
+    pthread_mutex_lock(&c->mutex);
+    while (!c->writer_done && !w->interrupted && (w->until_done || c->count >= c->capa)) {
+        pthread_cond_wait(&c->cond, &c->mutex);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    return NULL;
+}
+
+static void
+copy_wait_ubf(void *opaque)
+{
+    struct copy_waiter *w = (struct copy_waiter *)opaque;
+
+    pthread_mutex_lock(&w->c->mutex);
+    w->interrupted = 1;
+    pthread_cond_broadcast(&w->c->cond);
+    pthread_mutex_unlock(&w->c->mutex);
+}
+
+/*
+ * 書き込みスレッドのキューに空きが出来るまで (until_done が真であれば書き込みスレッドが終了するまで) 待機します。
+ */
+static void
+copy_wait_writer(struct copy *c, int until_done)
+{
+    struct copy_waiter w = { c, until_done, 0 };
+
+    for (;;) {
+        pthread_mutex_lock(&c->mutex);
+        int done = c->writer_done || (!until_done && c->count < c->capa);
+        pthread_mutex_unlock(&c->mutex);
+
+        if (done) {
+            break;
+        }
+
+        w.interrupted = 0;
+        rb_thread_call_without_gvl(copy_wait_nogvl, &w, copy_wait_ubf, &w);
+        rb_thread_check_ints();
+    }
+
+    if (c->writer_done) {
+        if (c->werror < 0) {
+            extbzip3_check_error(c->werror);
+        } else if (c->werrno) {
+            errno = c->werrno;
+            rb_sys_fail("write");
+        }
+    }
+}
+
+static void
+copy_retire(struct copy *c)
+{
+    struct copy_slot slot = c->ring[c->head];
+    int32_t ret = extbzip3_job_wait(slot.job);
+
+    c->ring[c->head].job = NULL;
+    c->head = (c->head + 1) % c->capa;
+    c->count--;
+
+    if (ret < 0) {
+        extbzip3_job_release(slot.job);
+        extbzip3_check_error(ret);
+    }
+
+    c->pending = slot.job; // 書き込み中に例外が発生しても解放されるように
+    copy_write_block(c, extbzip3_job_result(slot.job), ret, slot.origsize);
+    c->pending = NULL;
+    extbzip3_job_release(slot.job);
+}
+
+static void *
+copy_shutdown_nogvl(void *opaque)
+{
+    extbzip3_pool_shutdown((struct extbzip3_pool *)opaque);
+
+    return NULL;
+}
+
+static void
+copy_prepare(struct copy *c, uint32_t blocksize)
+{
+    if (c->pool && c->statesize >= blocksize) {
+        return;
+    }
+
+    if (c->pool) {
+        // キューに残っている仕事はすべて処理されてからワーカーが終了する
+        rb_thread_call_without_gvl(copy_shutdown_nogvl, c->pool, NULL, NULL);
+        extbzip3_pool_free(c->pool);
+        c->pool = NULL;
+    }
+
+    c->pool = extbzip3_pool_new(blocksize, c->nthreads, (size_t)c->nthreads * 2);
+    c->statesize = blocksize;
+
+#ifdef COPY_FD_SUPPORT
+    if (c->dstfd >= 0 && !c->writer_started) {
+        if (pthread_create(&c->writer, NULL, copy_writer_main, c) != 0) {
+            rb_raise(rb_eRuntimeError, "failed to create writer thread");
+        }
+
+        c->writer_started = 1;
+    }
+#endif
+}
+
+static void
+copy_block(struct copy *c, uint8_t *src, size_t len, uint32_t origsize)
+{
+    int type = (c->mode == COPY_ENCODE ? EXTBZIP3_JOB_ENCODE : EXTBZIP3_JOB_DECODE);
+    struct extbzip3_job *job = extbzip3_job_new(type, src, len, bz3_bound(origsize), origsize);
+
+    c->pending = job;
+    extbzip3_pool_push(c->pool, job);
+
+    if (c->writer_started) {
+        copy_wait_writer(c, 0);
+
+        pthread_mutex_lock(&c->mutex);
+        c->ring[(c->head + c->count) % c->capa] = (struct copy_slot){ job, origsize };
+        c->count++;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+    } else {
+        if (c->count >= c->capa) {
+            copy_retire(c);
+        }
+
+        c->ring[(c->head + c->count) % c->capa] = (struct copy_slot){ job, origsize };
+        c->count++;
+    }
+
+    c->pending = NULL;
+}
+
+static void
+copy_finish(struct copy *c)
+{
+    if (c->writer_started) {
+        pthread_mutex_lock(&c->mutex);
+        c->finish = 1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+
+        copy_wait_writer(c, 1);
+    } else {
+        while (c->count > 0) {
+            copy_retire(c);
+        }
+    }
+}
+
+/*
+ * 書き込みスレッドの終了を待ちます。
+ *
+ * 読み手が止まったパイプや端末への write(2) はブロックしたまま戻らないため、
+ * 中断する場合は終了するまで COPY_WAKEUP_SIGNAL を送り続けます
+ * (write(2) に入る直前に届いた場合は取りこぼすため、時間を区切って送り直す)。
+ */
+static void *
+copy_join_nogvl(void *opaque)
+{
+    struct copy *c = (struct copy *)opaque;
+
+#ifdef COPY_FD_SUPPORT
+    pthread_mutex_lock(&c->mutex);
+    while (!c->writer_done && c->abort) {
+        pthread_kill(c->writer, COPY_WAKEUP_SIGNAL);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 50 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        pthread_cond_timedwait(&c->cond, &c->mutex, &ts);
+    }
+    pthread_mutex_unlock(&c->mutex);
+#endif
+
+    pthread_join(c->writer, NULL);
+
+    return NULL;
+}
+
+static void
+copy_release(struct copy *c)
+{
+    if (c->writer_started) {
+        pthread_mutex_lock(&c->mutex);
+        c->abort = !c->writer_done;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+
+        // 書き込みスレッドは作業中の仕事を待ってから終了するため、プールより先に片付ける
+        rb_thread_call_without_gvl(copy_join_nogvl, c, NULL, NULL);
+        c->writer_started = 0;
+    }
+
+    if (c->pool) {
+        rb_thread_call_without_gvl(copy_shutdown_nogvl, c->pool, NULL, NULL);
+        extbzip3_pool_free(c->pool);
+        c->pool = NULL;
+    }
+
+    for (; c->count > 0; c->count--) {
+        extbzip3_job_release(c->ring[c->head].job);
+        c->head = (c->head + 1) % c->capa;
+    }
+
+    if (c->pending) {
+        extbzip3_job_release(c->pending);
+        c->pending = NULL;
+    }
+
+    xfree(c->ring);
+    c->ring = NULL;
+}
+
+#else // EXTBZIP3_POOL_SUPPORT
+
+static void
+copy_prepare(struct copy *c, uint32_t blocksize)
+{
+    if (c->bzip3 && c->statesize >= blocksize) {
+        return;
+    }
+
+    if (c->bzip3) {
+        aux_bz3_free(c->bzip3, c->statesize);
+        c->bzip3 = NULL;
+    }
+
+    c->bzip3 = aux_bz3_new(blocksize);
+    c->statesize = blocksize;
+}
+
+static void
+copy_block(struct copy *c, uint8_t *src, size_t len, uint32_t origsize)
+{
+    int32_t ret;
+
+    if (c->mode == COPY_ENCODE) {
+        ret = aux_bz3_encode_block_nogvl(c->bzip3, src, len);
+    } else {
+        ret = aux_bz3_decode_block_nogvl(c->bzip3, src, len, origsize);
+    }
+
+    if (ret < 0) {
+        extbzip3_check_error(bz3_last_error(c->bzip3));
+    }
+
+    copy_write_block(c, src, ret, origsize);
+}
+
+static void
+copy_finish(struct copy *c)
+{
+}
+
+static void
+copy_release(struct copy *c)
+{
+    if (c->bzip3) {
+        aux_bz3_free(c->bzip3, c->statesize);
+        c->bzip3 = NULL;
+    }
+}
+
+#endif // EXTBZIP3_POOL_SUPPORT
+
+static void
+copy_encode(struct copy *c)
+{
+    uint8_t header[9];
+    memcpy(header, aux_bzip3_signature, 5);
+    storeu32le(header + 5, c->blocksize);
+    copy_write(c, header, sizeof(header));
+
+    copy_prepare(c, c->blocksize);
+
+    for (;;) {
+        size_t n = copy_read(c, c->stage, c->blocksize);
+
+        if (n > 0) {
+            copy_block(c, c->stage, n, (uint32_t)n);
+        }
+
+        if (n < c->blocksize) {
+            break;
+        }
+    }
+}
+
+static void
+copy_decode_header(struct copy *c, const uint8_t *header, size_t len)
+{
+    uint32_t blocksize;
+    int status = aux_bzip3_check_stream_header(header, len, AUX_BZIP3_V1_FILE_FORMAT, &blocksize, NULL);
+    if (status != 0) {
+        extbzip3_check_error(status > 0 ? BZ3_ERR_TRUNCATED_DATA : status);
+    }
+
+    if (blocksize > c->blocksize) {
+        rb_raise(rb_eRuntimeError, "blocksize too big (limit %u, but given %u)", c->blocksize, blocksize);
+    }
+
+    copy_prepare(c, blocksize);
+}
+
+static void
+copy_decode(struct copy *c)
+{
+    uint8_t header[9];
+
+    copy_decode_header(c, header, copy_read(c, header, 9));
+
+    for (;;) {
+        size_t n = copy_read(c, header, 8);
+
+        if (n == 0) {
+            break;
+        }
+
+        if (n >= 5 && memcmp(header, aux_bzip3_signature, 5) == 0) {
+            if (!c->concat) {
+                break;
+            }
+
+            if (n == 8) {
+                n += copy_read(c, header + 8, 1);
+            }
+
+            copy_decode_header(c, header, n);
+            continue;
+        }
+
+        if (n < 8) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        uint32_t packedsize = loadu32le(header);
+        uint32_t originsize = loadu32le(header + 4);
+
+        if (!aux_bzip3_block_header_p(packedsize, originsize, c->statesize)) {
+            extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+        }
+
+        if (copy_read(c, c->stage, packedsize) < packedsize) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        copy_block(c, c->stage, packedsize, originsize);
+    }
+}
+
+static VALUE
+copy_main(VALUE arg)
+{
+    struct copy *c = (struct copy *)arg;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    c->capa = (size_t)c->nthreads * 2 + 1;
+    c->ring = ZALLOC_N(struct copy_slot, c->capa);
+#endif
+
+    c->stage = (uint8_t *)xmalloc(bz3_bound(c->blocksize));
+
+    if (c->mode == COPY_ENCODE) {
+        copy_encode(c);
+    } else {
+        copy_decode(c);
+    }
+
+    copy_finish(c);
+
+    return Qnil;
+}
+
+static VALUE
+copy_cleanup(VALUE arg)
+{
+    struct copy *c = (struct copy *)arg;
+
+    copy_release(c);
+    xfree(c->stage);
+    c->stage = NULL;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->mutex);
+#endif
+
+    return Qnil;
+}
+
+/*
+ *  @overload copy_stream(src, dst, mode: :encode, threads: nil, blocksize: (16 << 20), concat: true)
+ *
+ *  src から読み込んだデータを圧縮 (または伸長) して dst へ書き込みます。
+ *
+ *  読み込み、圧縮・伸長、書き込みは並行して行われ、全体の処理時間は最も遅い段の処理時間に近づきます。
+ *  src や dst がファイル記述子を持つ IO であれば、GVL を手放して直接読み書きします。
+ *
+ *  V1_FILE_FORMAT のみを扱います。
+ *
+ *  @param  src         [IO, #read]
+ *  @param  dst         [IO, #write]
+ *  @option opts        [Symbol]        :mode (:encode)
+ *      :encode または :decode
+ *  @option opts        [Integer]       :threads (number of online processors)
+ *  @option opts        [Integer]       :blocksize ((16 << 20))
+ *      :encode ではブロックサイズを、:decode では受け付ける最大ブロックサイズを記述します。
+ *  @option opts        [true, false]   :concat (true)
+ *      :decode で連結された bzip3 ストリームを続けて伸長するかどうか
+ *  @return [Array<Integer>]
+ *      `[読み込んだバイト数, 書き込んだバイト数]`
+ */
+static VALUE
+copy_s_copy_stream(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, dst, opts;
+    rb_scan_args(argc, argv, "2:", &src, &dst, &opts);
+
+    enum { numkw = 4 };
+    ID idtab[numkw] = { rb_intern("mode"), rb_intern("threads"), rb_intern("blocksize"), rb_intern("concat") };
+    union { struct { VALUE mode, threads, blocksize, concat; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    struct copy c;
+    memset(&c, 0, sizeof(c));
+
+    if (RB_NIL_OR_UNDEF_P(kw.mode) || kw.mode == ID2SYM(rb_intern("encode"))) {
+        c.mode = COPY_ENCODE;
+    } else if (kw.mode == ID2SYM(rb_intern("decode"))) {
+        c.mode = COPY_DECODE;
+    } else {
+        rb_raise(rb_eArgError, "wrong mode (expect :encode or :decode, but given %" PRIsVALUE ")", kw.mode);
+    }
+
+    c.src = src;
+    c.dst = dst;
+    c.readbuf = rb_str_buf_new(0);
+    c.concat = RB_UNDEF_P(kw.concat) || RTEST(kw.concat);
+    c.nthreads = aux_conv_to_threads(kw.threads);
+    c.blocksize = aux_conv_to_blocksize(kw.blocksize);
+    c.srcfd = copy_fd(src, 0);
+    c.dstfd = copy_fd(dst, 1);
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    pthread_mutex_init(&c.mutex, NULL);
+    pthread_cond_init(&c.cond, NULL);
+#endif
+
+    rb_ensure(copy_main, (VALUE)&c, copy_cleanup, (VALUE)&c);
+
+    RB_GC_GUARD(c.src);
+    RB_GC_GUARD(c.dst);
+    RB_GC_GUARD(c.readbuf);
+
+    return rb_assoc_new(ULL2NUM(c.readsize), ULL2NUM(c.writesize));
+}
+
+void
+extbzip3_init_copy(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    rb_define_singleton_method(bzip3_module, "copy_stream", copy_s_copy_stream, -1);
+
+#if defined(EXTBZIP3_POOL_SUPPORT) && defined(COPY_FD_SUPPORT)
+    // SA_RESTART を付けずにハンドラを置き、write(2) が再開されずに EINTR で戻るようにする
+    struct sigaction sa, old;
+    if (sigaction(COPY_WAKEUP_SIGNAL, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = copy_wakeup_handler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(COPY_WAKEUP_SIGNAL, &sa, NULL);
+    }
+#endif
+}
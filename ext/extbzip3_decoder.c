@@ -28,8 +28,166 @@ aux_check_header(const char *in, const char *const inend, uint32_t *blockcount)
     return blocksize;
 }
 
+struct aux_oneshot_decode
+{
+    struct bz3_state *bz3;
+    struct extbzip3_cache *cache;
+    uint32_t statesize;         /* bz3 を確保したブロックサイズ */
+    uint32_t chunksize;         /* 現在のストリームのブロックサイズ */
+    uint32_t needsize;          /* 0 以外なら、この大きさで bz3 を確保し直してから再開する */
+    uint32_t blockcount;
+    int32_t blocksize;          /* 受け入れるブロックサイズの上限 */
+    int format, concat, partial;
+    const char *inp, *inend;
+    char *outp, *outend;
+    char *scratch;
+    int status;
+    int interrupted;            /* 真の場合、次のブロックに進まずに戻る (aux_oneshot_decode_ubf) */
+};
+
+/*
+ * ヘッダの解析も含めたブロックごとの処理を、まとめて GVL を手放した状態で行います。
+ *
+ * より大きなブロックサイズのストリームが連結されていた場合は needsize を設定して戻ります。
+ * 呼び出し側が GVL を持った状態で bz3 を確保し直してから、続きを再開します。
+ * 割り込みがあった場合も、ブロックの間で interrupted を残して戻ります。
+ */
+static void *
+aux_oneshot_decode_nogvl(void *opaque)
+{
+    struct aux_oneshot_decode *d = (struct aux_oneshot_decode *)opaque;
+    int32_t ret;
+
+    while (d->inend - d->inp > 0) {
+        if (__atomic_load_n(&d->interrupted, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+
+        if (d->blockcount == 0) {
+            uint32_t blockcount1 = 0;
+            ret = aux_check_header(d->inp, d->inend, (d->format == AUX_BZIP3_V1_FILE_FORMAT ? NULL : &blockcount1));
+
+            if (ret > 0) {
+                if (!d->concat) {
+                    break;
+                }
+
+                d->blockcount = blockcount1;
+
+                if (ret < AUX_BZIP3_BLOCKSIZE_MIN || ret > d->blocksize || ret > AUX_BZIP3_BLOCKSIZE_MAX) {
+                    d->status = BZ3_ERR_OUT_OF_BOUNDS;
+                    return NULL;
+                }
+
+                d->chunksize = (uint32_t)ret;
+                d->inp += (d->format == AUX_BZIP3_V1_FILE_FORMAT ? 9 : 13);
+
+                if (d->chunksize > d->statesize) {
+                    d->needsize = d->chunksize;
+                    return NULL;
+                }
+
+                continue;
+            }
+        }
+
+        if (d->partial && d->outp >= d->outend) {
+            d->blockcount = 0;
+            break;
+        }
+
+        if (d->inend - d->inp < 8) {
+            d->status = BZ3_ERR_TRUNCATED_DATA;
+            return NULL;
+        }
+
+        uint32_t packedsize = loadu32le(d->inp);
+        uint32_t origsize = loadu32le(d->inp + 4);
+
+        if (origsize > d->chunksize || packedsize > bz3_bound(origsize)) {
+            d->status = BZ3_ERR_DATA_TOO_BIG;
+            return NULL;
+        }
+
+        d->inp += 8;
+
+        if (d->inend - d->inp < packedsize) {
+            d->status = BZ3_ERR_DATA_TOO_BIG;
+            return NULL;
+        }
+
+        size_t avail = (size_t)(d->outend - d->outp);
+
+        if (avail >= (origsize > packedsize ? origsize : packedsize)) {
+            memmove(d->outp, d->inp, packedsize);
+            ret = aux_bz3_decode_block_cached(d->cache, d->bz3, d->outp, packedsize, origsize);
+            if (ret < 0) {
+                d->status = ret;
+                return NULL;
+            }
+        } else if (avail >= origsize || d->partial) {
+            if (d->scratch == NULL) {
+                d->scratch = (char *)malloc(bz3_bound(d->statesize));
+
+                if (d->scratch == NULL) {
+                    d->status = BZ3_ERR_INIT;
+                    return NULL;
+                }
+            }
+
+            memcpy(d->scratch, d->inp, packedsize);
+            ret = aux_bz3_decode_block_cached(d->cache, d->bz3, d->scratch, packedsize, origsize);
+            if (ret < 0) {
+                d->status = ret;
+                return NULL;
+            }
+
+            if (avail < origsize) {
+                memcpy(d->outp, d->scratch, avail);
+                d->outp += avail;
+                d->blockcount = 0;
+                break;
+            }
+
+            memcpy(d->outp, d->scratch, origsize);
+        } else {
+            d->status = BZ3_ERR_DATA_TOO_BIG;
+            return NULL;
+        }
+
+        d->inp += packedsize;
+        d->outp += origsize;
+
+        if (d->format != AUX_BZIP3_V1_FILE_FORMAT) {
+            d->blockcount--;
+        }
+    }
+
+    d->status = (d->blockcount > 0 ? BZ3_ERR_TRUNCATED_DATA : BZ3_OK);
+
+    return NULL;
+}
+
+static void
+aux_oneshot_decode_ubf(void *opaque)
+{
+    __atomic_store_n(&((struct aux_oneshot_decode *)opaque)->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+static VALUE
+aux_oneshot_decode_check_ints(VALUE unused)
+{
+    rb_thread_check_ints();
+
+    return Qnil;
+}
+
+/*
+ * partial が真の場合、out が一杯になった時点で伸長を打ち切り、それまでの結果を返します。
+ * 最後のブロックが out に収まりきらない場合は作業領域へ伸長し、収まる分だけを複写します。
+ */
 static int
-aux_oneshot_decode(const void *in, void *out, size_t insize, size_t *outsize, int format, int32_t blocksize, int concat)
+aux_oneshot_decode(const void *in, void *out, size_t insize, size_t *outsize, int format, int32_t blocksize, int concat, int partial, struct extbzip3_cache *cache)
 {
     uint32_t blockcount = 0;
     int32_t ret = aux_check_header((const char *)in, (const char *)in + insize,
@@ -42,97 +200,112 @@ aux_oneshot_decode(const void *in, void *out, size_t insize, size_t *outsize, in
         return BZ3_ERR_OUT_OF_BOUNDS;
     }
 
-    uint32_t chunk_blocksize = ret;
-    struct bz3_state *bz3 = bz3_new(blocksize);
+    // 作業領域は実際のブロックサイズに合わせて確保し、より大きなストリームが連結されていた場合に確保し直す
+    struct aux_oneshot_decode d = {
+        aux_bz3_new((uint32_t)ret), cache, (uint32_t)ret, (uint32_t)ret, 0, blockcount,
+        blocksize, format, concat, partial,
+        (const char *)in + (format == AUX_BZIP3_V1_FILE_FORMAT ? 9 : 13), (const char *)in + insize,
+        (char *)out, (char *)out + *outsize,
+        NULL, BZ3_OK, 0,
+    };
+
+    for (;;) {
+        aux_call_without_gvl_ubf(aux_oneshot_decode_nogvl, &d, aux_oneshot_decode_ubf, &d);
+
+        if (d.interrupted) {
+            // 例外にならない割り込み (シグナルハンドラなど) であれば、続きのブロックから再開する
+            int state = 0;
+            d.interrupted = 0;
+            rb_protect(aux_oneshot_decode_check_ints, Qnil, &state);
+
+            if (state) {
+                free(d.scratch);
+                aux_bz3_free(d.bz3, d.statesize);
+                rb_jump_tag(state);
+            }
+
+            continue;
+        }
+
+        if (d.needsize == 0) {
+            break;
+        }
 
-    if (bz3 == NULL) {
-        return BZ3_ERR_INIT;
+        free(d.scratch);
+        d.scratch = NULL;
+        aux_bz3_free(d.bz3, d.statesize);
+        d.bz3 = NULL;
+        d.bz3 = aux_bz3_new(d.needsize);
+        d.statesize = d.needsize;
+        d.needsize = 0;
     }
 
-    const char *inp = (const char *)in + (format == AUX_BZIP3_V1_FILE_FORMAT ? 9 : 13);
-    const char *const inend = (const char *)in + insize;
-    char *outp = (char *)out;
-    char *const outend = outp + *outsize;
+    free(d.scratch);
+    aux_bz3_free(d.bz3, d.statesize);
+
+    if (d.status == BZ3_OK) {
+        *outsize = (size_t)(d.outp - (const char *)out);
+    }
 
-    while (inend - inp > 0) {
+    return d.status;
+}
+
+/*
+ * ブロックヘッダだけを辿って、伸長後の大きさを求めます。
+ *
+ * limit を超えた時点で走査を打ち切ります。
+ * ヘッダが壊れている場合は、そこまでの大きさを返します (伸長時に異常として検出されます)。
+ */
+static uint64_t
+aux_scan_size(int format, const char *in, const char *const inend, int concat, uint64_t limit)
+{
+    int headersize = (format == AUX_BZIP3_V1_FILE_FORMAT ? 9 : 13);
+    uint32_t blockcount = 0;
+    uint64_t total = 0;
+
+    if (aux_check_header(in, inend, (format == AUX_BZIP3_V1_FILE_FORMAT ? NULL : &blockcount)) < 0) {
+        return 0;
+    }
+
+    in += headersize;
+
+    while (inend - in >= 8) {
         if (blockcount == 0) {
             uint32_t blockcount1 = 0;
-            ret = aux_check_header(inp, inend, (format == AUX_BZIP3_V1_FILE_FORMAT ? NULL : &blockcount1));
 
-            if (ret > 0) {
+            if (aux_check_header(in, inend, (format == AUX_BZIP3_V1_FILE_FORMAT ? NULL : &blockcount1)) > 0) {
                 if (!concat) {
                     break;
                 }
 
                 blockcount = blockcount1;
-
-                if (ret < AUX_BZIP3_BLOCKSIZE_MIN || ret > blocksize || ret > AUX_BZIP3_BLOCKSIZE_MAX) {
-                    bz3_free(bz3);
-                    return BZ3_ERR_OUT_OF_BOUNDS;
-                }
-
-                chunk_blocksize = (uint32_t)ret;
-                inp += (format == AUX_BZIP3_V1_FILE_FORMAT ? 9 : 13);
+                in += headersize;
 
                 continue;
             }
         }
 
-        if (inend - inp < 8) {
-            bz3_free(bz3);
-            return BZ3_ERR_TRUNCATED_DATA;
-        }
-
-        uint32_t packedsize = loadu32le(inp);
-        uint32_t origsize = loadu32le(inp + 4);
-
-        if (origsize > chunk_blocksize || packedsize > bz3_bound(origsize)) {
-            bz3_free(bz3);
-            return BZ3_ERR_DATA_TOO_BIG;
-        }
+        uint32_t packedsize = loadu32le(in);
+        total += loadu32le(in + 4);
 
-        inp += 8;
-
-        if (inend - inp < packedsize) {
-            bz3_free(bz3);
-            return BZ3_ERR_DATA_TOO_BIG;
+        if (total > limit) {
+            break;
         }
 
-        if (outend - outp < (origsize > packedsize ? origsize : packedsize)) {
-            bz3_free(bz3);
-            return BZ3_ERR_DATA_TOO_BIG;
-        }
+        in += 8;
 
-        memmove(outp, inp, packedsize);
-        ret = aux_bz3_decode_block_nogvl(bz3, outp, packedsize, origsize);
-        if (ret < 0) {
-            bz3_free(bz3);
-            return ret;
+        if ((size_t)(inend - in) < packedsize) {
+            break;
         }
 
-        inp += packedsize;
-        outp += origsize;
+        in += packedsize;
 
         if (format != AUX_BZIP3_V1_FILE_FORMAT) {
             blockcount--;
         }
     }
 
-    bz3_free(bz3);
-
-    if (blockcount > 0) {
-        return BZ3_ERR_TRUNCATED_DATA;
-    }
-
-    *outsize = (size_t)(outp - (const char *)out);
-
-    return BZ3_OK;
-}
-
-static uint64_t
-aux_scan_size(int format, const char *in, const char *const inend, int concat)
-{
-    return 16 << 20; // FIXME!
+    return total;
 }
 
 static int
@@ -155,7 +328,9 @@ aux_io_read(VALUE io, size_t size, VALUE buf)
 struct decoder
 {
     struct bz3_state *bzip3;
-    uint32_t blocksize;
+    uint32_t blocksize;         /* 受け入れるブロックサイズの上限 */
+    uint32_t statesize;         /* bzip3 を確保したブロックサイズ */
+    uint32_t chunksize;         /* 現在のストリームのブロックサイズ */
     int concat:1;
     int firstread:1;
     int closed:1;
@@ -163,22 +338,65 @@ struct decoder
     VALUE inport;
     VALUE readbuf;
     VALUE destbuf;
+    size_t destoff;             /* destbuf のうち読み出し済みのバイト数 */
+    VALUE cache;
+    struct extbzip3_idle idle;
 };
 
 #define DECODER_FREE_BLOCK(P)                                           \
+        extbzip3_idle_unregister(&(P)->idle);                           \
         if ((P)->bzip3) {                                               \
-            bz3_free((P)->bzip3);                                       \
+            aux_bz3_free((P)->bzip3, (P)->statesize);                   \
         }                                                               \
 
 #define DECODER_VALUE_FOREACH(DEF)                                      \
         DEF(inport)                                                     \
         DEF(readbuf)                                                    \
         DEF(destbuf)                                                    \
+        DEF(cache)                                                      \
+
+#undef AUX_DEFINE_TYPED_DATA_INITIALIZED_P
+#define AUX_DEFINE_TYPED_DATA_INITIALIZED_P(P) ((P)->blocksize != 0)
 
 AUX_DEFINE_TYPED_DATA(decoder, decoder_allocate, DECODER_FREE_BLOCK, DECODER_VALUE_FOREACH)
 
 /*
- *  @overload initialize(blocksize: (16 << 20), concat: true)
+ * bz3_state と作業用の文字列を解放します。まだ読み出されていない destbuf の内容は残します。
+ * bz3_state は次のブロックを伸長するときに確保し直されます。
+ */
+static void
+decoder_release(struct decoder *p)
+{
+    if (p->bzip3) {
+        aux_bz3_free(p->bzip3, p->statesize);
+        p->bzip3 = NULL;
+        p->statesize = 0;
+    }
+
+    aux_str_release(p->readbuf);
+
+    if (rb_type_p(p->destbuf, RUBY_T_STRING) && (size_t)RSTRING_LEN(p->destbuf) <= p->destoff) {
+        aux_str_release(p->destbuf);
+        p->destoff = 0;
+    }
+}
+
+static void
+decoder_trim_idle(struct extbzip3_idle *idle)
+{
+    decoder_release((struct decoder *)((char *)idle - offsetof(struct decoder, idle)));
+}
+
+/*
+ *  @overload initialize(inport, blocksize: (16 << 20), concat: true, idle_trim: nil, cache: nil)
+ *
+ *  blocksize は受け入れるブロックサイズの上限です。
+ *  bzip3 の状態はストリームヘッダを読み込んだ時点で、そこに記されたブロックサイズに合わせて確保されます。
+ *
+ *  idle_trim に秒数を与えると、最後の read から idle_trim 秒以上たった後の Bzip3.trim_idle で
+ *  bzip3 の状態を解放します。解放された状態は次に伸長するブロックで確保し直されます。
+ *
+ *  cache に Bzip3::BlockCache を与えると、以前に伸長したものと同じ内容のブロックは伸長せずにキャッシュから複写します。
  */
 static VALUE
 decoder_initialize(int argc, VALUE argv[], VALUE self)
@@ -186,13 +404,15 @@ decoder_initialize(int argc, VALUE argv[], VALUE self)
     struct { VALUE inport, opts; } args;
     rb_scan_args(argc, argv, "1:", &args.inport, &args.opts);
 
-    enum { numkw = 2 };
-    ID idtab[numkw] = { rb_intern("blocksize"), rb_intern("concat") };
-    union { struct { VALUE blocksize, concat; }; VALUE vect[numkw]; } opts;
+    enum { numkw = 4 };
+    ID idtab[numkw] = { rb_intern("blocksize"), rb_intern("concat"), rb_intern("idle_trim"), rb_intern("cache") };
+    union { struct { VALUE blocksize, concat, idle_trim, cache; }; VALUE vect[numkw]; } opts;
     rb_get_kwargs(args.opts, idtab, 0, numkw, opts.vect);
 
+    extbzip3_get_cache(opts.cache);
+
     struct decoder *p = (struct decoder *)rb_check_typeddata(self, &decoder_type);
-    if (p == NULL || p->bzip3) {
+    if (p == NULL || p->blocksize != 0) {
         rb_raise(rb_eTypeError, "wrong initialized or re-initializing - %" PRIsVALUE, self);
     }
 
@@ -200,12 +420,45 @@ decoder_initialize(int argc, VALUE argv[], VALUE self)
     p->inport = args.inport;
     p->readbuf = Qnil;
     p->destbuf = Qnil;
-    p->bzip3 = aux_bz3_new(p->blocksize);
+    p->cache = (RB_UNDEF_P(opts.cache) ? Qnil : opts.cache);
+    p->bzip3 = NULL;
+    p->statesize = 0;
+    p->chunksize = 0;
     p->firstread = 1;
     p->concat = RB_UNDEF_P(opts.concat) || RTEST(opts.concat);
+    extbzip3_idle_register(&p->idle, opts.idle_trim, decoder_trim_idle);
 
     return self;
 }
+/*
+ * ストリームヘッダのブロックサイズを検査して、bzip3 の状態を必要な大きさで用意します。
+ * 既に確保した状態で足りる場合は、そのまま使い続けます。
+ */
+static void
+decoder_prepare_state(struct decoder *p, uint32_t blocksize)
+{
+    if (blocksize < AUX_BZIP3_BLOCKSIZE_MIN || blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
+        extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+    }
+
+    if (blocksize > p->blocksize) {
+        rb_raise(rb_eRuntimeError, "initialize で指定した blocksize が小さすぎます (期待値 %d に対して実際は %d)", (int)p->blocksize, (int)blocksize);
+    }
+
+    if (blocksize > p->statesize) {
+        if (p->bzip3) {
+            aux_bz3_free(p->bzip3, p->statesize);
+            p->bzip3 = NULL;
+            p->statesize = 0;
+        }
+
+        p->bzip3 = aux_bz3_new(blocksize);
+        p->statesize = blocksize;
+    }
+
+    p->chunksize = blocksize;
+}
+
 static int
 decoder_read_block(VALUE self, struct decoder *p)
 {
@@ -224,14 +477,7 @@ decoder_read_block(VALUE self, struct decoder *p)
             extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
         }
 
-        uint32_t blocksize = loadu32le(RSTRING_PTR(p->readbuf) + 5);
-        if (blocksize < AUX_BZIP3_BLOCKSIZE_MIN || blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
-            extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
-        }
-
-        if (blocksize > p->blocksize) {
-            rb_raise(rb_eRuntimeError, "initialize で指定した blocksize が小さすぎます (期待値 %d に対して実際は %d)", (int)p->blocksize, (int)blocksize);
-        }
+        decoder_prepare_state(p, loadu32le(RSTRING_PTR(p->readbuf) + 5));
 
         p->firstread = 0;
     }
@@ -252,16 +498,9 @@ decoder_read_block(VALUE self, struct decoder *p)
             if (aux_io_read(p->inport, 1, p->readbuf) == 0) {
                 workbuf[3] = RSTRING_PTR(p->readbuf)[0];
 
-                uint32_t blocksize = loadu32le(workbuf);
-                if (blocksize < AUX_BZIP3_BLOCKSIZE_MIN || blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
-                    extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
-                }
-
-                if (blocksize > p->blocksize) {
-                    rb_raise(rb_eRuntimeError, "initialize で指定した blocksize が小さすぎます (期待値 %d に対して実際は %d)", (int)p->blocksize, (int)blocksize);
-                }
-
                 if (p->concat) {
+                    decoder_prepare_state(p, loadu32le(workbuf));
+
                     continue;
                 } else {
                     p->eof = 1;
@@ -275,23 +514,43 @@ decoder_read_block(VALUE self, struct decoder *p)
         uint32_t packedsize = loadu32le(RSTRING_PTR(p->readbuf) + 0);
         uint32_t originsize = loadu32le(RSTRING_PTR(p->readbuf) + 4);
 
+        if (originsize > p->chunksize || packedsize > bz3_bound(originsize)) {
+            extbzip3_check_error(BZ3_ERR_DATA_TOO_BIG);
+        }
+
+        p->destoff = 0;
         rb_str_set_len(p->destbuf, 0);
-        rb_str_modify_expand(p->destbuf, originsize);
+        rb_str_modify_expand(p->destbuf, (originsize > packedsize ? originsize : packedsize));
 
+        // 圧縮されたブロックは destbuf へ直接読み込み、足りなければ readbuf を介して継ぎ足す
+        VALUE readto = p->destbuf;
         uint32_t needsize = packedsize;
         while (needsize > 0) {
-            if (aux_io_read(p->inport, packedsize, p->readbuf) != 0) {
+            if (aux_io_read(p->inport, needsize, readto) != 0) {
                 rb_raise(rb_eRuntimeError, "意図しない EOF");
-            } else if (RSTRING_LEN(p->readbuf) > packedsize) {
+            } else if ((size_t)RSTRING_LEN(readto) > needsize) {
                 rb_raise(rb_eRuntimeError, "#<%" PRIsVALUE ":0x%" PRIxVALUE ">#read は %u バイトを超過して読み込みました",
-                         rb_class_of(p->inport), p->inport, packedsize);
+                         rb_class_of(p->inport), p->inport, needsize);
+            }
+
+            needsize -= RSTRING_LEN(readto);
+
+            if (readto != p->destbuf) {
+                rb_str_cat(p->destbuf, RSTRING_PTR(readto), RSTRING_LEN(readto));
             }
 
-            rb_str_cat(p->destbuf, RSTRING_PTR(p->readbuf), RSTRING_LEN(p->readbuf));
-            needsize -= RSTRING_LEN(p->readbuf);
+            readto = p->readbuf;
         }
 
-        int32_t ret = aux_bz3_decode_block_nogvl(p->bzip3, RSTRING_PTR(p->destbuf), packedsize, originsize);
+        if (rb_str_capacity(p->destbuf) < originsize) {
+            rb_str_modify_expand(p->destbuf, originsize - RSTRING_LEN(p->destbuf));
+        }
+
+        if (!p->bzip3) {
+            decoder_prepare_state(p, p->chunksize);
+        }
+
+        int32_t ret = aux_bz3_decode_block_cached_nogvl(extbzip3_get_cache(p->cache), p->bzip3, RSTRING_PTR(p->destbuf), packedsize, originsize);
         extbzip3_check_error(ret);
 
         rb_str_set_len(p->destbuf, originsize);
@@ -302,6 +561,52 @@ decoder_read_block(VALUE self, struct decoder *p)
     return 0;
 }
 
+struct decoder_read_args
+{
+    VALUE self;
+    struct decoder *p;
+    size_t size;
+    VALUE dest;
+};
+
+static VALUE
+decoder_read_main(VALUE arg)
+{
+    struct decoder_read_args *args = (struct decoder_read_args *)arg;
+    struct decoder *p = args->p;
+    size_t size = args->size;
+
+    RUBY_ASSERT_ALWAYS(rb_type_p(args->dest, RUBY_T_STRING) && RSTRING_LEN(args->dest) == 0);
+    RUBY_ASSERT_ALWAYS(RB_NIL_P(p->destbuf) || rb_type_p(p->destbuf, RUBY_T_STRING));
+
+    if (RB_NIL_P(p->destbuf)) {
+        p->destbuf = rb_str_new(NULL, 0);
+    }
+
+    // 読み出した分は destoff を進めるだけにして、残りを詰め直すことはしない
+    for (;;) {
+        size_t avail = RSTRING_LEN(p->destbuf) - p->destoff;
+
+        if (avail >= size) {
+            rb_str_cat(args->dest, RSTRING_PTR(p->destbuf) + p->destoff, size);
+            p->destoff += size;
+
+            break;
+        }
+
+        size -= avail;
+        rb_str_cat(args->dest, RSTRING_PTR(p->destbuf) + p->destoff, avail);
+        rb_str_set_len(p->destbuf, 0);
+        p->destoff = 0;
+
+        if (decoder_read_block(args->self, p) != 0) {
+            break;
+        }
+    }
+
+    return (RSTRING_LEN(args->dest) > 0 ? args->dest : Qnil);
+}
+
 /*
  *  @overload read(size = nil, dest = "")
  */
@@ -340,35 +645,17 @@ decoder_read(int argc, VALUE argv[], VALUE self)
     if (size < 1) {
         return args.dest;
     } else {
-        RUBY_ASSERT_ALWAYS(rb_type_p(args.dest, RUBY_T_STRING) && RSTRING_LEN(args.dest) == 0);
-        RUBY_ASSERT_ALWAYS(RB_NIL_P(p->destbuf) || rb_type_p(p->destbuf, RUBY_T_STRING));
-
-        if (RB_NIL_P(p->destbuf)) {
-            p->destbuf = rb_str_new(NULL, 0);
-        }
-
-        for (;;) {
-            if ((size_t)RSTRING_LEN(p->destbuf) >= size) {
-                rb_str_cat(args.dest, RSTRING_PTR(p->destbuf), size);
-                memmove(RSTRING_PTR(p->destbuf), RSTRING_PTR(p->destbuf) + size, RSTRING_LEN(p->destbuf) - size);
-                rb_str_set_len(p->destbuf, RSTRING_LEN(p->destbuf) - size);
-
-                break;
-            }
-
-            size -= RSTRING_LEN(p->destbuf);
-            rb_str_cat(args.dest, RSTRING_PTR(p->destbuf), RSTRING_LEN(p->destbuf));
-            rb_str_set_len(p->destbuf, 0);
-
-            if (decoder_read_block(self, p) != 0) {
-                break;
-            }
-        }
+        struct decoder_read_args readargs = { self, p, size, args.dest };
 
-        return (RSTRING_LEN(args.dest) > 0 ? args.dest : Qnil);
+        return extbzip3_idle_call(&p->idle, decoder_read_main, (VALUE)&readargs);
     }
 }
 
+/*
+ *  @overload close
+ *
+ *  bzip3 の状態と作業用の文字列をすぐに解放します。inport は閉じません。
+ */
 static VALUE
 decoder_close(VALUE self)
 {
@@ -379,10 +666,30 @@ decoder_close(VALUE self)
     }
 
     p->closed = 1;
+    extbzip3_idle_unregister(&p->idle);
+    aux_str_release(p->destbuf);
+    p->destoff = 0;
+    decoder_release(p);
+    p->readbuf = p->destbuf = Qnil;
 
     return Qnil;
 }
 
+/*
+ *  @overload trim
+ *
+ *  bzip3 の状態と作業用の文字列を今すぐ解放します。解放した状態は次に伸長するブロックで確保し直されます。
+ *
+ *  @return [Decoder]   self
+ */
+static VALUE
+decoder_trim(VALUE self)
+{
+    extbzip3_idle_trim(&get_decoder(self)->idle);
+
+    return self;
+}
+
 static VALUE
 decoder_closed(VALUE self)
 {
@@ -395,78 +702,154 @@ decoder_eof(VALUE self)
     return (get_decoder(self)->eof ? Qtrue : Qfalse);
 }
 
+struct decoder_s_decode_args
+{
+    VALUE src, dest;
+    size_t maxdest;
+    int format;
+    int32_t blocksize;
+    int concat;
+    int partial;
+    uint64_t max_output;
+    VALUE cache;
+
+    const char *srcp;
+    char *destp;
+    size_t insize, outsize;
+    uint64_t total;
+};
+
+static void *
+decoder_s_decode_scan_nogvl(void *arg)
+{
+    struct decoder_s_decode_args *args = (struct decoder_s_decode_args *)arg;
+
+    args->total = aux_scan_size(args->format, args->srcp, args->srcp + args->insize, args->concat, args->max_output);
+
+    return NULL;
+}
+
+static VALUE
+decoder_s_decode_run(VALUE arg)
+{
+    struct decoder_s_decode_args *args = (struct decoder_s_decode_args *)arg;
+
+    return INT2FIX(aux_oneshot_decode(args->srcp, args->destp, args->insize, &args->outsize,
+                                      args->format, args->blocksize, args->concat, args->partial,
+                                      extbzip3_get_cache(args->cache)));
+}
+
+static VALUE
+decoder_s_decode_main(VALUE arg)
+{
+    struct decoder_s_decode_args *args = (struct decoder_s_decode_args *)arg;
+    VALUE src = aux_str_pin(args->src);
+    aux_src_bytes(src, &args->srcp, &args->insize);
+
+    size_t outsize = args->maxdest;
+    int bounded = (args->partial && outsize <= args->max_output);
+
+    if (outsize == SIZE_MAX || (args->max_output != UINT64_MAX && !bounded)) {
+        // 伸長を始める前に、ブロックヘッダが宣言する大きさで max_output を検査する
+        // (maxdest が与えられ max_output がなければ、ブロックヘッダを先に辿る必要はない)
+        aux_call_without_gvl(decoder_s_decode_scan_nogvl, args);
+        uint64_t total = args->total;
+
+        if (total > args->max_output) {
+            rb_raise(rb_eRuntimeError, "declared output size exceeds max_output (%" PRIu64 " bytes)", args->max_output);
+        }
+
+        if (outsize == SIZE_MAX) {
+            if (total > SIZE_MAX - 1) {
+                extbzip3_check_error(BZ3_ERR_DATA_TOO_BIG);
+            }
+
+            outsize = (size_t)total;
+        }
+    }
+
+    args->outsize = outsize;
+    args->destp = aux_dest_prepare(args->dest, &args->outsize);
+
+    int status = FIX2INT(aux_str_locked_call(args->dest, decoder_s_decode_run, arg));
+    extbzip3_check_error(status);
+    RB_GC_GUARD(src);
+
+    return aux_dest_finish(args->dest, args->outsize);
+}
+
 /*
  *  @overload decode(src, maxdest = nil, dest = "", **opts)
  *  @overload decode(src, dest, **opts)
  *
  *  decode bzip3 sequence.
  *
- *  @param  src         [String]        describe bzip3 sequence
+ *  @param  src         [String, IO::Buffer]    describe bzip3 sequence
  *  @param  maxdest     [Integer]       describe maximum dest size
- *  @param  dest        [String]        describe destination
+ *  @param  dest        [String, IO::Buffer]    describe destination
  *  @param  opts        [Hash]
  *  @option opts        [true, false]   :concat (true)
  *  @option opts        [true, false]   :partial (false)
+ *      真を与えると、maxdest (または dest が IO::Buffer の場合はその大きさ) を満たすのに必要なブロックだけを伸長し、
+ *      その先頭部分を返します。
+ *  @option opts        [Integer]       :max_output (nil)
+ *      伸長後の大きさの上限を記述します。
+ *      ブロックヘッダが宣言する大きさの合計がこれを超える場合、伸長を始める前に例外を発生させます。
  *  @option opts        [Integer]       :blocksize ((16 << 20))
  *      最大ブロックサイズを記述します。
  *  @option opts                        :format (Bzip3::V1_FILE_FORMAT)
  *      Bzip3::V1_FILE_FORMAT, Bzip3::V1_FRAME_FORMAT
- *  @return [String]    dest for decoded bzip3
+ *  @option opts        [Bzip3::BlockCache] :cache (nil)
+ *  @return [String, IO::Buffer]
+ *      dest for decoded bzip3.
+ *      If dest is IO::Buffer, returns a slice of it covering the written bytes.
  */
 static VALUE
 decoder_s_decode(int argc, VALUE argv[], VALUE mod)
 {
-    size_t insize, outsize;
     struct { VALUE src, maxdest, dest, opts; } args;
-    argc = rb_scan_args(argc, argv, "12:", &args.src, &args.maxdest, &args.dest, &args.opts);
+    struct decoder_s_decode_args decargs;
 
-    enum { numkw = 4 };
-    ID idtab[numkw] = { rb_intern("concat"), rb_intern("partial"), rb_intern("blocksize"), rb_intern("format") };
-    union { struct { VALUE concat, partial, blocksize, format; }; VALUE vect[numkw]; } opts;
-    rb_get_kwargs(args.opts, idtab, 0, numkw, opts.vect);
-
-    switch (argc) {
+    switch (rb_scan_args(argc, argv, "12:", &args.src, &args.maxdest, &args.dest, &args.opts)) {
     case 1:
-        insize = RSTRING_LEN(args.src);
-        outsize = aux_scan_size(aux_conv_to_format(opts.format), RSTRING_PTR(args.src), RSTRING_END(args.src), RB_UNDEF_P(opts.concat) || RTEST(opts.concat));
-        args.dest = rb_str_buf_new(outsize);
+        decargs.maxdest = SIZE_MAX;
+        decargs.dest = rb_str_buf_new(0);
         break;
     case 2:
-        insize = RSTRING_LEN(args.src);
-
         if (rb_type_p(args.maxdest, RUBY_T_FIXNUM) || rb_type_p(args.maxdest, RUBY_T_BIGNUM)) {
-            outsize = NUM2SIZET(args.maxdest);
-            args.dest = rb_str_buf_new(outsize);
+            decargs.maxdest = NUM2SIZET(args.maxdest);
+            decargs.dest = rb_str_buf_new(0);
         } else {
-            args.dest = args.maxdest;
-            outsize = aux_scan_size(aux_conv_to_format(opts.format), RSTRING_PTR(args.src), RSTRING_END(args.src), RB_UNDEF_P(opts.concat) || RTEST(opts.concat));
-            rb_str_modify(args.dest);
-            rb_str_set_len(args.dest, 0);
-            rb_str_modify_expand(args.dest, outsize);
+            decargs.maxdest = SIZE_MAX;
+            decargs.dest = args.maxdest;
         }
 
         break;
     case 3:
-        insize = RSTRING_LEN(args.src);
-        outsize = NUM2SIZET(args.maxdest);
-        rb_str_modify(args.dest);
-        rb_str_set_len(args.dest, 0);
-        rb_str_modify_expand(args.dest, outsize);
+        decargs.maxdest = NUM2SIZET(args.maxdest);
+        decargs.dest = args.dest;
 
         break;
     }
 
-    // TODO: maxdest, partial
+    aux_check_dest(decargs.dest);
 
-    int status = aux_oneshot_decode(RSTRING_PTR(args.src), RSTRING_PTR(args.dest), insize, &outsize,
-                                    aux_conv_to_format(opts.format),
-                                    (RB_NIL_OR_UNDEF_P(opts.blocksize) ? (16 << 20) : NUM2INT(opts.blocksize)),
-                                    RB_UNDEF_P(opts.concat) || RTEST(opts.concat));
-    extbzip3_check_error(status);
+    enum { numkw = 6 };
+    ID idtab[numkw] = { rb_intern("concat"), rb_intern("partial"), rb_intern("blocksize"), rb_intern("format"), rb_intern("max_output"), rb_intern("cache") };
+    union { struct { VALUE concat, partial, blocksize, format, max_output, cache; }; VALUE vect[numkw]; } opts;
+    rb_get_kwargs(args.opts, idtab, 0, numkw, opts.vect);
+
+    extbzip3_get_cache(opts.cache);
 
-    rb_str_set_len(args.dest, outsize);
+    decargs.src = args.src;
+    decargs.format = aux_conv_to_format(opts.format);
+    decargs.blocksize = (RB_NIL_OR_UNDEF_P(opts.blocksize) ? (16 << 20) : NUM2INT(opts.blocksize));
+    decargs.concat = RB_UNDEF_P(opts.concat) || RTEST(opts.concat);
+    decargs.partial = !RB_UNDEF_P(opts.partial) && RTEST(opts.partial);
+    decargs.max_output = (RB_NIL_OR_UNDEF_P(opts.max_output) ? UINT64_MAX : NUM2ULL(opts.max_output));
+    decargs.cache = (RB_UNDEF_P(opts.cache) ? Qnil : opts.cache);
 
-    return args.dest;
+    return aux_io_buffer_locked_call(decargs.src, decargs.dest, decoder_s_decode_main, (VALUE)&decargs);
 }
 
 void
@@ -479,6 +862,7 @@ extbzip3_init_decoder(VALUE bzip3_module)
     rb_define_method(decoder_class, "read", decoder_read, -1);
     rb_define_method(decoder_class, "close", decoder_close, 0);
     rb_define_method(decoder_class, "closed?", decoder_closed, 0);
+    rb_define_method(decoder_class, "trim", decoder_trim, 0);
     rb_define_method(decoder_class, "eof?", decoder_eof, 0);
     rb_define_alias(decoder_class, "eof", "eof?");
 }
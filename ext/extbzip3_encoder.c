@@ -1,83 +1,92 @@
 #include "extbzip3.h"
 
-static inline int
-aux_oneshot_encode(int format, uint32_t blocksize, const void *in, void *out, size_t insize, size_t *outsize)
+struct aux_oneshot_encode
 {
-    if (blocksize < AUX_BZIP3_BLOCKSIZE_MIN) {
-        blocksize = AUX_BZIP3_BLOCKSIZE_MIN;
-    } else if (blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
-        return BZ3_ERR_INIT;
-    }
-
-    if (!outsize) {
-        return BZ3_ERR_INIT;
-    }
+    struct bz3_state *bz3;
+    struct extbzip3_cache *cache;
+    uint32_t blocksize;
+    int growable;               /* 真の場合、出力先が足りなくなった時点で needsize を設定して戻る */
+    const uint8_t *inp, *inend;
+    uint8_t *outp, *outend;
+    uint8_t *scratch;           /* 出力先の残りが bz3_bound に満たない場合の作業領域 */
+    size_t needsize;
+    int status;
+    int interrupted;            /* 真の場合、次のブロックに進まずに戻る (aux_oneshot_encode_ubf) */
+};
 
-    int headersize;
-    size_t blockcount;
-    if (format == AUX_BZIP3_V1_FILE_FORMAT) {
-        headersize = 9;
-        blockcount = 0;
-    } else {
-        headersize = 13;
-        blockcount = (insize / blocksize) + ((insize % blocksize != 0) ? 1 : 0);
+/*
+ * ブロックごとの処理を、まとめて GVL を手放した状態で行います。
+ *
+ * growable が真の場合は、出力先の残りが次のブロックの bz3_bound に満たなくなった時点で needsize を設定して戻ります。
+ * 呼び出し側が GVL を持った状態で出力先を広げてから、続きを再開します。
+ * growable が偽の場合は作業領域へ圧縮し、残りに収まれば複写します。
+ * 割り込みがあった場合はブロックの間で interrupted を残して戻り、呼び出し側が割り込みを処理してから再開します。
+ */
+static void *
+aux_oneshot_encode_nogvl(void *opaque)
+{
+    struct aux_oneshot_encode *e = (struct aux_oneshot_encode *)opaque;
 
-        if (blockcount > (UINT32_MAX - 1)) {
-            return BZ3_ERR_DATA_TOO_BIG;
+    while (e->inend - e->inp > 0) {
+        if (__atomic_load_n(&e->interrupted, __ATOMIC_RELAXED)) {
+            return NULL;
         }
-    }
 
-    if (*outsize < (size_t)headersize) {
-        return BZ3_ERR_INIT;
-    }
+        uint32_t origsize = ((e->inend - e->inp) > e->blocksize) ? e->blocksize : (uint32_t)(e->inend - e->inp);
+        size_t bound = 8 + bz3_bound(origsize);
+        size_t avail = (size_t)(e->outend - e->outp);
+        uint8_t *buf = e->outp + 8;
 
-    struct bz3_state *bz3 = bz3_new(blocksize);
-    if (bz3 == NULL) {
-        return BZ3_ERR_INIT;
-    }
+        if (avail < bound) {
+            if (e->growable) {
+                e->needsize = bound;
+                return NULL;
+            }
 
-    const uint8_t *inp = (const uint8_t *)in;
-    const uint8_t *const inend = inp + insize;
-    uint8_t *outp = (uint8_t *)out + headersize;
-    uint8_t *const outend = outp + *outsize;
+            if (e->scratch == NULL) {
+                e->scratch = (uint8_t *)malloc(bz3_bound(e->blocksize));
 
-    while (inend - inp > 0) {
-        uint32_t origsize = ((inend - inp) > blocksize) ? blocksize : (uint32_t)(inend - inp);
-        uint32_t packedsize = (uint32_t)bz3_bound(origsize); // TODO???: 過剰な値かも？
+                if (e->scratch == NULL) {
+                    e->status = BZ3_ERR_INIT;
+                    return NULL;
+                }
+            }
 
-        if (outend - outp < packedsize) {
-            bz3_free(bz3);
-            return BZ3_ERR_DATA_TOO_BIG;
+            buf = e->scratch;
         }
 
-        outp += 8;
-
-        memmove(outp, inp, origsize);
-        int32_t ret = aux_bz3_encode_block_nogvl(bz3, outp, origsize);
+        memmove(buf, e->inp, origsize);
+        int32_t ret = aux_bz3_encode_block_cached(e->cache, e->blocksize, e->bz3, buf, origsize);
         if (ret < 0) {
-            bz3_free(bz3);
-            return ret;
+            e->status = ret;
+            return NULL;
         }
 
-        storeu32le(outp - 8, ret);
-        storeu32le(outp - 4, origsize);
+        if (buf != e->outp + 8) {
+            if (avail < 8 + (size_t)ret) {
+                e->status = BZ3_ERR_DATA_TOO_BIG;
+                return NULL;
+            }
 
-        inp += origsize;
-        outp += ret;
-    }
+            memcpy(e->outp + 8, buf, ret);
+        }
 
-    bz3_free(bz3);
+        storeu32le(e->outp, ret);
+        storeu32le(e->outp + 4, origsize);
 
-    *outsize = (size_t)(outp - (const uint8_t *)out);
+        e->inp += origsize;
+        e->outp += 8 + ret;
+    }
 
-    memmove(out, aux_bzip3_signature, sizeof(aux_bzip3_signature));
-    storeu32le((char *)out + 5, blocksize);
+    e->status = BZ3_OK;
 
-    if (format == AUX_BZIP3_V1_FRAME_FORMAT) {
-        storeu32le((char *)out + 9, (uint32_t)blockcount);
-    }
+    return NULL;
+}
 
-    return BZ3_OK;
+static void
+aux_oneshot_encode_ubf(void *opaque)
+{
+    __atomic_store_n(&((struct aux_oneshot_encode *)opaque)->interrupted, 1, __ATOMIC_RELAXED);
 }
 
 struct encoder
@@ -86,25 +95,237 @@ struct encoder
     uint32_t blocksize;
     int firstwrite:1;
     int closed:1;
+    int concurrent:1;
+    int encoding:1;             /* concurrent の場合に、いずれかのスレッドが圧縮を行っている */
+    int reblock:1;              /* append: :reblock の場合に、最初のブロックを書いた後で古いブロックの残りを切り詰める */
     VALUE outport;
     VALUE srcbuf;
     VALUE destbuf;
+    VALUE align;
+    VALUE spare;                /* concurrent の場合に、srcbuf と入れ替える空の文字列 */
+    VALUE waiters;              /* concurrent の場合に、圧縮が進むのを待っているスレッド */
+    VALUE timer;                /* max_latency の場合に、部分ブロックを書き出すスレッド */
+    VALUE cache;
+    double max_latency;
+    uint32_t min_block;
+    double oldest;              /* srcbuf の最も古いデータを受け付けた時刻 (0 は空) */
+    double mark;                /* srcbuf をブロックサイズで区切った最後のブロックの先頭を受け付けた時刻 */
+    struct extbzip3_idle idle;
 };
 
 #define ENCODER_FREE_BLOCK(P)                                           \
+        extbzip3_idle_unregister(&(P)->idle);                           \
         if ((P)->bzip3) {                                               \
-            bz3_free((P)->bzip3);                                       \
+            aux_bz3_free((P)->bzip3, (P)->blocksize);                   \
         }                                                               \
 
 #define ENCODER_VALUE_FOREACH(DEF)                                      \
         DEF(outport)                                                    \
         DEF(srcbuf)                                                     \
         DEF(destbuf)                                                    \
+        DEF(align)                                                      \
+        DEF(spare)                                                      \
+        DEF(waiters)                                                    \
+        DEF(timer)                                                      \
+        DEF(cache)                                                      \
+
+#undef AUX_DEFINE_TYPED_DATA_INITIALIZED_P
+#define AUX_DEFINE_TYPED_DATA_INITIALIZED_P(P) ((P)->blocksize != 0)
 
 AUX_DEFINE_TYPED_DATA(encoder, encoder_allocate, ENCODER_FREE_BLOCK, ENCODER_VALUE_FOREACH)
 
 /*
- *  @overload initialize(blocksize: (16 << 20))
+ * bz3_state と作業用の文字列を解放します。まだ圧縮していない srcbuf の内容は残します。
+ */
+static void
+encoder_release(struct encoder *p)
+{
+    if (p->bzip3) {
+        aux_bz3_free(p->bzip3, p->blocksize);
+        p->bzip3 = NULL;
+    }
+
+    aux_str_release(p->destbuf);
+    aux_str_release(p->spare);
+
+    if (rb_type_p(p->srcbuf, RUBY_T_STRING) && RSTRING_LEN(p->srcbuf) == 0) {
+        aux_str_release(p->srcbuf);
+    }
+}
+
+static void
+encoder_trim_idle(struct extbzip3_idle *idle)
+{
+    encoder_release((struct encoder *)((char *)idle - offsetof(struct encoder, idle)));
+}
+
+/*
+ * 解放されていた bz3_state を確保し直します。
+ * ストリームヘッダを書き込んだ後なので、ブロックサイズは変えられません。
+ */
+static void
+encoder_prepare_state(struct encoder *p)
+{
+    if (!p->bzip3) {
+        p->bzip3 = aux_bz3_new(p->blocksize);
+    }
+}
+
+/*
+ * 追記する既存のストリームを調べた結果です。
+ */
+struct encoder_append
+{
+    uint32_t blocksize;         /* 最後のストリームヘッダのブロックサイズ (0 は空のファイル) */
+    int haslast;                /* 最後のストリームヘッダの後にブロックがあるか */
+    uint64_t lastoff;
+    uint32_t lastpacked;
+    uint32_t lastorig;
+};
+
+static VALUE
+aux_io_read_at(VALUE io, uint64_t off, size_t size)
+{
+    rb_funcall(io, rb_intern("seek"), 2, ULL2NUM(off), INT2FIX(SEEK_SET));
+    VALUE buf = rb_funcall(io, rb_intern("read"), 1, SIZET2NUM(size));
+
+    return (RB_NIL_P(buf) ? rb_str_new(0, 0) : StringValue(buf));
+}
+
+/*
+ * 既存のストリームのヘッダとブロックヘッダを辿り、最後のブロックの位置を調べます。
+ * ブロックの本体は読み込みません。
+ */
+static void
+encoder_append_scan(VALUE io, struct encoder_append *a)
+{
+    memset(a, 0, sizeof(*a));
+
+    rb_funcall(io, rb_intern("seek"), 2, INT2FIX(0), INT2FIX(SEEK_END));
+    uint64_t size = NUM2ULL(rb_funcall(io, rb_intern("pos"), 0));
+    uint64_t off = 0;
+
+    while (off < size) {
+        VALUE header = aux_io_read_at(io, off, 9);
+        const char *ptr = RSTRING_PTR(header);
+        size_t len = RSTRING_LEN(header);
+
+        if (len >= 5 && memcmp(ptr, aux_bzip3_signature, 5) == 0) {
+            if (len < 9) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            a->blocksize = loadu32le(ptr + 5);
+            if (a->blocksize < AUX_BZIP3_BLOCKSIZE_MIN || a->blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
+                extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+            }
+
+            a->haslast = 0;
+            off += 9;
+
+            continue;
+        }
+
+        if (a->blocksize == 0) {
+            extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+        }
+
+        if (len < 8) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        uint32_t packedsize = loadu32le(ptr);
+        uint32_t originsize = loadu32le(ptr + 4);
+
+        if (!aux_bzip3_block_header_p(packedsize, originsize, a->blocksize)) {
+            extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+        }
+
+        if (off + 8 + packedsize > size) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        a->haslast = 1;
+        a->lastoff = off;
+        a->lastpacked = packedsize;
+        a->lastorig = originsize;
+        off += 8 + packedsize;
+    }
+}
+
+/*
+ * 最後のブロックを伸長して srcbuf に戻し、書き込み位置をそのブロックの先頭に移します。
+ * 続けて書き込まれたデータと合わせて、ブロックサイズいっぱいのブロックとして圧縮し直されます。
+ *
+ * ここではまだ切り詰めません。
+ * 置き換えるブロックを書き込むまでは古いブロックを残し、途中で止まっても既存のデータを失わないようにします。
+ */
+static void
+encoder_append_reblock(VALUE io, struct encoder *p, const struct encoder_append *a)
+{
+    VALUE packed = aux_io_read_at(io, a->lastoff + 8, a->lastpacked);
+    if ((size_t)RSTRING_LEN(packed) < a->lastpacked) {
+        extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+    }
+
+    VALUE buf = rb_str_buf_new(bz3_bound(a->lastorig));
+    memcpy(RSTRING_PTR(buf), RSTRING_PTR(packed), a->lastpacked);
+    int32_t ret = aux_bz3_decode_block_nogvl(p->bzip3, RSTRING_PTR(buf), a->lastpacked, a->lastorig);
+    if (ret < 0) {
+        extbzip3_check_error(bz3_last_error(p->bzip3));
+    }
+    rb_str_set_len(buf, ret);
+
+    rb_funcall(io, rb_intern("seek"), 2, ULL2NUM(a->lastoff), INT2FIX(SEEK_SET));
+    p->srcbuf = buf;
+    p->reblock = 1;
+}
+
+static VALUE encoder_timer_main(void *arg);
+
+/*
+ *  @overload initialize(outport, blocksize: (16 << 20), align: nil, append: false, idle_trim: nil, concurrent: false, max_latency: nil, min_block: 0, cache: nil)
+ *
+ *  @param  outport     [#<<]
+ *  @param  blocksize   [Integer]
+ *      append が真で既存のストリームがある場合、省略するとそのストリームヘッダのブロックサイズになります。
+ *      既存のブロックサイズより大きな値を与えると ArgumentError 例外が発生します。
+ *  @param  align       [String, nil]
+ *      区切り文字列を与えると、各ブロックをブロックサイズ以内で最後に現れる区切りの直後で終わらせます。
+ *      各ブロックがレコードの途中で切れないため、ブロックごとに独立して処理することが出来ます。
+ *      ブロックサイズ以内に区切りがない場合は、ブロックサイズで区切ります。
+ *  @param  append      [true, false, :reblock]
+ *      真を与えると、既存の bzip3 ファイルの末尾へ新しいストリームヘッダを書かずにブロックを追加します。
+ *      outport は `seek`、`pos`、`read` に応答する必要があります (File なら "r+b" または "a+b" で開いてください)。
+ *      既存のデータは伸長も再圧縮もしません。空のファイルの場合は通常通りストリームヘッダから書き込みます。
+ *
+ *      :reblock を与えると、最後のブロックがブロックサイズに満たない場合にそれを伸長して切り詰め、
+ *      新しいデータと合わせて圧縮し直します。この場合 outport は `truncate` にも応答する必要があります。
+ *      古いブロックは、置き換えるブロックを書き込んだ後に切り詰めます (close しなかった場合は元のまま残ります)。
+ *      古いブロックの位置に上書きするため、File は "a+b" ではなく "r+b" で開いてください。
+ *  @param  idle_trim   [Numeric, nil]
+ *      秒数を与えると、最後の write から idle_trim 秒以上たった後の Bzip3.trim_idle で bz3_state を解放します。
+ *      解放された bz3_state は次の write で確保し直されます。
+ *  @param  concurrent  [true, false]
+ *      真を与えると、複数のスレッドから同時に write しても安全になります。
+ *      それぞれの write に与えたデータは分割されずに、write を受け付けた順に連続して圧縮されます。
+ *      あるスレッドがブロックを圧縮している間も、他のスレッドの write は待たされずに受け付けられます
+ *      (ただし圧縮を待つデータがブロックサイズの2倍を超えた場合は、圧縮が進むまで待ちます)。
+ *      align と同時には使えません。
+ *  @param  max_latency [Numeric, nil]
+ *      秒数を与えると、最も古いデータを受け付けてからこの秒数がたった時点で、ブロックサイズに満たなくても書き出します。
+ *      書き出しは内部のスレッドが行うため、後から write されなくても行われます。
+ *
+ *      concurrent: true を与えた場合と同じ動作になります。
+ *      write のデータはブロックの途中で区切られることがあり、align とは同時に使えません。
+ *
+ *      内部のスレッドは close で終了します。
+ *      close されずに Encoder が回収された場合もスレッドは終了しますが、書き出されていないデータは失われます。
+ *  @param  min_block   [Integer]
+ *      max_latency の期限を過ぎた後の write が、内部のスレッドを待たずに自ら書き出すデータの最小の大きさです。
+ *      これに満たないデータも内部のスレッドが期限に書き出すため、max_latency より遅れることはありません。
+ *  @param  cache       [Bzip3::BlockCache, nil]
+ *      与えると、以前に圧縮したものと同じ内容のブロックは bz3_encode_block を呼ばずにキャッシュから書き出します。
  */
 static VALUE
 encoder_initialize(int argc, VALUE argv[], VALUE self)
@@ -112,22 +333,92 @@ encoder_initialize(int argc, VALUE argv[], VALUE self)
     struct { VALUE outport, opts; } args;
     rb_scan_args(argc, argv, "1:", &args.outport, &args.opts);
 
-    enum { numkw = 1 };
-    ID idtab[numkw] = { rb_intern("blocksize") };
-    union { struct { VALUE blocksize; }; VALUE vect[numkw]; } opts;
+    enum { numkw = 8 };
+    ID idtab[numkw] = {
+        rb_intern("blocksize"), rb_intern("align"), rb_intern("append"), rb_intern("idle_trim"),
+        rb_intern("concurrent"), rb_intern("max_latency"), rb_intern("min_block"), rb_intern("cache"),
+    };
+    union { struct { VALUE blocksize, align, append, idle_trim, concurrent, max_latency, min_block, cache; }; VALUE vect[numkw]; } opts;
     rb_get_kwargs(args.opts, idtab, 0, numkw, opts.vect);
 
+    if (RB_NIL_OR_UNDEF_P(opts.align)) {
+        opts.align = Qnil;
+    } else {
+        opts.align = rb_str_new_frozen(StringValue(opts.align));
+
+        if (RSTRING_LEN(opts.align) < 1) {
+            rb_raise(rb_eArgError, "empty string for align");
+        }
+    }
+
+    double max_latency = (RB_NIL_OR_UNDEF_P(opts.max_latency) ? 0.0 : NUM2DBL(opts.max_latency));
+    if (!RB_NIL_OR_UNDEF_P(opts.max_latency) && !(max_latency > 0.0)) {
+        rb_raise(rb_eArgError, "max_latency must be positive - %" PRIsVALUE, opts.max_latency);
+    }
+
+    uint32_t min_block = (RB_NIL_OR_UNDEF_P(opts.min_block) ? 0 : NUM2UINT(opts.min_block));
+
+    extbzip3_get_cache(opts.cache);
+
+    int concurrent = (!RB_UNDEF_P(opts.concurrent) && RTEST(opts.concurrent)) || max_latency > 0.0;
+    if (concurrent && !RB_NIL_P(opts.align)) {
+        rb_raise(rb_eArgError, "align is exclusive with concurrent and max_latency");
+    }
+
     struct encoder *p = (struct encoder *)rb_check_typeddata(self, &encoder_type);
-    if (p == NULL || p->bzip3) {
+    if (p == NULL || p->blocksize != 0) {
         rb_raise(rb_eTypeError, "wrong initialized or re-initializing - %" PRIsVALUE, self);
     }
 
+    int append = !RB_UNDEF_P(opts.append) && RTEST(opts.append);
+    int reblock = append && opts.append == ID2SYM(rb_intern("reblock"));
+    struct encoder_append app = { 0 };
+
+    if (append) {
+        encoder_append_scan(args.outport, &app);
+    }
+
     p->blocksize = aux_conv_to_blocksize(opts.blocksize);
+    if (app.blocksize > 0) {
+        if (RB_NIL_OR_UNDEF_P(opts.blocksize)) {
+            p->blocksize = app.blocksize;
+        } else if (p->blocksize > app.blocksize) {
+            rb_raise(rb_eArgError,
+                     "blocksize is larger than the existing stream (given %d, but stream has %d)",
+                     (int)p->blocksize, (int)app.blocksize);
+        }
+    }
+
     p->outport = args.outport;
     p->srcbuf = Qnil;
     p->destbuf = Qnil;
-    p->bzip3 = aux_bz3_new(p->blocksize);
-    p->firstwrite = 1;
+    p->align = opts.align;
+    p->spare = Qnil;
+    p->waiters = Qnil;
+    p->concurrent = concurrent;
+    p->timer = Qnil;
+    p->cache = (RB_UNDEF_P(opts.cache) ? Qnil : opts.cache);
+    p->max_latency = max_latency;
+    p->min_block = min_block;
+    p->bzip3 = aux_bz3_new_shrinkable(&p->blocksize);
+    p->firstwrite = (app.blocksize == 0);
+    extbzip3_idle_register(&p->idle, opts.idle_trim, encoder_trim_idle);
+
+    if (append) {
+        if (reblock && app.haslast && app.lastorig < app.blocksize && app.lastorig <= p->blocksize) {
+            encoder_append_reblock(args.outport, p, &app);
+        } else {
+            rb_funcall(args.outport, rb_intern("seek"), 2, INT2FIX(0), INT2FIX(SEEK_END));
+        }
+    }
+
+    if (max_latency > 0.0) {
+        // 内部のスレッドが Encoder の回収を妨げないように、弱い参照を渡す
+        VALUE ref = rb_ary_new_from_args(2, rb_class_new_instance(0, NULL, rb_path2class("ObjectSpace::WeakMap")),
+                                         rb_obj_alloc(rb_cObject));
+        rb_funcall(RARRAY_AREF(ref, 0), rb_intern("[]="), 2, RARRAY_AREF(ref, 1), self);
+        p->timer = rb_thread_create(encoder_timer_main, (void *)ref);
+    }
 
     return self;
 }
@@ -143,11 +434,14 @@ encoder_write_encode(VALUE self, struct encoder *p, const void *buf, size_t len)
 {
     size_t bufoff = 8 + (p->firstwrite ? 9 : 0);
 
+    encoder_prepare_state(p);
+
     p->destbuf = aux_str_new_recycle(p->destbuf, bufoff + bz3_bound(len));
     rb_str_set_len(p->destbuf, bufoff);
     rb_str_cat(p->destbuf, buf, len);
 
-    int32_t res = aux_bz3_encode_block_nogvl(p->bzip3, RSTRING_PTR(p->destbuf) + bufoff, RSTRING_LEN(p->destbuf) - bufoff);
+    int32_t res = aux_bz3_encode_block_cached_nogvl(extbzip3_get_cache(p->cache), p->blocksize, p->bzip3,
+                                                    RSTRING_PTR(p->destbuf) + bufoff, RSTRING_LEN(p->destbuf) - bufoff);
 
     if (res < 0) {
         extbzip3_check_error(res);
@@ -164,16 +458,330 @@ encoder_write_encode(VALUE self, struct encoder *p, const void *buf, size_t len)
     }
 
     rb_funcallv(p->outport, rb_intern("<<"), 1, &p->destbuf);
+
+    if (p->reblock) {
+        p->reblock = 0;
+        rb_funcall(p->outport, rb_intern("truncate"), 1, rb_funcall(p->outport, rb_intern("pos"), 0));
+    }
+}
+
+struct encoder_write_args
+{
+    VALUE self;
+    struct encoder *p;
+    VALUE src;
+};
+
+/*
+ * buf の先頭 limit バイト以内で最後に現れる sep の直後の位置を返します。
+ * 見つからなければ 0 を返します。
+ */
+static size_t
+aux_find_last_separator(const char *buf, size_t limit, const char *sep, size_t seplen)
+{
+    if (seplen > limit) {
+        return 0;
+    }
+
+    for (size_t off = limit - seplen + 1; off > 0; off--) {
+        if (buf[off - 1] == *sep && memcmp(buf + off - 1, sep, seplen) == 0) {
+            return off - 1 + seplen;
+        }
+    }
+
+    return 0;
 }
 
+/*
+ * align が指定された場合の write 処理です。
+ *
+ * srcbuf にブロックサイズ + 1 バイトまで溜め、あふれたら区切りの直後までを1ブロックとして圧縮し、
+ * 残りを srcbuf の先頭へ移します。
+ * ちょうどブロックサイズで溜まった場合は、次の1バイトが来るまで区切りの位置を確定できないため保留します。
+ */
 static VALUE
-encoder_write(VALUE self, VALUE src)
+encoder_write_aligned(VALUE self, struct encoder *p, VALUE src)
 {
-    struct encoder *p = get_encoder(self);
+    const char *srcptr;
+    size_t srclen;
+    size_t srcoff = 0;
+
+    aux_src_bytes(src, &srcptr, &srclen);
 
-    rb_check_type(src, RUBY_T_STRING);
+    if (!rb_type_p(p->srcbuf, RUBY_T_STRING)) {
+        p->srcbuf = rb_str_buf_new(p->blocksize + 1);
+    }
 
-    size_t srclen = RSTRING_LEN(src);
+    while (srcoff < srclen) {
+        size_t buflen = RSTRING_LEN(p->srcbuf);
+        size_t catlen = p->blocksize + 1 - buflen;
+
+        if (catlen > srclen - srcoff) {
+            catlen = srclen - srcoff;
+        }
+
+        rb_str_cat(p->srcbuf, srcptr + srcoff, catlen);
+        srcoff += catlen;
+        buflen += catlen;
+
+        if (buflen <= p->blocksize) {
+            break;
+        }
+
+        size_t cut = aux_find_last_separator(RSTRING_PTR(p->srcbuf), p->blocksize,
+                                             RSTRING_PTR(p->align), RSTRING_LEN(p->align));
+        if (cut == 0) {
+            cut = p->blocksize;
+        }
+
+        encoder_write_encode(self, p, RSTRING_PTR(p->srcbuf), cut);
+        rb_str_modify(p->srcbuf);
+        memmove(RSTRING_PTR(p->srcbuf), RSTRING_PTR(p->srcbuf) + cut, buflen - cut);
+        rb_str_set_len(p->srcbuf, buflen - cut);
+
+        aux_src_bytes(src, &srcptr, &srclen); // maybe changed src with `outport << destbuf`
+    }
+
+    return self;
+}
+
+/*
+ * concurrent の場合の待ち合わせです。
+ *
+ * srcbuf などの操作はすべて GVL を持ったまま行うため、GVL 以外のロックは使いません。
+ * 待つスレッドは waiters に自身を登録して眠り、圧縮を行うスレッドが1ブロックごとに起こします。
+ * 条件の検査から眠るまでの間に GVL を手放さないため、起こし損ねることはありません。
+ */
+static void
+encoder_wait(struct encoder *p)
+{
+    if (RB_NIL_P(p->waiters)) {
+        p->waiters = rb_ary_new();
+    }
+
+    rb_ary_push(p->waiters, rb_thread_current());
+    rb_thread_sleep_forever();
+}
+
+static void
+encoder_wake(struct encoder *p)
+{
+    if (!RB_NIL_P(p->waiters) && RARRAY_LEN(p->waiters) > 0) {
+        for (long i = 0; i < RARRAY_LEN(p->waiters); i++) {
+            rb_thread_wakeup_alive(RARRAY_AREF(p->waiters, i));
+        }
+
+        rb_ary_clear(p->waiters);
+    }
+}
+
+struct encoder_drain_args
+{
+    VALUE self;
+    struct encoder *p;
+    int all;
+    VALUE taken;
+    size_t len;
+    size_t off;
+    double oldest;              /* taken の oldest と mark */
+    double mark;
+};
+
+static VALUE
+encoder_drain_taken(VALUE arg)
+{
+    struct encoder_drain_args *args = (struct encoder_drain_args *)arg;
+    struct encoder *p = args->p;
+
+    while (args->len - args->off >= p->blocksize || (args->all && args->off < args->len)) {
+        size_t n = (args->len - args->off < p->blocksize ? args->len - args->off : p->blocksize);
+        encoder_write_encode(args->self, p, RSTRING_PTR(args->taken) + args->off, n);
+        args->off += n;
+        encoder_wake(p);
+    }
+
+    return Qnil;
+}
+
+/*
+ * 圧縮しきれなかった端数を、新しい srcbuf の内容の前に戻します。
+ * outport が例外を発生させた場合も、書き出せなかったデータを失わないように必ず呼ばれます。
+ */
+static VALUE
+encoder_drain_restore(VALUE arg)
+{
+    struct encoder_drain_args *args = (struct encoder_drain_args *)arg;
+    struct encoder *p = args->p;
+    VALUE taken = args->taken;
+
+    rb_str_modify(taken);
+    memmove(RSTRING_PTR(taken), RSTRING_PTR(taken) + args->off, args->len - args->off);
+    rb_str_set_len(taken, args->len - args->off);
+    rb_str_cat(taken, RSTRING_PTR(p->srcbuf), RSTRING_LEN(p->srcbuf));
+    rb_str_set_len(p->srcbuf, 0);
+    p->spare = p->srcbuf;
+    p->srcbuf = taken;
+
+    size_t tail = args->len - args->off;
+    if (tail > 0) {
+        // 残した端数が最後のブロックそのものであれば、その先頭の時刻が分かっている
+        // (途中で中断した場合は、taken の最も古い時刻を使う)
+        size_t last = (args->len - 1) / p->blocksize * p->blocksize;
+        double tailtime = (args->off == last ? args->mark : args->oldest);
+        double newtime = p->oldest;
+
+        p->oldest = tailtime;
+        p->mark = ((size_t)RSTRING_LEN(taken) - 1) / p->blocksize * p->blocksize < tail ? tailtime : newtime;
+    }
+
+    return Qnil;
+}
+
+/*
+ * srcbuf を取り出して空の spare と入れ替えてから、ブロックサイズごとに圧縮して書き出します。
+ * GVL を手放して圧縮している間に他のスレッドが write したデータは、新しい srcbuf に溜まります。
+ *
+ * all が真の場合は、最初に取り出した分を端数まですべて圧縮します。
+ */
+static VALUE
+encoder_drain_main(VALUE arg)
+{
+    struct encoder_drain_args *args = (struct encoder_drain_args *)arg;
+    struct encoder *p = args->p;
+
+    for (;;) {
+        size_t len = RSTRING_LEN(p->srcbuf);
+
+        if (len == 0 || (!args->all && len < p->blocksize)) {
+            break;
+        }
+
+        args->taken = p->srcbuf;
+        args->len = len;
+        args->off = 0;
+        args->oldest = p->oldest;
+        args->mark = p->mark;
+        p->oldest = p->mark = 0.0;  // 新しい srcbuf の時刻は、write が改めて記録する
+        if (RB_NIL_P(p->spare)) {
+            p->spare = rb_str_new(NULL, 0);
+        }
+        p->srcbuf = p->spare;
+        p->spare = Qnil;
+
+        rb_ensure(encoder_drain_taken, arg, encoder_drain_restore, arg);
+
+        args->all = 0;
+    }
+
+    return Qnil;
+}
+
+static VALUE
+encoder_drain_ensure(VALUE arg)
+{
+    struct encoder *p = ((struct encoder_drain_args *)arg)->p;
+
+    p->encoding = 0;
+    encoder_wake(p);
+
+    if (!RB_NIL_P(p->timer) && p->oldest != 0.0) {
+        // 端数を戻したことで最も古いデータの時刻が早まるため、書き出すスレッドに確かめ直させる
+        rb_thread_wakeup_alive(p->timer);
+    }
+
+    return Qnil;
+}
+
+/*
+ * 他のスレッドが圧縮を行っていなければ、自身が圧縮を行います。
+ */
+static void
+encoder_drain(VALUE self, struct encoder *p, int all)
+{
+    if (all) {
+        while (p->encoding) {
+            encoder_wait(p);
+        }
+    } else if (p->encoding) {
+        return;
+    }
+
+    struct encoder_drain_args args = { self, p, all, Qnil, 0, 0, 0.0, 0.0 };
+    p->encoding = 1;
+    rb_ensure(encoder_drain_main, (VALUE)&args, encoder_drain_ensure, (VALUE)&args);
+}
+
+/*
+ * concurrent の場合の write 処理です。
+ *
+ * src を srcbuf へ一度に追加するため、各 write のデータは分割されずに受け付けた順に並びます。
+ */
+static VALUE
+encoder_write_concurrent(VALUE self, struct encoder *p, VALUE src)
+{
+    const char *srcptr;
+    size_t srclen;
+
+    while (p->encoding && (size_t)RSTRING_LEN(p->srcbuf) >= (size_t)p->blocksize * 2) {
+        encoder_wait(p);
+    }
+
+    if (p->closed) {
+        rb_raise(rb_eRuntimeError, "closed stream - %" PRIsVALUE, self);
+    }
+
+    aux_src_bytes(src, &srcptr, &srclen);
+    size_t before = RSTRING_LEN(p->srcbuf);
+    rb_str_cat(p->srcbuf, srcptr, srclen);
+
+    if (srclen > 0 && (before + srclen - 1) / p->blocksize * p->blocksize >= before) {
+        // このデータが最後のブロックの先頭を含む
+        p->mark = extbzip3_idle_now();
+
+        if (before == 0) {
+            p->oldest = p->mark;
+
+            if (!RB_NIL_P(p->timer)) {
+                rb_thread_wakeup_alive(p->timer);
+            }
+        }
+    }
+
+    size_t len = RSTRING_LEN(p->srcbuf);
+    if (len >= p->blocksize) {
+        encoder_drain(self, p, 0);
+    } else if (p->max_latency > 0.0 && !p->encoding && len > 0 && len >= p->min_block &&
+               extbzip3_idle_now() >= p->oldest + p->max_latency) {
+        // 期限を過ぎていれば、書き出すスレッドを待たずに書き出す
+        encoder_drain(self, p, 1);
+    }
+
+    return self;
+}
+
+static VALUE
+encoder_write_main(VALUE arg)
+{
+    struct encoder_write_args *args = (struct encoder_write_args *)arg;
+    VALUE self = args->self;
+    struct encoder *p = args->p;
+    VALUE src = args->src;
+    const char *srcptr;
+    size_t srclen;
+
+    if (!RB_NIL_P(p->align)) {
+        return encoder_write_aligned(self, p, src);
+    }
+
+    if (p->concurrent) {
+        if (!rb_type_p(p->srcbuf, RUBY_T_STRING)) {
+            p->srcbuf = rb_str_new(NULL, 0);
+        }
+
+        return encoder_write_concurrent(self, p, src);
+    }
+
+    aux_src_bytes(src, &srcptr, &srclen);
 
     if (srclen <= p->blocksize) {
         if (rb_type_p(p->srcbuf, RUBY_T_STRING)) {
@@ -181,10 +789,13 @@ encoder_write(VALUE self, VALUE src)
             size_t catlen = srclen + srcbuflen;
 
             if (catlen >= p->blocksize) {
-                rb_str_cat(p->srcbuf, RSTRING_PTR(src), p->blocksize - srcbuflen);
+                rb_str_cat(p->srcbuf, srcptr, p->blocksize - srcbuflen);
                 encoder_write_encode(self, p, RSTRING_PTR(p->srcbuf), RSTRING_LEN(p->srcbuf));
                 rb_str_set_len(p->srcbuf, 0);
-                rb_str_cat(p->srcbuf, RSTRING_PTR(src) + p->blocksize - srcbuflen, srclen - (p->blocksize - srcbuflen));
+                aux_src_bytes(src, &srcptr, &srclen); // maybe changed src with `outport << destbuf`
+                if (srclen > p->blocksize - srcbuflen) {
+                    rb_str_cat(p->srcbuf, srcptr + p->blocksize - srcbuflen, srclen - (p->blocksize - srcbuflen));
+                }
 
                 return self;
             }
@@ -192,7 +803,7 @@ encoder_write(VALUE self, VALUE src)
             p->srcbuf = rb_str_new(0, 0);
         }
 
-        rb_str_cat(p->srcbuf, RSTRING_PTR(src), srclen);
+        rb_str_cat(p->srcbuf, srcptr, srclen);
 
         return self;
     } else {
@@ -200,19 +811,19 @@ encoder_write(VALUE self, VALUE src)
 
         if (rb_type_p(p->srcbuf, RUBY_T_STRING) && RSTRING_LEN(p->srcbuf) > 0) {
             srcoff = p->blocksize - RSTRING_LEN(p->srcbuf);
-            rb_str_cat(p->srcbuf, RSTRING_PTR(src), srcoff);
+            rb_str_cat(p->srcbuf, srcptr, srcoff);
             encoder_write_encode(self, p, RSTRING_PTR(p->srcbuf), RSTRING_LEN(p->srcbuf));
             rb_str_set_len(p->srcbuf, 0);
-            srclen = RSTRING_LEN(src); // maybe changed src with `outport << destbuf`
+            aux_src_bytes(src, &srcptr, &srclen); // maybe changed src with `outport << destbuf`
             if (srclen < srcoff) {
                 return self;
             }
         }
 
         while (srclen - srcoff > p->blocksize) {
-            encoder_write_encode(self, p, RSTRING_PTR(src) + srcoff, p->blocksize);
+            encoder_write_encode(self, p, srcptr + srcoff, p->blocksize);
             srcoff += p->blocksize;
-            srclen = RSTRING_LEN(src); // maybe changed src with `outport << destbuf`
+            aux_src_bytes(src, &srcptr, &srclen); // maybe changed src with `outport << destbuf`
             if (srclen < srcoff) {
                 return self;
             }
@@ -223,18 +834,52 @@ encoder_write(VALUE self, VALUE src)
                 p->srcbuf = rb_str_new(0, 0);
             }
 
-            rb_str_cat(p->srcbuf, RSTRING_PTR(src), srclen - srcoff);
+            rb_str_cat(p->srcbuf, srcptr + srcoff, srclen - srcoff);
         }
 
         return self;
     }
 }
 
+/*
+ *  @overload write(src)
+ *
+ *  @param  src         [String, IO::Buffer]
+ *  @return [Encoder]   self
+ */
 static VALUE
-encoder_flush(VALUE self)
+encoder_write_locked(VALUE arg)
+{
+    struct encoder_write_args *args = (struct encoder_write_args *)arg;
+
+    return aux_io_buffer_locked_call(args->src, Qnil, encoder_write_main, arg);
+}
+
+static VALUE
+encoder_write(VALUE self, VALUE src)
+{
+    struct encoder_write_args args = { self, get_encoder(self), src };
+
+    if (args.p->closed) {
+        rb_raise(rb_eRuntimeError, "closed stream - %" PRIsVALUE, self);
+    }
+
+    return extbzip3_idle_call(&args.p->idle, encoder_write_locked, (VALUE)&args);
+}
+
+static VALUE
+encoder_flush_main(VALUE self)
 {
     struct encoder *p = get_encoder(self);
 
+    if (p->concurrent) {
+        if (rb_type_p(p->srcbuf, RUBY_T_STRING)) {
+            encoder_drain(self, p, 1);
+        }
+
+        return Qnil;
+    }
+
     if (rb_type_p(p->srcbuf, RUBY_T_STRING) && RSTRING_LEN(p->srcbuf) > 0) {
         encoder_write_encode(self, p, RSTRING_PTR(p->srcbuf), RSTRING_LEN(p->srcbuf));
         rb_str_set_len(p->srcbuf, 0);
@@ -243,89 +888,378 @@ encoder_flush(VALUE self)
     return Qnil;
 }
 
+static VALUE
+encoder_flush(VALUE self)
+{
+    struct encoder *p = get_encoder(self);
+
+    if (p->closed) {
+        rb_raise(rb_eRuntimeError, "closed stream - %" PRIsVALUE, self);
+    }
+
+    return extbzip3_idle_call(&p->idle, encoder_flush_main, self);
+}
+
+#define ENCODER_TIMER_POLL 1.0    /* srcbuf が空の間に、Encoder が回収されていないかを確かめる間隔 (秒) */
+
+/*
+ * 書き出す時刻になっていれば書き出し、次に確かめるまでの秒数を返します。終了する場合は負の値を返します。
+ *
+ * Encoder をスタックに残したまま眠ると回収されなくなるため、眠る処理とは別の関数にしています。
+ */
+NOINLINE(static double encoder_timer_step(VALUE ref));
+
+static double
+encoder_timer_step(VALUE ref)
+{
+    VALUE self = rb_funcall(RARRAY_AREF(ref, 0), rb_intern("[]"), 1, RARRAY_AREF(ref, 1));
+
+    if (RB_NIL_P(self)) {
+        return -1.0;
+    }
+
+    struct encoder *p = get_encoder(self);
+
+    if (p->closed) {
+        return -1.0;
+    }
+
+    size_t len = (rb_type_p(p->srcbuf, RUBY_T_STRING) ? RSTRING_LEN(p->srcbuf) : 0);
+
+    if (len == 0 || p->oldest == 0.0) {
+        return ENCODER_TIMER_POLL;
+    }
+
+    double wait = p->oldest + p->max_latency - extbzip3_idle_now();
+
+    if (wait > 0.0) {
+        return wait;
+    }
+
+    extbzip3_idle_call(&p->idle, encoder_flush_main, self);
+
+    return 0.0;
+}
+
+/*
+ * max_latency の場合に、部分ブロックを書き出すスレッドの本体です。
+ *
+ * ref は Encoder を値に持つ ObjectSpace::WeakMap とそのキーの組です。
+ * srcbuf が空の間は ENCODER_TIMER_POLL 秒ごとに確かめ、最初のデータを受け付けた write に起こされます。
+ * close されるか、Encoder が回収されると終了します。
+ */
+static VALUE
+encoder_timer_main(void *arg)
+{
+    VALUE ref = (VALUE)arg;
+    double wait;
+
+    while ((wait = encoder_timer_step(ref)) >= 0.0) {
+        if (wait > 0.0) {
+            struct timeval tv = { (time_t)wait, (long)((wait - (double)(time_t)wait) * 1e6) + 1 };
+            rb_thread_wait_for(tv);
+        }
+    }
+
+    RB_GC_GUARD(ref);
+
+    return Qnil;
+}
+
+/*
+ *  @overload close
+ *
+ *  残りのデータを圧縮して書き出し、bz3_state と作業用の文字列をすぐに解放します。
+ *  outport は閉じません。
+ */
 static VALUE
 encoder_close(VALUE self)
 {
     struct encoder *p = get_encoder(self);
 
-    if (rb_type_p(p->srcbuf, RUBY_T_STRING) && RSTRING_LEN(p->srcbuf) > 0) {
-        encoder_write_encode(self, p, RSTRING_PTR(p->srcbuf), RSTRING_LEN(p->srcbuf));
-        rb_str_set_len(p->srcbuf, 0);
+    if (p->closed) {
+        return Qnil;
     }
 
+    if (p->concurrent) {
+        // 以降の write を拒否してから、受け付けたデータをすべて書き出す
+        p->closed = 1;
+    }
+
+    extbzip3_idle_call(&p->idle, encoder_flush_main, self);
+
     p->closed = 1;
 
+    if (!RB_NIL_P(p->timer)) {
+        // 書き出すスレッドで起きた例外は、ここで改めて発生させる
+        VALUE timer = p->timer;
+        p->timer = Qnil;
+        rb_thread_wakeup_alive(timer);
+        rb_funcall(timer, rb_intern("join"), 0);
+    }
+
+    extbzip3_idle_unregister(&p->idle);
+    encoder_release(p);
+    p->srcbuf = p->destbuf = Qnil;
+
     return Qnil;
 }
 
+/*
+ *  @overload trim
+ *
+ *  bz3_state と作業用の文字列を今すぐ解放します。解放した bz3_state は次の write で確保し直されます。
+ *
+ *  @return [Encoder]   self
+ */
+static VALUE
+encoder_trim(VALUE self)
+{
+    extbzip3_idle_trim(&get_encoder(self)->idle);
+
+    return self;
+}
+
 static VALUE
 encoder_closed_p(VALUE self)
 {
     return get_encoder(self)->closed ? Qtrue : Qfalse;
 }
 
+struct encoder_s_encode_args
+{
+    VALUE src, dest;
+    size_t maxdest;
+    int format;
+    uint32_t blocksize;
+    VALUE cache;
+    int shrink;                 /* dest をこちらで作った場合は、余分な容量を切り詰めて返す */
+
+    const char *srcp;
+    size_t insize;
+    int headersize;
+    size_t blockcount;
+    char *destp;
+    size_t capa;
+    struct aux_oneshot_encode enc;
+};
+
+static VALUE
+encoder_s_encode_run(VALUE arg)
+{
+    struct encoder_s_encode_args *args = (struct encoder_s_encode_args *)arg;
+
+    aux_call_without_gvl_ubf(aux_oneshot_encode_nogvl, &args->enc, aux_oneshot_encode_ubf, &args->enc);
+
+    return Qnil;
+}
+
+/*
+ * ここまでの圧縮率から残りの出力の大きさを見積もって、出力先を広げます。
+ * 入力全体の bz3_bound を最初から確保すると、よく縮むデータでは入力と同じくらいのメモリが無駄になるためです。
+ */
+static void
+encoder_s_encode_grow(struct encoder_s_encode_args *args)
+{
+    struct aux_oneshot_encode *e = &args->enc;
+    size_t written = (size_t)((char *)e->outp - args->destp);
+    size_t consumed = (size_t)((const char *)e->inp - args->srcp);
+    size_t remain = (size_t)(e->inend - e->inp);
+
+    size_t estimate = (size_t)((double)remain * (double)(written - args->headersize) / (double)consumed);
+    size_t capa = written + estimate + estimate / 8 + e->needsize;
+    if (capa < written + written / 4) {
+        capa = written + written / 4; // 見積もりが外れ続けても、広げる回数が増えすぎないようにする
+    }
+
+    size_t fullblocks = remain / e->blocksize;
+    size_t limit = written + fullblocks * (8 + bz3_bound(e->blocksize)) + 8 + bz3_bound(remain % e->blocksize);
+    if (capa > limit) {
+        capa = limit;
+    }
+
+    rb_str_set_len(args->dest, written);
+    rb_str_modify_expand(args->dest, capa - written);
+
+    args->destp = RSTRING_PTR(args->dest);
+    args->capa = capa;
+    e->outp = (uint8_t *)args->destp + written;
+    e->outend = (uint8_t *)args->destp + capa;
+    e->needsize = 0;
+}
+
+static VALUE
+encoder_s_encode_body(VALUE arg)
+{
+    struct encoder_s_encode_args *args = (struct encoder_s_encode_args *)arg;
+    struct aux_oneshot_encode *e = &args->enc;
+
+    if (args->maxdest == SIZE_MAX && rb_type_p(args->dest, RUBY_T_STRING)) {
+        // 最初のブロックの分だけを確保し、残りは圧縮率を見ながら広げる
+        size_t first = (args->insize < e->blocksize ? args->insize : e->blocksize);
+        args->capa = args->headersize + 8 + bz3_bound(first);
+        e->growable = 1;
+    } else {
+        args->capa = args->maxdest;
+    }
+
+    args->destp = aux_dest_prepare(args->dest, &args->capa);
+
+    if (args->capa < (size_t)args->headersize) {
+        extbzip3_check_error(BZ3_ERR_INIT);
+    }
+
+    e->bz3 = aux_bz3_new(e->blocksize);
+    e->outp = (uint8_t *)args->destp + args->headersize;
+    e->outend = (uint8_t *)args->destp + args->capa;
+
+    for (;;) {
+        aux_str_locked_call(args->dest, encoder_s_encode_run, arg);
+
+        if (e->interrupted) {
+            // 例外にならない割り込み (シグナルハンドラなど) であれば、続きのブロックから再開する
+            e->interrupted = 0;
+            rb_thread_check_ints();
+        } else if (e->needsize == 0) {
+            break;
+        } else {
+            encoder_s_encode_grow(args);
+        }
+    }
+
+    extbzip3_check_error(e->status);
+
+    size_t outsize = (size_t)((char *)e->outp - args->destp);
+
+    memcpy(args->destp, aux_bzip3_signature, sizeof(aux_bzip3_signature));
+    storeu32le(args->destp + 5, e->blocksize);
+
+    if (args->format == AUX_BZIP3_V1_FRAME_FORMAT) {
+        storeu32le(args->destp + 9, (uint32_t)args->blockcount);
+    }
+
+    if (args->shrink) {
+        return rb_str_resize(args->dest, outsize);
+    }
+
+    return aux_dest_finish(args->dest, outsize);
+}
+
+static VALUE
+encoder_s_encode_cleanup(VALUE arg)
+{
+    struct aux_oneshot_encode *e = &((struct encoder_s_encode_args *)arg)->enc;
+
+    if (e->bz3) {
+        aux_bz3_free(e->bz3, e->blocksize);
+        e->bz3 = NULL;
+    }
+
+    free(e->scratch);
+    e->scratch = NULL;
+
+    return Qnil;
+}
+
+static VALUE
+encoder_s_encode_main(VALUE arg)
+{
+    struct encoder_s_encode_args *args = (struct encoder_s_encode_args *)arg;
+    VALUE src = aux_str_pin(args->src);
+    aux_src_bytes(src, &args->srcp, &args->insize);
+
+    uint32_t blocksize = args->blocksize;
+    if (blocksize < AUX_BZIP3_BLOCKSIZE_MIN) {
+        blocksize = AUX_BZIP3_BLOCKSIZE_MIN;
+    } else if (blocksize > AUX_BZIP3_BLOCKSIZE_MAX) {
+        extbzip3_check_error(BZ3_ERR_INIT);
+    }
+
+    if (args->format == AUX_BZIP3_V1_FILE_FORMAT) {
+        args->headersize = 9;
+        args->blockcount = 0;
+    } else {
+        args->headersize = 13;
+        args->blockcount = (args->insize / blocksize) + ((args->insize % blocksize != 0) ? 1 : 0);
+
+        if (args->blockcount > (UINT32_MAX - 1)) {
+            extbzip3_check_error(BZ3_ERR_DATA_TOO_BIG);
+        }
+    }
+
+    memset(&args->enc, 0, sizeof(args->enc));
+    args->enc.cache = extbzip3_get_cache(args->cache);
+    args->enc.blocksize = blocksize;
+    args->enc.inp = (const uint8_t *)args->srcp;
+    args->enc.inend = (const uint8_t *)args->srcp + args->insize;
+
+    VALUE ret = rb_ensure(encoder_s_encode_body, arg, encoder_s_encode_cleanup, arg);
+    RB_GC_GUARD(src);
+
+    return ret;
+}
+
 /*
  *  @overload encode(src, maxdest = nil, dest = "", **opts)
  *  @overload encode(src, dest, **opts)
  *
- *  @return [String]
- *      dest as decompression data
- *  @param  [String]    src
+ *  @return [String, IO::Buffer]
+ *      dest as decompression data.
+ *      If dest is IO::Buffer, returns a slice of it covering the written bytes.
+ *  @param  [String, IO::Buffer]    src
  *  @param  [Integer]   maxdest
- *  @param  [String]    dest
+ *  @param  [String, IO::Buffer]    dest
  *  @option opts        [Integer]       :blocksize ((16 << 20))
  *  @option opts                        :format (Bzip3::V1_FILE_FORMAT)
  *      Bzip3::V1_FILE_FORMAT, Bzip3::V1_FRAME_FORMAT
+ *  @option opts        [Bzip3::BlockCache] :cache (nil)
  */
 static VALUE
 encoder_s_encode(int argc, VALUE argv[], VALUE mod)
 {
-    size_t insize, outsize;
     struct { VALUE src, maxdest, dest, opts; } args;
+    struct encoder_s_encode_args encargs;
+
     switch (rb_scan_args(argc, argv, "12:", &args.src, &args.maxdest, &args.dest, &args.opts)) {
     case 1:
-        insize = RSTRING_LEN(args.src);
-        outsize = bz3_bound(insize);
-        args.dest = rb_str_buf_new(outsize);
+        encargs.maxdest = SIZE_MAX;
+        encargs.dest = rb_str_buf_new(0);
+        encargs.shrink = 1;
         break;
     case 2:
-        insize = RSTRING_LEN(args.src);
-
         if (rb_type_p(args.maxdest, RUBY_T_FIXNUM) || rb_type_p(args.maxdest, RUBY_T_BIGNUM)) {
-            outsize = NUM2SIZET(args.maxdest);
-            args.dest = rb_str_buf_new(outsize);
+            encargs.maxdest = NUM2SIZET(args.maxdest);
+            encargs.dest = rb_str_buf_new(0);
+            encargs.shrink = 1;
         } else {
-            args.dest = args.maxdest;
-            outsize = bz3_bound(insize);
-            rb_str_modify(args.dest);
-            rb_str_set_len(args.dest, 0);
-            rb_str_modify_expand(args.dest, outsize);
+            encargs.maxdest = SIZE_MAX;
+            encargs.dest = args.maxdest;
+            encargs.shrink = 0;
         }
 
         break;
     case 3:
-        insize = RSTRING_LEN(args.src);
-        outsize = NUM2SIZET(args.maxdest);
-        rb_str_modify(args.dest);
-        rb_str_set_len(args.dest, 0);
-        rb_str_modify_expand(args.dest, outsize);
+        encargs.maxdest = NUM2SIZET(args.maxdest);
+        encargs.dest = args.dest;
+        encargs.shrink = 0;
 
         break;
     }
 
-    enum { numkw = 2 };
-    ID idtab[numkw] = { rb_intern("blocksize"), rb_intern("format") };
-    union { struct { VALUE blocksize, format; }; VALUE vect[numkw]; } opts;
+    aux_check_dest(encargs.dest);
+
+    enum { numkw = 3 };
+    ID idtab[numkw] = { rb_intern("blocksize"), rb_intern("format"), rb_intern("cache") };
+    union { struct { VALUE blocksize, format, cache; }; VALUE vect[numkw]; } opts;
     rb_get_kwargs(args.opts, idtab, 0, numkw, opts.vect);
 
-    uint32_t blocksize = aux_conv_to_blocksize(opts.blocksize);
-    int status = aux_oneshot_encode(aux_conv_to_format(opts.format), blocksize,
-                                    RSTRING_PTR(args.src), RSTRING_PTR(args.dest),
-                                    insize, &outsize);
-    extbzip3_check_error(status);
-    rb_str_set_len(args.dest, outsize);
+    extbzip3_get_cache(opts.cache);
+    encargs.src = args.src;
+    encargs.cache = (RB_UNDEF_P(opts.cache) ? Qnil : opts.cache);
+    encargs.format = aux_conv_to_format(opts.format);
+    encargs.blocksize = aux_conv_to_blocksize(opts.blocksize);
 
-    return args.dest;
+    return aux_io_buffer_locked_call(encargs.src, encargs.dest, encoder_s_encode_main, (VALUE)&encargs);
 }
 
 void
@@ -340,5 +1274,6 @@ extbzip3_init_encoder(VALUE bzip3_module)
     rb_define_method(encoder_class, "flush", encoder_flush, 0);
     rb_define_method(encoder_class, "close", encoder_close, 0);
     rb_define_method(encoder_class, "closed?", encoder_closed_p, 0);
+    rb_define_method(encoder_class, "trim", encoder_trim, 0);
     rb_define_alias(encoder_class, "<<", "write");
 }
@@ -0,0 +1,346 @@
+#include "extbzip3.h"
+#include <math.h>
+#include <time.h>
+
+/*
+ * Bzip3.estimate の実装です。
+ *
+ * 入力からいくつかの部分を抜き出し、次の値を求めて圧縮率と所要時間を見積もります。
+ *
+ *  - 0 次のエントロピー (バイトの出現頻度)
+ *  - 1 次のエントロピー (直前のバイトを文脈とした出現頻度)
+ *  - 4 バイト列の繰り返しの割合
+ *  - 抜き出した部分を実際に bz3_encode_block で圧縮した結果 (trial: true の場合)
+ */
+
+#define ESTIMATE_TRIAL_BLOCKSIZE AUX_BZIP3_BLOCKSIZE_MIN
+#define ESTIMATE_REPEAT_BITS 14
+
+/* 試験圧縮しない場合に仮定する処理速度 (バイト/マイクロ秒) */
+#define ESTIMATE_DEFAULT_THROUGHPUT 10.0
+
+static VALUE estimate_class;
+
+/*
+ * 試験圧縮のために使い回す bz3_state です。
+ *
+ * 同時に使おうとした側は新しく確保し、返却時に空きがなければ解放します。
+ * メモリの予算が足りない場合は確保せず、試験圧縮を行いません。
+ */
+static struct bz3_state *estimate_cached_state;
+
+static struct bz3_state *
+estimate_take_state(void)
+{
+    struct bz3_state *bz3 = __atomic_exchange_n(&estimate_cached_state, NULL, __ATOMIC_ACQ_REL);
+
+    if (bz3 == NULL && extbzip3_memory_reserve(aux_bz3_footprint(ESTIMATE_TRIAL_BLOCKSIZE))) {
+        bz3 = bz3_new(ESTIMATE_TRIAL_BLOCKSIZE);
+
+        if (bz3 == NULL) {
+            extbzip3_memory_release(aux_bz3_footprint(ESTIMATE_TRIAL_BLOCKSIZE));
+        }
+    }
+
+    return bz3;
+}
+
+static void
+estimate_return_state(struct bz3_state *bz3)
+{
+    struct bz3_state *expected = NULL;
+
+    if (bz3 && !__atomic_compare_exchange_n(&estimate_cached_state, &expected, bz3, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        aux_bz3_free(bz3, ESTIMATE_TRIAL_BLOCKSIZE);
+    }
+}
+
+static double
+estimate_now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#else
+    return (double)clock() * 1e6 / CLOCKS_PER_SEC;
+#endif
+}
+
+struct estimate
+{
+    const uint8_t *src;
+    size_t srclen;
+    size_t samplesize;
+    int nsamples;
+    int trial;
+
+    size_t sampled;
+    double order0;
+    double order1;
+    double repeats;
+    double trial_ratio;
+    double trial_us;
+    int status;
+};
+
+static double
+estimate_entropy(const uint32_t *counts, size_t num, uint64_t total)
+{
+    double bits = 0.0;
+
+    for (size_t i = 0; i < num; i++) {
+        if (counts[i] > 0) {
+            double p = (double)counts[i] / (double)total;
+            bits -= (double)counts[i] * log2(p);
+        }
+    }
+
+    return bits;
+}
+
+static void *
+estimate_nogvl(void *opaque)
+{
+    struct estimate *e = (struct estimate *)opaque;
+    uint32_t *order1 = (uint32_t *)calloc(256 * 256 + 256, sizeof(uint32_t));
+    uint32_t *repeat = (uint32_t *)calloc(1 << ESTIMATE_REPEAT_BITS, sizeof(uint32_t));
+    uint8_t *trialbuf = (e->trial ? (uint8_t *)malloc(bz3_bound(ESTIMATE_TRIAL_BLOCKSIZE)) : NULL);
+
+    if (!order1 || !repeat || (e->trial && !trialbuf)) {
+        free(order1);
+        free(repeat);
+        free(trialbuf);
+        e->status = BZ3_ERR_INIT;
+        return NULL;
+    }
+
+    uint32_t *order0 = order1 + 256 * 256;
+    uint64_t repeated = 0, grams = 0;
+    size_t trialused = 0;
+    size_t stride = (e->nsamples > 1 ? (e->srclen - e->samplesize) / (e->nsamples - 1) : 0);
+
+    for (int i = 0; i < e->nsamples; i++) {
+        const uint8_t *p = e->src + stride * i;
+        size_t len = e->samplesize;
+
+        for (size_t j = 0; j < len; j++) {
+            order0[p[j]]++;
+
+            if (j > 0) {
+                order1[(p[j - 1] << 8) | p[j]]++;
+            }
+
+            if (j >= 3) {
+                uint32_t gram = loadu32le(p + j - 3);
+                uint32_t h = (gram * 2654435761u) >> (32 - ESTIMATE_REPEAT_BITS);
+
+                if (repeat[h] == gram + 1) {
+                    repeated++;
+                }
+
+                repeat[h] = gram + 1;
+                grams++;
+            }
+        }
+
+        if (trialbuf && trialused < ESTIMATE_TRIAL_BLOCKSIZE) {
+            size_t n = ESTIMATE_TRIAL_BLOCKSIZE - trialused;
+            n = (n < len ? n : len);
+            memcpy(trialbuf + trialused, p, n);
+            trialused += n;
+        }
+
+        e->sampled += len;
+    }
+
+    e->order0 = estimate_entropy(order0, 256, e->sampled) / (double)e->sampled;
+
+    double h1 = 0.0;
+    uint64_t pairs = 0;
+    for (int prev = 0; prev < 256; prev++) {
+        uint32_t *row = order1 + (prev << 8);
+        uint64_t rowtotal = 0;
+
+        for (int c = 0; c < 256; c++) {
+            rowtotal += row[c];
+        }
+
+        if (rowtotal > 0) {
+            h1 += estimate_entropy(row, 256, rowtotal);
+            pairs += rowtotal;
+        }
+    }
+
+    e->order1 = (pairs > 0 ? h1 / (double)pairs : e->order0);
+    e->repeats = (grams > 0 ? (double)repeated / (double)grams : 0.0);
+
+    if (trialbuf && trialused > 0) {
+        struct bz3_state *bz3 = estimate_take_state();
+
+        if (bz3) {
+            double start = estimate_now_us();
+            int32_t ret = bz3_encode_block(bz3, trialbuf, (int32_t)trialused);
+            e->trial_us = estimate_now_us() - start;
+
+            if (ret > 0) {
+                e->trial_ratio = (double)(ret + 8) / (double)trialused;
+                e->trial_us = e->trial_us / (double)trialused;
+            }
+
+            estimate_return_state(bz3);
+        }
+    }
+
+    free(order1);
+    free(repeat);
+    free(trialbuf);
+
+    return NULL;
+}
+
+/*
+ * 見積もり結果から、入力に対して費用対効果のよいブロックサイズを選びます。
+ *
+ * 入力全体を1ブロックに収められるならその大きさを、
+ * そうでない場合は繰り返しが多い (遠くの重複が効く) ほど大きなブロックサイズを選びます。
+ */
+static uint32_t
+estimate_blocksize(const struct estimate *e)
+{
+    uint32_t blocksize;
+
+    if (e->srclen <= (16 << 20)) {
+        blocksize = (uint32_t)e->srclen;
+    } else if (e->repeats > 0.5) {
+        blocksize = 64 << 20;
+    } else {
+        blocksize = 16 << 20;
+    }
+
+    return (blocksize < AUX_BZIP3_BLOCKSIZE_MIN ? AUX_BZIP3_BLOCKSIZE_MIN : blocksize);
+}
+
+struct estimate_args
+{
+    VALUE src;
+    struct estimate *e;
+};
+
+static VALUE
+estimate_main(VALUE arg)
+{
+    struct estimate_args *args = (struct estimate_args *)arg;
+    struct estimate *e = args->e;
+    const char *ptr;
+
+    aux_src_bytes(args->src, &ptr, &e->srclen);
+    e->src = (const uint8_t *)ptr;
+
+    if (e->samplesize * e->nsamples > e->srclen) {
+        e->samplesize = e->srclen / e->nsamples;
+
+        if (e->samplesize == 0) {
+            e->nsamples = 1;
+            e->samplesize = e->srclen;
+        }
+    }
+
+    if (e->srclen > 0) {
+        aux_call_without_gvl(estimate_nogvl, e);
+    }
+
+    return Qnil;
+}
+
+/*
+ *  @overload estimate(src, sample: (16 << 10), samples: 4, trial: true)
+ *
+ *  src を圧縮した場合の圧縮率と所要時間を、抜き出した一部分から見積もります。
+ *
+ *  @param  src         [String, IO::Buffer]
+ *  @option opts        [Integer]       :sample ((16 << 10))
+ *      1か所から抜き出す大きさ
+ *  @option opts        [Integer]       :samples (4)
+ *      抜き出す箇所の数 (入力全体に均等に配置します)
+ *  @option opts        [true, false]   :trial (true)
+ *      抜き出した部分を実際に圧縮して見積もりに使うかどうか
+ *  @return [Bzip3::Estimate]
+ *      - `ratio`: 圧縮後の大きさ / 元の大きさ の予想値
+ *      - `encode_us`: src 全体を圧縮するのに掛かる時間 (マイクロ秒) の予想値
+ *      - `blocksize`: 推奨するブロックサイズ
+ *      - `order0`, `order1`: 0 次、1 次のエントロピー (ビット/バイト)
+ *      - `repeats`: 4 バイト列が繰り返し現れた割合
+ *      - `sampled`: 実際に調べたバイト数
+ */
+static VALUE
+estimate_s_estimate(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "1:", &src, &opts);
+
+    enum { numkw = 3 };
+    ID idtab[numkw] = { rb_intern("sample"), rb_intern("samples"), rb_intern("trial") };
+    union { struct { VALUE sample, samples, trial; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    struct estimate e;
+    memset(&e, 0, sizeof(e));
+    e.samplesize = (RB_NIL_OR_UNDEF_P(kw.sample) ? (16 << 10) : NUM2SIZET(kw.sample));
+    e.nsamples = (RB_NIL_OR_UNDEF_P(kw.samples) ? 4 : NUM2INT(kw.samples));
+    e.trial = RB_UNDEF_P(kw.trial) || RTEST(kw.trial);
+
+    if (e.samplesize < 1 || e.samplesize > AUX_BZIP3_BLOCKSIZE_MAX) {
+        rb_raise(rb_eArgError, "out of range for sample (expect 1..%d)", AUX_BZIP3_BLOCKSIZE_MAX);
+    }
+
+    if (e.nsamples < 1 || e.nsamples > 1024) {
+        rb_raise(rb_eArgError, "out of range for samples (expect 1..1024, but given %d)", e.nsamples);
+    }
+
+    src = aux_str_pin(src);
+
+    struct estimate_args args = { src, &e };
+    aux_io_buffer_locked_call(src, Qnil, estimate_main, (VALUE)&args);
+    RB_GC_GUARD(src);
+
+    if (e.status < 0) {
+        extbzip3_check_error(e.status);
+    }
+
+    double ratio;
+    if (e.sampled == 0) {
+        ratio = 1.0;
+    } else if (e.trial_ratio > 0.0) {
+        ratio = e.trial_ratio;
+    } else {
+        /* 1 次のエントロピーは標本が少ないと過小になるため、調べた量に応じて 0 次と混ぜる */
+        double w = (double)e.sampled / ((double)e.sampled + 256 * 256);
+        double bits = e.order0 * (1.0 - w) + (e.order1 < e.order0 ? e.order1 : e.order0) * w;
+        ratio = bits / 8.0 * (1.0 - e.repeats * 0.5) + 16.0 / (double)e.sampled;
+    }
+
+    double per_byte = (e.trial_ratio > 0.0 ? e.trial_us : 1.0 / ESTIMATE_DEFAULT_THROUGHPUT);
+
+    return rb_struct_new(estimate_class,
+                         SIZET2NUM(e.srclen),
+                         DBL2NUM(ratio),
+                         DBL2NUM(per_byte * (double)e.srclen),
+                         UINT2NUM(estimate_blocksize(&e)),
+                         DBL2NUM(e.order0),
+                         DBL2NUM(e.order1),
+                         DBL2NUM(e.repeats),
+                         SIZET2NUM(e.sampled));
+}
+
+void
+extbzip3_init_estimate(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    estimate_class = rb_struct_define_under(bzip3_module, "Estimate",
+                                            "size", "ratio", "encode_us", "blocksize",
+                                            "order0", "order1", "repeats", "sampled", NULL);
+    rb_define_singleton_method(bzip3_module, "estimate", estimate_s_estimate, -1);
+}
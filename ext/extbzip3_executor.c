@@ -0,0 +1,698 @@
+#include "extbzip3.h"
+
+/*
+ * プロセス全体で共有するネイティブスレッドの実行器です。
+ *
+ * ブロック単位の処理 (一括処理、ストリーム、BlockProcessor、BlockPool など) はすべてここで実行されます。
+ * 呼び出し側ごとに仕事の待ち行列 (struct extbzip3_queue) を持ち、
+ * 実行器は仕事のある待ち行列を順番に一つずつ取り出す (ラウンドロビン) ことで、
+ * 多くの仕事を積んだ呼び出し側が他の呼び出し側を待たせ続けないようにします。
+ *
+ * fork した子プロセスでは実行器を作り直します (親プロセスのワーカースレッドは引き継がれないため)。
+ * fork の前には実行器と登録されたロック (struct extbzip3_lock) をすべて取得し、
+ * 子プロセスでロックが持たれたまま残らないようにします。
+ */
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+
+#include <unistd.h>
+
+struct executor
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        /* 仕事が積まれた */
+    pthread_cond_t not_full;    /* 待ち行列に空きが出来た */
+    pthread_cond_t done;        /* 仕事が終わった */
+    int nlive;
+    int target;
+    size_t depth;               /* BlockPool などが積む仕事の総数の上限 */
+    size_t queued;
+    struct extbzip3_queue *ring_head;
+    struct extbzip3_queue *ring_tail;
+};
+
+static struct executor *executor;
+static pthread_mutex_t executor_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long executor_generation;
+static pthread_mutex_t lock_registry = PTHREAD_MUTEX_INITIALIZER;
+static struct extbzip3_lock *lock_head;
+static int config_threads;      /* 0 は既定値 */
+static size_t config_depth;     /* 0 は既定値 */
+
+static int
+executor_default_depth(int nthreads)
+{
+    return nthreads * 4;
+}
+
+static void
+executor_link(struct executor *ex, struct extbzip3_queue *q)
+{
+    q->next = NULL;
+    q->linked = 1;
+
+    if (ex->ring_tail) {
+        ex->ring_tail->next = q;
+    } else {
+        ex->ring_head = q;
+    }
+
+    ex->ring_tail = q;
+}
+
+/*
+ * ex->mutex を保持した状態で呼び出します。
+ */
+static void
+executor_unlink(struct executor *ex, struct extbzip3_queue *q)
+{
+    struct extbzip3_queue **pp = &ex->ring_head, *prev = NULL;
+
+    for (; *pp; prev = *pp, pp = &(*pp)->next) {
+        if (*pp == q) {
+            *pp = q->next;
+            if (ex->ring_tail == q) {
+                ex->ring_tail = prev;
+            }
+            break;
+        }
+    }
+
+    q->next = NULL;
+    q->linked = 0;
+}
+
+static void *
+executor_worker(void *opaque)
+{
+    struct executor *ex = (struct executor *)opaque;
+
+    pthread_mutex_lock(&ex->mutex);
+
+    for (;;) {
+        while (ex->nlive <= ex->target && ex->ring_head == NULL) {
+            pthread_cond_wait(&ex->work, &ex->mutex);
+        }
+
+        if (ex->nlive > ex->target) {
+            ex->nlive--;
+            break;
+        }
+
+        struct extbzip3_queue *q = ex->ring_head;
+        ex->ring_head = q->next;
+        if (ex->ring_head == NULL) {
+            ex->ring_tail = NULL;
+        }
+
+        struct extbzip3_task *task = q->head;
+        q->head = task->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        q->count--;
+        q->running++;
+        if (q->capacity > 0) {
+            ex->queued--;
+        }
+
+        // まだ仕事が残っていれば、他の待ち行列の後ろへ回す
+        if (q->head && q->running < q->limit) {
+            executor_link(ex, q);
+        } else {
+            q->linked = 0;
+        }
+
+        pthread_cond_broadcast(&ex->not_full);
+        pthread_mutex_unlock(&ex->mutex);
+
+        // task->detached が真の場合、task は func の中で解放されることがある
+        int detached = task->detached;
+        void *ret = task->func(task->arg);
+
+        pthread_mutex_lock(&ex->mutex);
+        q->running--;
+
+        if (q->head && !q->linked && q->running < q->limit) {
+            executor_link(ex, q);
+            pthread_cond_signal(&ex->work);
+        }
+
+        if (!detached) {
+            task->ret = ret;
+            task->done = 1;
+
+            if (task->cond) {
+                pthread_cond_signal(task->cond);
+            }
+        }
+
+        // extbzip3_queue_close で待っているスレッドだけを起こす
+        if (q->closed) {
+            pthread_cond_broadcast(&ex->done);
+        }
+
+        // 持ち主が手放した待ち行列は、最後の仕事が終わった時にここで後始末をする
+        if (q->orphan && q->running == 0) {
+            void (*orphan)(struct extbzip3_queue *) = q->orphan;
+            q->orphan = NULL;
+            pthread_mutex_unlock(&ex->mutex);
+            orphan(q);
+            pthread_mutex_lock(&ex->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&ex->mutex);
+
+    return NULL;
+}
+
+/*
+ * ex->mutex を保持した状態で呼び出します。
+ */
+static int
+executor_spawn(struct executor *ex)
+{
+    while (ex->nlive < ex->target) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, executor_worker, ex) != 0) {
+            return (ex->nlive > 0);
+        }
+
+        pthread_detach(thread);
+        ex->nlive++;
+    }
+
+    return 1;
+}
+
+void
+extbzip3_lock_init(struct extbzip3_lock *lock, pthread_cond_t *cond)
+{
+    pthread_mutex_init(&lock->mutex, NULL);
+    lock->cond = cond;
+    lock->atfork_child = NULL;
+    if (cond) {
+        pthread_cond_init(cond, NULL);
+    }
+
+    pthread_mutex_lock(&lock_registry);
+    lock->prev = NULL;
+    lock->next = lock_head;
+    if (lock_head) {
+        lock_head->prev = lock;
+    }
+    lock_head = lock;
+    pthread_mutex_unlock(&lock_registry);
+}
+
+/*
+ * GVL を持たない状態でも呼び出せます。lock->mutex を持った状態で呼び出してはいけません。
+ */
+void
+extbzip3_lock_destroy(struct extbzip3_lock *lock)
+{
+    pthread_mutex_lock(&lock_registry);
+    if (lock->prev) {
+        lock->prev->next = lock->next;
+    } else {
+        lock_head = lock->next;
+    }
+    if (lock->next) {
+        lock->next->prev = lock->prev;
+    }
+    pthread_mutex_unlock(&lock_registry);
+
+    if (lock->cond) {
+        pthread_cond_destroy(lock->cond);
+    }
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+/*
+ * ロックは executor_lock、ex->mutex、lock_registry、登録されたロックの順に取得します。
+ * 登録されたロック同士は入れ子にしないため、順番は問いません。
+ */
+static void
+executor_atfork_prepare(void)
+{
+    pthread_mutex_lock(&executor_lock);
+    if (executor) {
+        pthread_mutex_lock(&executor->mutex);
+    }
+
+    pthread_mutex_lock(&lock_registry);
+    for (struct extbzip3_lock *lock = lock_head; lock; lock = lock->next) {
+        pthread_mutex_lock(&lock->mutex);
+    }
+}
+
+static void
+executor_atfork_parent(void)
+{
+    for (struct extbzip3_lock *lock = lock_head; lock; lock = lock->next) {
+        pthread_mutex_unlock(&lock->mutex);
+    }
+    pthread_mutex_unlock(&lock_registry);
+
+    if (executor) {
+        pthread_mutex_unlock(&executor->mutex);
+    }
+    pthread_mutex_unlock(&executor_lock);
+}
+
+static void
+executor_atfork_child(void)
+{
+    // 親プロセスで待っていたスレッドは存在しないため、条件変数は初期化し直す
+    for (struct extbzip3_lock *lock = lock_head; lock; lock = lock->next) {
+        pthread_mutex_unlock(&lock->mutex);
+        if (lock->cond) {
+            pthread_cond_init(lock->cond, NULL);
+        }
+    }
+
+    // 親プロセスのワーカースレッドは存在しないため、古い実行器は使わずに捨てる
+    executor = NULL;
+    executor_generation++;
+
+    // 親プロセスで実行中だった仕事が持っていた資源 (プールの作業領域など) を戻す
+    for (struct extbzip3_lock *lock = lock_head; lock; lock = lock->next) {
+        if (lock->atfork_child) {
+            lock->atfork_child(lock);
+        }
+    }
+    pthread_mutex_unlock(&lock_registry);
+
+    pthread_mutex_unlock(&executor_lock);
+}
+
+static struct executor *
+executor_get(void)
+{
+    struct executor *ex = __atomic_load_n(&executor, __ATOMIC_ACQUIRE);
+
+    if (ex) {
+        return ex;
+    }
+
+    pthread_mutex_lock(&executor_lock);
+
+    if (!executor) {
+        ex = (struct executor *)calloc(1, sizeof(struct executor));
+
+        if (ex) {
+            pthread_mutex_init(&ex->mutex, NULL);
+            pthread_cond_init(&ex->work, NULL);
+            pthread_cond_init(&ex->not_full, NULL);
+            pthread_cond_init(&ex->done, NULL);
+            ex->target = (config_threads > 0 ? config_threads : extbzip3_default_threads());
+            ex->depth = (config_depth > 0 ? config_depth : (size_t)executor_default_depth(ex->target));
+
+            pthread_mutex_lock(&ex->mutex);
+            int spawned = executor_spawn(ex);
+            pthread_mutex_unlock(&ex->mutex);
+
+            if (spawned) {
+                __atomic_store_n(&executor, ex, __ATOMIC_RELEASE);
+            } else {
+                free(ex);
+            }
+        }
+    }
+
+    ex = executor;
+    pthread_mutex_unlock(&executor_lock);
+
+    if (!ex) {
+        rb_raise(rb_eRuntimeError, "failed to start bzip3 executor");
+    }
+
+    return ex;
+}
+
+/*
+ * fork 前に作られた待ち行列は、子プロセスでは空の状態から使い直します。
+ * 積まれたまま残っていた仕事は実行されないため、task->cancel で取り消しとして完了させます。
+ * ex->mutex を保持した状態で呼び出します。
+ */
+static void
+queue_revalidate(struct extbzip3_queue *q)
+{
+    if (q->generation != executor_generation) {
+        for (struct extbzip3_task *task = q->head, *next; task; task = next) {
+            next = task->next;
+
+            if (task->cancel) {
+                task->cancel(task->arg);
+            }
+        }
+
+        q->head = q->tail = NULL;
+        q->next = NULL;
+        q->count = 0;
+        q->running = 0;
+        q->linked = 0;
+        q->generation = executor_generation;
+    }
+}
+
+void
+extbzip3_queue_init(struct extbzip3_queue *q, int limit, size_t capacity)
+{
+    memset(q, 0, sizeof(*q));
+    q->limit = (limit > 0 ? limit : 1);
+    q->capacity = capacity;
+    q->generation = executor_generation;
+}
+
+/*
+ * GVL を持たない状態で呼び出します。
+ *
+ * 待ち行列に空きが出来るまで待ってから task を積みます。
+ * *interrupted が真になるか、待ち行列が閉じられた場合は積まずに 0 を返します。
+ */
+int
+extbzip3_queue_push(struct extbzip3_queue *q, struct extbzip3_task *task, const int *interrupted)
+{
+    struct executor *ex = executor;
+    int pushed = 0;
+
+    if (!ex) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ex->mutex);
+    queue_revalidate(q);
+
+    while (!*interrupted && !q->closed &&
+           q->capacity > 0 && (q->count >= q->capacity || ex->queued >= ex->depth)) {
+        pthread_cond_wait(&ex->not_full, &ex->mutex);
+    }
+
+    if (!*interrupted && !q->closed) {
+        task->next = NULL;
+        task->done = 0;
+
+        if (q->tail) {
+            q->tail->next = task;
+        } else {
+            q->head = task;
+        }
+
+        q->tail = task;
+        q->count++;
+        if (q->capacity > 0) {
+            ex->queued++;
+        }
+
+        if (!q->linked && q->running < q->limit) {
+            executor_link(ex, q);
+            pthread_cond_signal(&ex->work);
+        }
+
+        pushed = 1;
+    }
+
+    pthread_mutex_unlock(&ex->mutex);
+
+    return pushed;
+}
+
+/*
+ * extbzip3_queue_push の待機を中断させます。unblocking function から呼び出します。
+ */
+void
+extbzip3_queue_interrupt(int *interrupted)
+{
+    struct executor *ex = executor;
+
+    if (ex) {
+        pthread_mutex_lock(&ex->mutex);
+        *interrupted = 1;
+        pthread_cond_broadcast(&ex->not_full);
+        pthread_mutex_unlock(&ex->mutex);
+    } else {
+        *interrupted = 1;
+    }
+}
+
+/*
+ * GVL を持たない状態で呼び出します。
+ *
+ * 待ち行列を閉じ、積まれた仕事と実行中の仕事がすべて終わるまで待ちます。
+ */
+void
+extbzip3_queue_close(struct extbzip3_queue *q)
+{
+    struct executor *ex = executor;
+
+    if (!ex) {
+        q->closed = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&ex->mutex);
+    q->closed = 1;
+    queue_revalidate(q);
+    pthread_cond_broadcast(&ex->not_full);
+
+    while (q->count > 0 || q->running > 0) {
+        pthread_cond_wait(&ex->done, &ex->mutex);
+    }
+
+    pthread_mutex_unlock(&ex->mutex);
+}
+
+/*
+ * GVL を持たない状態でも呼び出せます。待機はしません。
+ *
+ * 待ち行列を閉じ、まだ実行されていない仕事を取り除いて、それぞれの task->cancel を呼び出します。
+ * 実行中の仕事が無ければこの場で、あれば最後の仕事が終わった時にワーカースレッドから orphan(q) を呼び出します。
+ * orphan は q を含む領域を解放して構いません。
+ */
+void
+extbzip3_queue_abandon(struct extbzip3_queue *q, void (*orphan)(struct extbzip3_queue *q))
+{
+    struct executor *ex = executor;
+    struct extbzip3_task *pending;
+    int running = 0;
+
+    if (ex) {
+        pthread_mutex_lock(&ex->mutex);
+        q->closed = 1;
+        queue_revalidate(q);
+
+        if (q->linked) {
+            executor_unlink(ex, q);
+        }
+
+        if (q->capacity > 0) {
+            ex->queued -= q->count;
+        }
+
+        pending = q->head;
+        q->head = q->tail = NULL;
+        q->count = 0;
+        running = q->running;
+        if (running > 0) {
+            q->orphan = orphan;
+        }
+
+        pthread_cond_broadcast(&ex->not_full);
+        pthread_mutex_unlock(&ex->mutex);
+    } else {
+        q->closed = 1;
+        pending = NULL;
+    }
+
+    while (pending) {
+        struct extbzip3_task *task = pending;
+        pending = task->next;
+
+        if (task->cancel) {
+            task->cancel(task->arg);
+        }
+    }
+
+    if (running == 0) {
+        orphan(q);
+    }
+}
+
+/*
+ * 待ち行列を使う前に、GVL を持った状態で呼び出します。必要であれば実行器を作ります。
+ */
+void
+extbzip3_executor_prepare(void)
+{
+    executor_get();
+}
+
+/*
+ * fork するたびに変わる値です。fork の前に積まれた仕事を見分けるために使います。
+ */
+unsigned long
+extbzip3_executor_generation(void)
+{
+    return executor_generation;
+}
+
+struct executor_call
+{
+    struct executor *ex;
+    struct extbzip3_queue queue;
+    struct extbzip3_task task;
+    pthread_cond_t done;        /* 他の呼び出し側の完了で起こされないように、呼び出しごとに持つ */
+};
+
+static void *
+executor_call_nogvl(void *opaque)
+{
+    struct executor_call *c = (struct executor_call *)opaque;
+    struct executor *ex = c->ex;
+    static const int never = 0;
+
+    extbzip3_queue_push(&c->queue, &c->task, &never);
+
+    pthread_mutex_lock(&ex->mutex);
+    while (!c->task.done) {
+        pthread_cond_wait(&c->done, &ex->mutex);
+    }
+    pthread_mutex_unlock(&ex->mutex);
+
+    return c->task.ret;
+}
+
+/*
+ * GVL を手放し、func(arg) を実行器で実行して、その戻り値を返します。
+ *
+ * rb_thread_call_without_gvl の代わりに使います。
+ * 呼び出しごとに待ち行列を作るため、同時に呼び出した Ruby スレッドの間で順番に実行されます。
+ *
+ * ubf は待っている間に割り込みがあった場合に呼ばれます (NULL 可)。
+ * func は実行器のワーカーで動いているため、ubf は func に中断を知らせるだけにしてください。
+ * func が戻るまでは、この関数も戻りません。
+ */
+void *
+extbzip3_executor_call(void *(*func)(void *), void *arg, rb_unblock_function_t *ubf, void *ubfarg)
+{
+    struct executor_call c;
+
+    c.ex = executor_get();
+    extbzip3_queue_init(&c.queue, 1, 0);
+    memset(&c.task, 0, sizeof(c.task));
+    c.task.func = func;
+    c.task.arg = arg;
+    c.task.cond = &c.done;
+    pthread_cond_init(&c.done, NULL);
+
+    void *ret = rb_thread_call_without_gvl(executor_call_nogvl, &c, ubf, ubfarg);
+    pthread_cond_destroy(&c.done);
+
+    return ret;
+}
+
+/*
+ *  @overload configure(threads: nil, queue_depth: nil)
+ *
+ *  ブロック単位の処理を行う、プロセス全体で共有されるネイティブスレッドの実行器を設定します。
+ *
+ *  一括処理、Encoder と Decoder、BlockProcessor、BlockPool、Bzip3.copy_stream などは
+ *  すべてこの実行器の上で処理されるため、多くの Ruby スレッドが同時に圧縮しても CPU を使いすぎません。
+ *  仕事は呼び出し側ごとに順番に取り出されるため、多くのブロックを積んだ呼び出し側が他を待たせ続けることもありません。
+ *
+ *  fork した子プロセスでは、最初に使われた時に実行器が作り直されます。
+ *
+ *  キーワード引数を省略した項目は変更しません。
+ *
+ *  @param  threads     [Integer, nil]
+ *      ワーカースレッドの数 (既定値: オンラインのプロセッサ数)
+ *  @param  queue_depth [Integer, nil]
+ *      BlockPool などが実行器に積むことの出来る、実行待ちのブロックの総数 (既定値: `threads * 4`)。
+ *      一括処理やストリームの呼び出しは呼び出し側が待機するため、この上限には含まれません。
+ *      nil を与えると既定値に戻します。
+ *  @return [Hash]  現在の設定 (`{ threads:, queue_depth: }`)
+ */
+static VALUE
+executor_s_configure(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    enum { numkw = 2 };
+    ID idtab[numkw] = { rb_intern("threads"), rb_intern("queue_depth") };
+    union { struct { VALUE threads, queue_depth; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    if (!RB_UNDEF_P(kw.threads)) {
+        config_threads = (RB_NIL_P(kw.threads) ? 0 : aux_conv_to_threads(kw.threads));
+    }
+
+    if (!RB_UNDEF_P(kw.queue_depth)) {
+        long depth = (RB_NIL_P(kw.queue_depth) ? 0 : NUM2LONG(kw.queue_depth));
+
+        if (!RB_NIL_P(kw.queue_depth) && depth < 1) {
+            rb_raise(rb_eArgError, "out of range for queue_depth (expect 1.., but given %ld)", depth);
+        }
+
+        config_depth = (size_t)depth;
+    }
+
+    struct executor *ex = executor_get();
+    int threads = (config_threads > 0 ? config_threads : extbzip3_default_threads());
+
+    pthread_mutex_lock(&ex->mutex);
+    ex->target = threads;
+    ex->depth = (config_depth > 0 ? config_depth : (size_t)executor_default_depth(threads));
+    executor_spawn(ex);
+    pthread_cond_broadcast(&ex->work);      // 減らした分のワーカーを終了させる
+    pthread_cond_broadcast(&ex->not_full);
+    size_t depth = ex->depth;
+    pthread_mutex_unlock(&ex->mutex);
+
+    VALUE config = rb_hash_new();
+    rb_hash_aset(config, ID2SYM(rb_intern("threads")), INT2FIX(threads));
+    rb_hash_aset(config, ID2SYM(rb_intern("queue_depth")), SIZET2NUM(depth));
+
+    return config;
+}
+
+void
+extbzip3_init_executor(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    pthread_atfork(executor_atfork_prepare, executor_atfork_parent, executor_atfork_child);
+
+    rb_define_singleton_method(bzip3_module, "configure", executor_s_configure, -1);
+}
+
+#else // EXTBZIP3_POOL_SUPPORT
+
+/*
+ * ネイティブスレッドが使えない環境では、呼び出した Ruby スレッドで直接処理します。
+ */
+static VALUE
+executor_s_configure(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    VALUE config = rb_hash_new();
+    rb_hash_aset(config, ID2SYM(rb_intern("threads")), INT2FIX(0));
+    rb_hash_aset(config, ID2SYM(rb_intern("queue_depth")), INT2FIX(0));
+
+    return config;
+}
+
+void
+extbzip3_init_executor(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    rb_define_singleton_method(bzip3_module, "configure", executor_s_configure, -1);
+}
+
+#endif // EXTBZIP3_POOL_SUPPORT
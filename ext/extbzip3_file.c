@@ -0,0 +1,952 @@
+#include "extbzip3.h"
+
+#if defined(EXTBZIP3_POOL_SUPPORT) && defined(HAVE_PREAD) && defined(HAVE_PWRITE)
+# include <ruby/io.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# define FILE_ENGINE_SUPPORT 1
+# if defined(HAVE_LIBURING_H) && defined(HAVE_IO_URING_QUEUE_INIT)
+#  include <liburing.h>
+#  define FILE_IO_URING_SUPPORT 1
+# endif
+#endif
+
+#ifdef FILE_ENGINE_SUPPORT
+
+/*
+ * Bzip3.encode_file / Bzip3.decode_file の実装です。
+ *
+ * ファイル上の位置を指定した読み書き (io_uring または pread/pwrite) で、
+ * ブロックの大きさのバッファを複数同時に読み書きしながらワーカースレッドへ圧縮・伸長を任せます。
+ *
+ * 各ブロックは次の状態を順に辿ります。
+ *
+ *  1. FILE_SLOT_READING: 入力を仕事 (extbzip3_job) のバッファへ読み込み中
+ *  2. FILE_SLOT_WORKING: ワーカースレッドが処理中
+ *  3. FILE_SLOT_WRITING: 出力を書き込み中 (出力位置が決まるように、書き込みはブロックの順に開始する)
+ *
+ * 圧縮ではブロックの入力位置が予め分かるため、複数の読み込みを同時に発行します。
+ * 伸長ではブロックヘッダを読むまで次のブロックの位置が分からないため、
+ * 圧縮データと続くブロックヘッダを1回で読み込み、読み込みを1つずつ連鎖させます。
+ */
+
+enum {
+    FILE_ENCODE = 1,
+    FILE_DECODE = 2,
+};
+
+enum {
+    FILE_ENGINE_AUTO = 0,
+    FILE_ENGINE_IO_URING = 1,
+    FILE_ENGINE_PREAD = 2,
+};
+
+enum {
+    FILE_SLOT_FREE = 0,
+    FILE_SLOT_READING,
+    FILE_SLOT_WORKING,
+    FILE_SLOT_WRITING,
+};
+
+enum {
+    FILE_OP_READ = 0,
+    FILE_OP_WRITE_HEADER = 1,
+    FILE_OP_WRITE_DATA = 2,
+    FILE_OP_KINDS = 3,
+};
+
+#define FILE_OP_NONE SIZE_MAX
+
+struct file_op
+{
+    int fd;
+    int write;
+    int err;
+    uint8_t *buf;
+    size_t len;
+    size_t done;
+    uint64_t off;
+};
+
+struct file_slot
+{
+    int state;
+    int pending;                /* 完了していない書き込みの数 */
+    struct extbzip3_job *job;
+    uint64_t inoff;
+    uint32_t packedsize;
+    uint32_t origsize;
+    uint8_t header[8];
+};
+
+struct file_copy
+{
+    int mode;
+    int engine;
+    int srcfd;
+    int dstfd;
+    int nthreads;
+    int concat;
+    uint32_t blocksize;         /* FILE_ENCODE ではブロックサイズ、FILE_DECODE では最大ブロックサイズ */
+    uint64_t srcsize;
+
+    struct extbzip3_pool *pool;
+    struct file_slot *slots;
+    size_t nslots;
+    uint64_t nread;             /* 読み込みを開始したブロックの数 */
+    uint64_t nwrite;            /* 書き込みを開始したブロックの数 */
+    uint64_t inoff;
+    uint64_t outoff;
+
+    /* FILE_DECODE */
+    uint32_t chunk_blocksize;
+    uint32_t poolsize;
+    uint32_t rebuild;           /* 0 でなければ、すべてのブロックを書き終えてからこの大きさでプールを作り直す */
+    int have_header;
+    int reading;
+    int eof;
+    uint32_t next_packedsize;
+    uint32_t next_origsize;
+
+    /* 入出力 */
+    struct file_op *ops;
+    size_t *completed;          /* pread/pwrite で完了した要求 */
+    size_t ncompleted;
+    size_t inflight;
+#ifdef FILE_IO_URING_SUPPORT
+    int uring;
+    struct io_uring ring;
+#endif
+};
+
+static void *
+file_op_nogvl(void *opaque)
+{
+    struct file_op *op = (struct file_op *)opaque;
+
+    while (op->done < op->len) {
+        ssize_t n;
+        if (op->write) {
+            n = pwrite(op->fd, op->buf + op->done, op->len - op->done, (off_t)(op->off + op->done));
+        } else {
+            n = pread(op->fd, op->buf + op->done, op->len - op->done, (off_t)(op->off + op->done));
+        }
+
+        if (n > 0) {
+            op->done += n;
+        } else if (n == 0 && !op->write) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            op->err = (n < 0 ? errno : EIO);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ヘッダなどの小さな読み込みを、入出力エンジンを介さずに同期的に行います。
+ */
+static size_t
+file_pread(struct file_copy *f, void *buf, size_t len, uint64_t off)
+{
+    struct file_op op = { f->srcfd, 0, 0, (uint8_t *)buf, len, 0, off };
+    rb_thread_call_without_gvl(file_op_nogvl, &op, NULL, NULL);
+
+    if (op.err) {
+        rb_syserr_fail(op.err, "pread");
+    }
+
+    return op.done;
+}
+
+static void
+file_pwrite(struct file_copy *f, const void *buf, size_t len, uint64_t off)
+{
+    struct file_op op = { f->dstfd, 1, 0, (uint8_t *)buf, len, 0, off };
+    rb_thread_call_without_gvl(file_op_nogvl, &op, NULL, NULL);
+
+    if (op.err) {
+        rb_syserr_fail(op.err, "pwrite");
+    }
+}
+
+#ifdef FILE_IO_URING_SUPPORT
+static void
+file_uring_queue(struct file_copy *f, size_t index)
+{
+    struct file_op *op = &f->ops[index];
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->ring);
+
+    if (sqe == NULL) {
+        io_uring_submit(&f->ring);
+        sqe = io_uring_get_sqe(&f->ring);
+
+        if (sqe == NULL) {
+            rb_raise(rb_eRuntimeError, "io_uring submission queue is full");
+        }
+    }
+
+    if (op->write) {
+        io_uring_prep_write(sqe, op->fd, op->buf + op->done, (unsigned)(op->len - op->done), op->off + op->done);
+    } else {
+        io_uring_prep_read(sqe, op->fd, op->buf + op->done, (unsigned)(op->len - op->done), op->off + op->done);
+    }
+
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)index);
+}
+
+struct file_uring_wait
+{
+    struct io_uring *ring;
+    struct io_uring_cqe *cqe;
+    int timeout;
+    int ret;
+};
+
+static void *
+file_uring_wait_nogvl(void *opaque)
+{
+    struct file_uring_wait *w = (struct file_uring_wait *)opaque;
+
+    if (w->timeout) {
+        // 割り込みを確認するため、時間を区切って待つ
+        struct __kernel_timespec ts = { 0, 100 * 1000 * 1000 };
+        w->ret = io_uring_wait_cqe_timeout(w->ring, &w->cqe, &ts);
+    } else {
+        w->ret = io_uring_wait_cqe(w->ring, &w->cqe);
+    }
+
+    return NULL;
+}
+#endif // FILE_IO_URING_SUPPORT
+
+static void
+file_engine_init(struct file_copy *f)
+{
+    f->ops = ZALLOC_N(struct file_op, f->nslots * FILE_OP_KINDS);
+    f->completed = ALLOC_N(size_t, f->nslots * FILE_OP_KINDS);
+
+#ifdef FILE_IO_URING_SUPPORT
+    if (f->engine != FILE_ENGINE_PREAD) {
+        int ret = io_uring_queue_init((unsigned)(f->nslots * FILE_OP_KINDS), &f->ring, 0);
+
+        if (ret == 0) {
+            f->uring = 1;
+        } else if (f->engine == FILE_ENGINE_IO_URING) {
+            rb_syserr_fail(-ret, "io_uring_queue_init");
+        }
+    }
+#endif
+}
+
+/*
+ * 入出力の要求を開始します。
+ *
+ * pread/pwrite の場合はここで処理を終えて完了の一覧へ積み、io_uring の場合は要求を積むだけで、
+ * 実際に発行するのは file_engine_submit です。
+ */
+static void
+file_engine_start(struct file_copy *f, size_t index, int fd, int write, uint8_t *buf, size_t len, uint64_t off)
+{
+    struct file_op *op = &f->ops[index];
+    *op = (struct file_op){ fd, write, 0, buf, len, 0, off };
+    f->inflight++;
+
+#ifdef FILE_IO_URING_SUPPORT
+    if (f->uring) {
+        file_uring_queue(f, index);
+        return;
+    }
+#endif
+
+    rb_thread_call_without_gvl(file_op_nogvl, op, NULL, NULL);
+    f->completed[f->ncompleted++] = index;
+}
+
+static void
+file_engine_submit(struct file_copy *f)
+{
+#ifdef FILE_IO_URING_SUPPORT
+    if (f->uring) {
+        int ret = io_uring_submit(&f->ring);
+
+        if (ret < 0) {
+            rb_syserr_fail(-ret, "io_uring_submit");
+        }
+    }
+#endif
+}
+
+/*
+ * 完了した入出力の要求を1つ取り出します。block が偽で完了したものがなければ FILE_OP_NONE を返します。
+ */
+static size_t
+file_engine_reap(struct file_copy *f, int block)
+{
+#ifdef FILE_IO_URING_SUPPORT
+    if (f->uring) {
+        for (;;) {
+            struct file_uring_wait w = { &f->ring, NULL, 1, 0 };
+
+            if (!block) {
+                w.ret = io_uring_peek_cqe(&f->ring, &w.cqe);
+
+                if (w.ret == -EAGAIN) {
+                    return FILE_OP_NONE;
+                }
+            } else {
+                rb_thread_call_without_gvl(file_uring_wait_nogvl, &w, NULL, NULL);
+
+                if (w.ret == -ETIME || w.ret == -EINTR) {
+                    rb_thread_check_ints();
+                    continue;
+                }
+            }
+
+            if (w.ret < 0) {
+                rb_syserr_fail(-w.ret, "io_uring_wait_cqe");
+            }
+
+            size_t index = (size_t)(uintptr_t)io_uring_cqe_get_data(w.cqe);
+            int res = w.cqe->res;
+            io_uring_cqe_seen(&f->ring, w.cqe);
+
+            struct file_op *op = &f->ops[index];
+
+            if (res == -EINTR || res == -EAGAIN) {
+                file_uring_queue(f, index);
+                file_engine_submit(f);
+                continue;
+            } else if (res < 0) {
+                op->err = -res;
+            } else if (res == 0) {
+                if (op->write) {
+                    op->err = EIO;
+                }
+            } else {
+                op->done += res;
+
+                if (op->done < op->len) {
+                    // 不足分を改めて要求する
+                    file_uring_queue(f, index);
+                    file_engine_submit(f);
+                    continue;
+                }
+            }
+
+            f->inflight--;
+
+            return index;
+        }
+    }
+#endif
+
+    if (f->ncompleted == 0) {
+        return FILE_OP_NONE;
+    }
+
+    f->inflight--;
+
+    return f->completed[--f->ncompleted];
+}
+
+/*
+ * 発行済みの入出力の要求がすべて終わるのを待ちます。バッファを解放する前に必ず呼び出します。
+ */
+static void
+file_engine_drain(struct file_copy *f)
+{
+#ifdef FILE_IO_URING_SUPPORT
+    if (f->uring) {
+        io_uring_submit(&f->ring);
+
+        while (f->inflight > 0) {
+            struct file_uring_wait w = { &f->ring, NULL, 0, 0 };
+            rb_thread_call_without_gvl(file_uring_wait_nogvl, &w, NULL, NULL);
+
+            if (w.ret == -EINTR) {
+                continue;
+            } else if (w.ret < 0) {
+                break;
+            }
+
+            io_uring_cqe_seen(&f->ring, w.cqe);
+            f->inflight--;
+        }
+
+        io_uring_queue_exit(&f->ring);
+        f->uring = 0;
+    }
+#endif
+
+    f->inflight = 0;
+    f->ncompleted = 0;
+}
+
+static void *
+file_shutdown_nogvl(void *opaque)
+{
+    extbzip3_pool_shutdown((struct extbzip3_pool *)opaque);
+
+    return NULL;
+}
+
+static void
+file_prepare(struct file_copy *f, uint32_t blocksize)
+{
+    if (f->pool) {
+        rb_thread_call_without_gvl(file_shutdown_nogvl, f->pool, NULL, NULL);
+        extbzip3_pool_free(f->pool);
+        f->pool = NULL;
+    }
+
+    f->pool = extbzip3_pool_new(blocksize, f->nthreads, (size_t)f->nthreads * 2);
+    f->poolsize = blocksize;
+}
+
+static int
+file_slots_idle_p(struct file_copy *f)
+{
+    for (size_t i = 0; i < f->nslots; i++) {
+        if (f->slots[i].state != FILE_SLOT_FREE) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static struct file_slot *
+file_slot_begin(struct file_copy *f, size_t bufsize, size_t len, uint32_t origsize)
+{
+    struct file_slot *s = &f->slots[f->nread % f->nslots];
+    int type = (f->mode == FILE_ENCODE ? EXTBZIP3_JOB_ENCODE : EXTBZIP3_JOB_DECODE);
+
+    s->job = extbzip3_job_new(type, NULL, len, bufsize, origsize);
+    s->state = FILE_SLOT_READING;
+    s->inoff = f->inoff;
+    s->origsize = origsize;
+
+    return s;
+}
+
+/*
+ * 次のブロックの読み込みを開始します。開始できなかった場合は 0 を返します。
+ */
+static int
+file_issue_read(struct file_copy *f)
+{
+    if (f->slots[f->nread % f->nslots].state != FILE_SLOT_FREE) {
+        return 0;
+    }
+
+    size_t index = (f->nread % f->nslots) * FILE_OP_KINDS + FILE_OP_READ;
+
+    if (f->mode == FILE_ENCODE) {
+        if (f->inoff >= f->srcsize) {
+            return 0;
+        }
+
+        uint64_t rest = f->srcsize - f->inoff;
+        size_t len = (rest < f->blocksize ? (size_t)rest : f->blocksize);
+        struct file_slot *s = file_slot_begin(f, bz3_bound(len), len, (uint32_t)len);
+        file_engine_start(f, index, f->srcfd, 0, extbzip3_job_buffer(s->job), len, f->inoff);
+        f->inoff += len;
+    } else {
+        if (!f->have_header || f->reading || f->eof) {
+            return 0;
+        }
+
+        if (f->rebuild) {
+            if (!file_slots_idle_p(f)) {
+                return 0;
+            }
+
+            file_prepare(f, f->rebuild);
+            f->rebuild = 0;
+        }
+
+        size_t packedsize = f->next_packedsize;
+        size_t bufsize = bz3_bound(f->next_origsize);
+        if (bufsize < packedsize + 8) {
+            bufsize = packedsize + 8;
+        }
+
+        // 圧縮データに続く次のブロックヘッダも同時に読み込む
+        uint64_t rest = f->srcsize - f->inoff;
+        size_t len = (rest < packedsize + 8 ? (size_t)rest : packedsize + 8);
+        if (len < packedsize) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        struct file_slot *s = file_slot_begin(f, bufsize, packedsize, f->next_origsize);
+        s->packedsize = (uint32_t)packedsize;
+        f->have_header = 0;
+        f->reading = 1;
+        file_engine_start(f, index, f->srcfd, 0, extbzip3_job_buffer(s->job), len, f->inoff);
+    }
+
+    f->nread++;
+
+    return 1;
+}
+
+/*
+ * ストリームヘッダを確認し、その後ろの最初のブロックヘッダを読み込みます。
+ */
+static void
+file_decode_stream_header(struct file_copy *f, const uint8_t *header, size_t len)
+{
+    uint32_t blocksize;
+    int status = aux_bzip3_check_stream_header(header, len, AUX_BZIP3_V1_FILE_FORMAT, &blocksize, NULL);
+    if (status != 0) {
+        extbzip3_check_error(status > 0 ? BZ3_ERR_TRUNCATED_DATA : status);
+    }
+
+    if (blocksize > f->blocksize) {
+        rb_raise(rb_eRuntimeError, "blocksize too big (limit %u, but given %u)", f->blocksize, blocksize);
+    }
+
+    if (f->pool == NULL) {
+        file_prepare(f, blocksize);
+    } else if (blocksize > f->poolsize) {
+        f->rebuild = blocksize;
+    }
+
+    f->chunk_blocksize = blocksize;
+
+    f->inoff += 9;
+}
+
+static void
+file_decode_block_header(struct file_copy *f, const uint8_t *header, size_t len)
+{
+    while (len > 0) {
+        if (len >= 5 && memcmp(header, aux_bzip3_signature, 5) == 0) {
+            if (!f->concat) {
+                f->eof = 1;
+                return;
+            }
+
+            uint8_t buf[17];
+            len = file_pread(f, buf, sizeof(buf), f->inoff);
+            file_decode_stream_header(f, buf, len);
+            header = buf + 9;
+            len = (len > 9 ? len - 9 : 0);
+            continue;
+        }
+
+        if (len < 8) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        uint32_t packedsize = loadu32le(header);
+        uint32_t origsize = loadu32le(header + 4);
+
+        if (!aux_bzip3_block_header_p(packedsize, origsize, f->chunk_blocksize)) {
+            extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+        }
+
+        f->next_packedsize = packedsize;
+        f->next_origsize = origsize;
+        f->have_header = 1;
+        f->inoff += 8;
+
+        return;
+    }
+
+    f->eof = 1;
+}
+
+static void
+file_read_done(struct file_copy *f, struct file_slot *s, struct file_op *op)
+{
+    if (op->err) {
+        rb_syserr_fail(op->err, "read");
+    }
+
+    if (f->mode == FILE_ENCODE) {
+        if (op->done < op->len) {
+            rb_raise(rb_eRuntimeError, "unexpected end of file (file was truncated while reading)");
+        }
+    } else {
+        f->reading = 0;
+
+        if (op->done < s->packedsize) {
+            extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+        }
+
+        f->inoff = s->inoff + s->packedsize;
+        file_decode_block_header(f, op->buf + s->packedsize, op->done - s->packedsize);
+    }
+
+    s->state = FILE_SLOT_WORKING;
+    extbzip3_pool_push(f->pool, s->job);
+}
+
+static void
+file_write_done(struct file_copy *f, struct file_slot *s, struct file_op *op)
+{
+    if (op->err) {
+        rb_syserr_fail(op->err, "write");
+    }
+
+    if (--s->pending == 0) {
+        extbzip3_job_release(s->job);
+        s->job = NULL;
+        s->state = FILE_SLOT_FREE;
+    }
+}
+
+static void
+file_handle(struct file_copy *f, size_t index)
+{
+    struct file_slot *s = &f->slots[index / FILE_OP_KINDS];
+    struct file_op *op = &f->ops[index];
+
+    if (index % FILE_OP_KINDS == FILE_OP_READ) {
+        file_read_done(f, s, op);
+    } else {
+        file_write_done(f, s, op);
+    }
+}
+
+/*
+ * 処理を終えた先頭のブロックの書き込みを開始します。
+ */
+static void
+file_issue_write(struct file_copy *f, struct file_slot *s, int32_t ret)
+{
+    size_t base = (s - f->slots) * FILE_OP_KINDS;
+    uint8_t *buf = (uint8_t *)extbzip3_job_result(s->job);
+
+    if (ret < 0) {
+        extbzip3_check_error(ret);
+    }
+
+    s->state = FILE_SLOT_WRITING;
+    f->nwrite++;
+
+    if (f->mode == FILE_ENCODE) {
+        storeu32le(s->header, ret);
+        storeu32le(s->header + 4, s->origsize);
+        s->pending = 2;
+        file_engine_start(f, base + FILE_OP_WRITE_HEADER, f->dstfd, 1, s->header, 8, f->outoff);
+        file_engine_start(f, base + FILE_OP_WRITE_DATA, f->dstfd, 1, buf, ret, f->outoff + 8);
+        f->outoff += 8 + ret;
+    } else {
+        if ((uint32_t)ret != s->origsize) {
+            extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+        }
+
+        s->pending = 1;
+        file_engine_start(f, base + FILE_OP_WRITE_DATA, f->dstfd, 1, buf, ret, f->outoff);
+        f->outoff += ret;
+    }
+}
+
+static int
+file_reap_all(struct file_copy *f)
+{
+    int reaped = 0;
+
+    for (size_t index; (index = file_engine_reap(f, 0)) != FILE_OP_NONE; ) {
+        file_handle(f, index);
+        reaped = 1;
+    }
+
+    return reaped;
+}
+
+static int
+file_reading_done_p(struct file_copy *f)
+{
+    if (f->mode == FILE_ENCODE) {
+        return f->inoff >= f->srcsize;
+    } else {
+        return f->eof && !f->reading && !f->have_header;
+    }
+}
+
+static VALUE
+file_main(VALUE arg)
+{
+    struct file_copy *f = (struct file_copy *)arg;
+    struct stat st, dst;
+
+    if (fstat(f->srcfd, &st) != 0 || fstat(f->dstfd, &dst) != 0) {
+        rb_sys_fail("fstat");
+    }
+
+    // 出力先は入力と同じファイルでないことを確かめてから切り詰める
+    if (st.st_dev == dst.st_dev && st.st_ino == dst.st_ino) {
+        rb_raise(rb_eArgError, "src and dest are the same file");
+    }
+
+    if (S_ISREG(dst.st_mode) && ftruncate(f->dstfd, 0) != 0) {
+        rb_sys_fail("ftruncate");
+    }
+
+    f->srcsize = (uint64_t)st.st_size;
+    f->nslots = (size_t)f->nthreads * 2 + 2;
+    f->slots = ZALLOC_N(struct file_slot, f->nslots);
+    file_engine_init(f);
+
+    if (f->mode == FILE_ENCODE) {
+        uint8_t header[9];
+        memcpy(header, aux_bzip3_signature, 5);
+        storeu32le(header + 5, f->blocksize);
+        file_pwrite(f, header, sizeof(header), 0);
+        f->outoff = sizeof(header);
+
+        if (f->srcsize > 0) {
+            file_prepare(f, f->blocksize);
+        }
+    } else {
+        uint8_t header[17];
+        size_t len = file_pread(f, header, sizeof(header), 0);
+        file_decode_stream_header(f, header, len);
+        file_decode_block_header(f, header + 9, (len > 9 ? len - 9 : 0));
+    }
+
+    for (;;) {
+        int progress = 0;
+
+        while (file_issue_read(f)) {
+            // pread/pwrite の場合は読み込みが終わっているので、すぐにワーカーへ渡す
+            file_reap_all(f);
+            progress = 1;
+        }
+
+        file_engine_submit(f);
+        progress = file_reap_all(f) || progress;
+
+        struct file_slot *s = &f->slots[f->nwrite % f->nslots];
+
+        if (f->nwrite < f->nread && s->state == FILE_SLOT_WORKING) {
+            if (extbzip3_job_done_p(s->job)) {
+                file_issue_write(f, s, extbzip3_job_wait(s->job));
+                continue;
+            }
+
+            if (!progress) {
+                // 先頭のブロックの処理を待つ (その間も入出力は進む)
+                extbzip3_job_wait(s->job);
+            }
+
+            continue;
+        }
+
+        if (progress) {
+            continue;
+        }
+
+        if (f->inflight == 0) {
+            if (f->nwrite == f->nread && file_reading_done_p(f)) {
+                break;
+            }
+
+            rb_raise(rb_eRuntimeError, "[BUG] file engine stalled");
+        }
+
+        size_t index = file_engine_reap(f, 1);
+        if (index != FILE_OP_NONE) {
+            file_handle(f, index);
+        }
+    }
+
+    return Qnil;
+}
+
+static VALUE
+file_cleanup(VALUE arg)
+{
+    struct file_copy *f = (struct file_copy *)arg;
+
+    // 入出力とワーカーが仕事のバッファを参照しなくなってから解放する
+    file_engine_drain(f);
+
+    if (f->pool) {
+        rb_thread_call_without_gvl(file_shutdown_nogvl, f->pool, NULL, NULL);
+        extbzip3_pool_free(f->pool);
+        f->pool = NULL;
+    }
+
+    if (f->slots) {
+        for (size_t i = 0; i < f->nslots; i++) {
+            if (f->slots[i].job) {
+                extbzip3_job_release(f->slots[i].job);
+            }
+        }
+    }
+
+    xfree(f->slots);
+    xfree(f->ops);
+    xfree(f->completed);
+
+    if (f->srcfd >= 0) {
+        close(f->srcfd);
+    }
+
+    if (f->dstfd >= 0) {
+        close(f->dstfd);
+    }
+
+    return Qnil;
+}
+
+static int
+file_conv_to_engine(VALUE engine)
+{
+    if (RB_NIL_OR_UNDEF_P(engine) || engine == ID2SYM(rb_intern("auto"))) {
+        return FILE_ENGINE_AUTO;
+    } else if (engine == ID2SYM(rb_intern("pread"))) {
+        return FILE_ENGINE_PREAD;
+    } else if (engine == ID2SYM(rb_intern("io_uring"))) {
+#ifdef FILE_IO_URING_SUPPORT
+        return FILE_ENGINE_IO_URING;
+#else
+        rb_raise(rb_eNotImpError, "io_uring engine is not available (built without liburing)");
+#endif
+    } else {
+        rb_raise(rb_eArgError, "wrong engine (expect :auto, :io_uring or :pread, but given %" PRIsVALUE ")", engine);
+    }
+}
+
+static int
+file_open(VALUE path, int flags)
+{
+    path = rb_get_path(path);
+    int fd = rb_cloexec_open(StringValueCStr(path), flags, 0666);
+
+    if (fd < 0) {
+        rb_sys_fail_str(path);
+    }
+
+    rb_update_max_fd(fd);
+
+    return fd;
+}
+
+static VALUE
+file_open_dest(VALUE path)
+{
+    return INT2FIX(file_open(path, O_WRONLY | O_CREAT));
+}
+
+static VALUE
+file_s_run(int argc, VALUE argv[], int mode)
+{
+    VALUE src, dest, opts;
+    rb_scan_args(argc, argv, "2:", &src, &dest, &opts);
+
+    enum { numkw = 4 };
+    ID idtab[numkw] = { rb_intern("threads"), rb_intern("blocksize"), rb_intern("engine"), rb_intern("concat") };
+    union { struct { VALUE threads, blocksize, engine, concat; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, (mode == FILE_DECODE ? numkw : numkw - 1), kw.vect);
+
+    struct file_copy f;
+    memset(&f, 0, sizeof(f));
+    f.mode = mode;
+    f.nthreads = aux_conv_to_threads(kw.threads);
+    f.blocksize = aux_conv_to_blocksize(kw.blocksize);
+    f.engine = file_conv_to_engine(kw.engine);
+    f.concat = (mode == FILE_DECODE && (RB_UNDEF_P(kw.concat) || RTEST(kw.concat)));
+    f.srcfd = -1;
+    f.dstfd = -1;
+
+    // FIFO を開く時に書き込み側を待たないように O_NONBLOCK を与える (通常のファイルには影響しない)
+    f.srcfd = file_open(src, O_RDONLY | O_NONBLOCK);
+
+    // 大きさの分からない入力 (FIFO や端末など) は位置を指定して読めない
+    struct stat st;
+    if (fstat(f.srcfd, &st) != 0) {
+        int err = errno;
+        close(f.srcfd);
+        rb_syserr_fail(err, "fstat");
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        close(f.srcfd);
+        rb_raise(rb_eArgError, "not a regular file - %" PRIsVALUE, src);
+    }
+
+    int state;
+    VALUE dstfd = rb_protect(file_open_dest, dest, &state);
+    if (state) {
+        close(f.srcfd);
+        rb_jump_tag(state);
+    }
+
+    f.dstfd = FIX2INT(dstfd);
+    rb_ensure(file_main, (VALUE)&f, file_cleanup, (VALUE)&f);
+
+    return rb_assoc_new(ULL2NUM(f.inoff), ULL2NUM(f.outoff));
+}
+
+/*
+ *  @overload encode_file(src, dest, threads: nil, blocksize: (16 << 20), engine: :auto)
+ *
+ *  src ファイルを圧縮して dest ファイルへ書き込みます。
+ *  src は通常のファイルである必要があり、dest と同じファイルであってはいけません。
+ *
+ *  ブロックの大きさのバッファを複数同時に読み書きしながら、ワーカースレッドで並列に圧縮します。
+ *  io_uring が利用可能 (liburing とともにビルドされ、かつカーネルが対応している) であれば io_uring を、
+ *  そうでなければ pread/pwrite を使います。
+ *
+ *  @param  src         [String, Pathname]
+ *  @param  dest        [String, Pathname]
+ *  @option opts        [Integer]       :threads (number of online processors)
+ *  @option opts        [Integer]       :blocksize ((16 << 20))
+ *  @option opts        [Symbol]        :engine (:auto)
+ *      :auto, :io_uring, :pread
+ *  @return [Array<Integer>]
+ *      `[読み込んだバイト数, 書き込んだバイト数]`
+ */
+static VALUE
+file_s_encode_file(int argc, VALUE argv[], VALUE mod)
+{
+    return file_s_run(argc, argv, FILE_ENCODE);
+}
+
+/*
+ *  @overload decode_file(src, dest, threads: nil, blocksize: (16 << 20), engine: :auto, concat: true)
+ *
+ *  src ファイルを伸長して dest ファイルへ書き込みます。
+ *  src と dest の制約は encode_file と同じです。
+ *
+ *  @param  src         [String, Pathname]
+ *  @param  dest        [String, Pathname]
+ *  @option opts        [Integer]       :threads (number of online processors)
+ *  @option opts        [Integer]       :blocksize ((16 << 20))
+ *      受け付ける最大ブロックサイズ
+ *  @option opts        [Symbol]        :engine (:auto)
+ *      :auto, :io_uring, :pread
+ *  @option opts        [true, false]   :concat (true)
+ *  @return [Array<Integer>]
+ *      `[読み込んだバイト数, 書き込んだバイト数]`
+ */
+static VALUE
+file_s_decode_file(int argc, VALUE argv[], VALUE mod)
+{
+    return file_s_run(argc, argv, FILE_DECODE);
+}
+
+#endif // FILE_ENGINE_SUPPORT
+
+void
+extbzip3_init_file(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+#ifdef FILE_ENGINE_SUPPORT
+    rb_define_singleton_method(bzip3_module, "encode_file", file_s_encode_file, -1);
+    rb_define_singleton_method(bzip3_module, "decode_file", file_s_decode_file, -1);
+#endif
+}
@@ -0,0 +1,165 @@
+#include "extbzip3.h"
+#include <time.h>
+
+#if RUBY_API_VERSION_CODE >= 30000
+# include <ruby/ractor.h>
+# define IDLE_RACTOR_LOCAL 1
+#endif
+
+/*
+ * 使われていない Encoder や Decoder の bz3_state を解放するための登録簿です。
+ *
+ * idle_trim: を与えた Encoder と Decoder をここへ登録し、Bzip3.trim_idle が呼ばれたときに
+ * 最後に使われてから idle_trim 秒以上たったものの bz3_state と作業用の文字列を解放します。
+ * 解放した bz3_state は次の write や read で確保し直されます。
+ *
+ * 登録簿の操作はすべて GVL を持った状態で行います。
+ * 他の Ractor のオブジェクトに触れないように、登録簿は Ractor ごとに持ちます。
+ * Ractor が終了した後も登録されたままのオブジェクトが残る場合があるため、登録簿は解放しません。
+ */
+
+#ifdef IDLE_RACTOR_LOCAL
+static const struct rb_ractor_local_storage_type idle_list_type = { NULL, NULL };
+static rb_ractor_local_key_t idle_list_key;
+
+static struct extbzip3_idle *
+idle_list(void)
+{
+    struct extbzip3_idle *list = (struct extbzip3_idle *)rb_ractor_local_storage_ptr(idle_list_key);
+
+    if (list == NULL) {
+        list = ALLOC(struct extbzip3_idle);
+        memset(list, 0, sizeof(*list));
+        list->prev = list->next = list;
+        rb_ractor_local_storage_ptr_set(idle_list_key, list);
+    }
+
+    return list;
+}
+#else
+static struct extbzip3_idle idle_list_head = { &idle_list_head, &idle_list_head };
+# define idle_list() (&idle_list_head)
+#endif
+
+double
+extbzip3_idle_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)time(NULL);
+#endif
+}
+
+void
+extbzip3_idle_register(struct extbzip3_idle *idle, VALUE timeout, void (*trim)(struct extbzip3_idle *idle))
+{
+    idle->trim = trim;
+    idle->lastuse = extbzip3_idle_now();
+
+    if (RB_NIL_OR_UNDEF_P(timeout)) {
+        return;
+    }
+
+    idle->timeout = NUM2DBL(timeout);
+    if (idle->timeout < 0.0) {
+        rb_raise(rb_eArgError, "negative idle_trim - %" PRIsVALUE, timeout);
+    }
+
+    struct extbzip3_idle *list = idle_list();
+    idle->prev = list->prev;
+    idle->next = list;
+    list->prev->next = idle;
+    list->prev = idle;
+}
+
+void
+extbzip3_idle_unregister(struct extbzip3_idle *idle)
+{
+    if (idle->next) {
+        idle->prev->next = idle->next;
+        idle->next->prev = idle->prev;
+        idle->prev = idle->next = NULL;
+    }
+}
+
+static VALUE
+idle_leave(VALUE arg)
+{
+    struct extbzip3_idle *idle = (struct extbzip3_idle *)arg;
+
+    idle->busy--;
+    idle->lastuse = extbzip3_idle_now();
+
+    return Qnil;
+}
+
+VALUE
+extbzip3_idle_call(struct extbzip3_idle *idle, VALUE (*func)(VALUE), VALUE arg)
+{
+    idle->busy++;
+
+    return rb_ensure(func, arg, idle_leave, (VALUE)idle);
+}
+
+int
+extbzip3_idle_trim(struct extbzip3_idle *idle)
+{
+    if (idle->busy > 0 || idle->trim == NULL) {
+        return 0;
+    }
+
+    idle->trim(idle);
+
+    return 1;
+}
+
+size_t
+extbzip3_idle_trim_expired(void)
+{
+    struct extbzip3_idle *list = idle_list();
+    double now = extbzip3_idle_now();
+    size_t count = 0;
+
+    for (struct extbzip3_idle *idle = list->next; idle != list; idle = idle->next) {
+        if (now - idle->lastuse >= idle->timeout) {
+            count += extbzip3_idle_trim(idle);
+        }
+    }
+
+    return count;
+}
+
+/*
+ *  @overload trim_idle
+ *
+ *  idle_trim: を与えて作成した Encoder と Decoder のうち、最後に使われてから idle_trim 秒以上たったものの
+ *  bz3_state と作業用の文字列を解放します。解放したものは次の write や read で確保し直されます。
+ *
+ *  接続ごとにストリームを持つサーバーなどで、タイマーから定期的に呼び出すことを想定しています。
+ *  Bzip3.memory_limit に達した場合にも自動的に呼び出されます。
+ *
+ *  呼び出した Ractor で作られたものだけが対象です。
+ *
+ *  @return [Integer]   解放した数
+ */
+static VALUE
+idle_s_trim_idle(VALUE mod)
+{
+    return SIZET2NUM(extbzip3_idle_trim_expired());
+}
+
+void
+extbzip3_init_idle(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+#ifdef IDLE_RACTOR_LOCAL
+    idle_list_key = rb_ractor_local_storage_ptr_newkey(&idle_list_type);
+#endif
+
+    rb_define_singleton_method(bzip3_module, "trim_idle", idle_s_trim_idle, 0);
+}
@@ -0,0 +1,305 @@
+#include "extbzip3.h"
+#include <time.h>
+
+/*
+ * bz3_state が使用するメモリの予算です。
+ *
+ * aux_bz3_new などで確保した作業領域の概算 (aux_bz3_footprint) を合計し、
+ * Bzip3.memory_limit を超えないように新たな確保を待たせるか、例外を発生させます。
+ *
+ * 予算の操作はアトミック命令だけで行うため、どのスレッドからでも呼び出せます。
+ * 空きを待つスレッドは条件変数で待機し、予算が返却された時に起こされます。
+ */
+
+static size_t memory_limit;     /* 0 は無制限 */
+static size_t memory_usage;
+static double memory_timeout;   /* __atomic_load / __atomic_store で読み書きする */
+static VALUE memory_limit_error;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+/*
+ * 予算の空きを待つスレッドを、extbzip3_memory_release から起こすためのものです。
+ * memory_waiters が 0 の間は、返却する側はロックを取りません。
+ */
+static struct extbzip3_lock memory_lock;   /* extbzip3_init_memory で登録する */
+static pthread_cond_t memory_released;
+static int memory_waiters;
+#endif
+
+int
+extbzip3_memory_reserve(size_t size)
+{
+    size_t used = __atomic_load_n(&memory_usage, __ATOMIC_RELAXED);
+
+    for (;;) {
+        size_t limit = __atomic_load_n(&memory_limit, __ATOMIC_RELAXED);
+
+        if (limit > 0 && (used > limit || size > limit - used)) {
+            return 0;
+        }
+
+        if (__atomic_compare_exchange_n(&memory_usage, &used, used + size, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+}
+
+static void
+memory_wakeup(void)
+{
+#ifdef EXTBZIP3_POOL_SUPPORT
+    if (__atomic_load_n(&memory_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&memory_lock.mutex);
+        pthread_cond_broadcast(&memory_released);
+        pthread_mutex_unlock(&memory_lock.mutex);
+    }
+#endif
+}
+
+void
+extbzip3_memory_release(size_t size)
+{
+    __atomic_fetch_sub(&memory_usage, size, __ATOMIC_SEQ_CST);
+    memory_wakeup();
+}
+
+static double
+memory_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+struct memory_waiter
+{
+    size_t size;
+    struct timespec deadline;   /* CLOCK_REALTIME */
+    int interrupted;
+    int reserved;
+};
+
+static void *
+memory_wait_nogvl(void *opaque)
+{
+    struct memory_waiter *w = (struct memory_waiter *)opaque;
+
+    pthread_mutex_lock(&memory_lock.mutex);
+    // 返却する側が memory_waiters を見落とさないように、数えてから予算を確かめる
+    __atomic_add_fetch(&memory_waiters, 1, __ATOMIC_SEQ_CST);
+
+    while (!w->interrupted && !(w->reserved = extbzip3_memory_reserve(w->size))) {
+        if (pthread_cond_timedwait(&memory_released, &memory_lock.mutex, &w->deadline) != 0) {
+            w->reserved = extbzip3_memory_reserve(w->size);
+            break;
+        }
+    }
+
+    __atomic_sub_fetch(&memory_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&memory_lock.mutex);
+
+    return NULL;
+}
+
+static void
+memory_wait_ubf(void *opaque)
+{
+    struct memory_waiter *w = (struct memory_waiter *)opaque;
+
+    pthread_mutex_lock(&memory_lock.mutex);
+    w->interrupted = 1;
+    pthread_cond_broadcast(&memory_released);
+    pthread_mutex_unlock(&memory_lock.mutex);
+}
+#endif
+
+/*
+ * 予算に size バイトの空きが出来るまで、最大 sec 秒待ちます。確保できた場合は真を返します。
+ */
+static int
+memory_wait(size_t size, double sec)
+{
+#ifdef EXTBZIP3_POOL_SUPPORT
+    struct memory_waiter w = { size, { 0, 0 }, 0, 0 };
+    clock_gettime(CLOCK_REALTIME, &w.deadline);
+    w.deadline.tv_sec += (time_t)sec;
+    w.deadline.tv_nsec += (long)((sec - (double)(time_t)sec) * 1e9);
+    if (w.deadline.tv_nsec >= 1000000000L) {
+        w.deadline.tv_sec++;
+        w.deadline.tv_nsec -= 1000000000L;
+    }
+
+    rb_thread_call_without_gvl(memory_wait_nogvl, &w, memory_wait_ubf, &w);
+
+    return w.reserved;
+#else
+    struct timeval interval = { 0, 10 * 1000 };
+
+    for (double waited = 0.0; waited < sec; waited += 0.01) {
+        rb_thread_wait_for(interval);
+
+        if (extbzip3_memory_reserve(size)) {
+            return 1;
+        }
+    }
+
+    return extbzip3_memory_reserve(size);
+#endif
+}
+
+void
+extbzip3_memory_acquire(size_t size)
+{
+    if (extbzip3_memory_reserve(size)) {
+        return;
+    }
+
+    // 使われていない Encoder や Decoder が予算を抱えたままの場合がある
+    if (extbzip3_idle_trim_expired() > 0 && extbzip3_memory_reserve(size)) {
+        return;
+    }
+
+    size_t limit = __atomic_load_n(&memory_limit, __ATOMIC_RELAXED);
+    double timeout;
+    __atomic_load(&memory_timeout, &timeout, __ATOMIC_RELAXED);
+
+    if (limit == 0 || size <= limit) {
+        double deadline = memory_now() + timeout;
+        int collected = 0;
+
+        for (;;) {
+            double remain = deadline - memory_now();
+
+            // 参照されなくなった Encoder や Decoder が予算を抱えたままの場合があるため、
+            // 少し待っても返却されなければ、待機ごとに一度だけ GC を走らせる
+            if (!collected && (remain <= 0.0 || timeout - remain >= 0.1)) {
+                rb_gc_start();
+                collected = 1;
+
+                if (extbzip3_memory_reserve(size)) {
+                    return;
+                }
+            }
+
+            if (remain <= 0.0) {
+                break;
+            }
+
+            if (memory_wait(size, (collected || remain < 0.1 ? remain : 0.1))) {
+                return;
+            }
+
+            rb_thread_check_ints();
+        }
+    }
+
+    rb_raise(memory_limit_error,
+             "bzip3 memory limit exceeded (limit: %" PRIuSIZE ", in use: %" PRIuSIZE ", requested: %" PRIuSIZE ")",
+             limit, __atomic_load_n(&memory_usage, __ATOMIC_RELAXED), size);
+}
+
+/*
+ *  @overload memory_limit
+ *
+ *  bz3_state が使用するメモリ量の上限を返します。上限がない場合は nil を返します。
+ *
+ *  @return [Integer, nil]
+ */
+static VALUE
+memory_s_limit(VALUE mod)
+{
+    size_t limit = __atomic_load_n(&memory_limit, __ATOMIC_RELAXED);
+
+    return (limit > 0 ? SIZET2NUM(limit) : Qnil);
+}
+
+/*
+ *  @overload memory_limit=(size)
+ *
+ *  bz3_state が使用するメモリ量の上限を設定します。nil または 0 で上限をなくします。
+ *
+ *  上限に達している場合、新たな Encoder、Decoder、BlockProcessor、ワーカースレッドなどは
+ *  Bzip3.memory_timeout 秒まで空きを待ち、それでも足りなければ Bzip3::MemoryLimitError 例外を発生させます。
+ *  ただし Encoder はブロックサイズを小さくして確保できる場合はそうします。
+ *  BlockPool などのワーカースレッドは、確保できた分だけのスレッド数で動作します (最低でも1つ)。
+ *
+ *  使用量は確保時の概算で、すでに確保されている作業領域には影響しません。
+ *
+ *  @param  size        [Integer, nil]
+ */
+static VALUE
+memory_s_set_limit(VALUE mod, VALUE size)
+{
+    __atomic_store_n(&memory_limit, (RB_NIL_P(size) ? 0 : NUM2SIZET(size)), __ATOMIC_RELAXED);
+    memory_wakeup();
+
+    return size;
+}
+
+/*
+ *  @overload memory_usage
+ *
+ *  bz3_state が現在使用しているメモリ量の概算を返します。
+ *
+ *  @return [Integer]
+ */
+static VALUE
+memory_s_usage(VALUE mod)
+{
+    return SIZET2NUM(__atomic_load_n(&memory_usage, __ATOMIC_RELAXED));
+}
+
+/*
+ *  @overload memory_timeout
+ *
+ *  メモリの上限に達している場合に、空きを待つ最大の秒数を返します。
+ *
+ *  @return [Float]
+ */
+static VALUE
+memory_s_timeout(VALUE mod)
+{
+    double timeout;
+    __atomic_load(&memory_timeout, &timeout, __ATOMIC_RELAXED);
+
+    return DBL2NUM(timeout);
+}
+
+/*
+ *  @overload memory_timeout=(sec)
+ *
+ *  @param  sec         [Numeric, nil]  nil は 0 と同じです
+ */
+static VALUE
+memory_s_set_timeout(VALUE mod, VALUE sec)
+{
+    double timeout = (RB_NIL_P(sec) ? 0.0 : NUM2DBL(sec));
+
+    if (timeout < 0.0) {
+        rb_raise(rb_eArgError, "negative timeout - %" PRIsVALUE, sec);
+    }
+
+    __atomic_store(&memory_timeout, &timeout, __ATOMIC_RELAXED);
+
+    return sec;
+}
+
+void
+extbzip3_init_memory(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    extbzip3_lock_init(&memory_lock, &memory_released);
+#endif
+
+    memory_limit_error = rb_define_class_under(bzip3_module, "MemoryLimitError", rb_eRuntimeError);
+
+    rb_define_singleton_method(bzip3_module, "memory_limit", memory_s_limit, 0);
+    rb_define_singleton_method(bzip3_module, "memory_limit=", memory_s_set_limit, 1);
+    rb_define_singleton_method(bzip3_module, "memory_usage", memory_s_usage, 0);
+    rb_define_singleton_method(bzip3_module, "memory_timeout", memory_s_timeout, 0);
+    rb_define_singleton_method(bzip3_module, "memory_timeout=", memory_s_set_timeout, 1);
+}
@@ -0,0 +1,896 @@
+#include "extbzip3.h"
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+
+#include <unistd.h>
+
+/*
+ * 実行器が処理する1ブロック分の仕事です。
+ *
+ * 作成した側と実行器の待ち行列 (または実行中のワーカー) がそれぞれ参照を持ち、
+ * 最後に参照を手放した側が解放します。
+ * GVL を持たないスレッドから解放されることがあるため、メモリは malloc/free で管理します。
+ */
+struct extbzip3_job
+{
+    struct extbzip3_task task;
+    struct extbzip3_pool *pool;
+    struct extbzip3_lock lock;
+    pthread_cond_t cond;
+    unsigned long generation;   /* 作成した時の extbzip3_executor_generation() */
+    int refcount;
+    int done;
+    int type;
+    const uint8_t *src;         /* EXTBZIP3_JOB_VERIFY の入力 */
+    uint8_t *buf;
+    size_t len;
+    size_t origsize;
+    int32_t ret;
+};
+
+/*
+ * 作業領域 (bz3_state) の組と、共有の実行器への待ち行列です。
+ *
+ * 作業領域の数だけの仕事を同時に実行器へ渡します。
+ * ワーカースレッドは実行器のものを使うため、プールごとにスレッドを作ることはありません。
+ */
+struct extbzip3_pool
+{
+    uint32_t blocksize;
+    int nthreads;               /* 作業領域の数 (同時に処理するブロックの数) */
+    int shutdown;
+    struct bz3_state **bzip3;
+    uint8_t **scratch;          /* EXTBZIP3_JOB_VERIFY のための伸長先 */
+    int *freeslots;
+    int nfree;
+    struct extbzip3_lock lock;
+    struct extbzip3_queue queue;
+};
+
+static struct extbzip3_job *
+job_alloc(int type, size_t bufsize)
+{
+    struct extbzip3_job *job = (struct extbzip3_job *)calloc(1, sizeof(struct extbzip3_job));
+    uint8_t *buf = (bufsize > 0 ? (uint8_t *)malloc(bufsize) : NULL);
+
+    if (!job || (bufsize > 0 && !buf)) {
+        free(job);
+        free(buf);
+        rb_raise(rb_eNoMemError, "failed to allocate memory for block job");
+    }
+
+    extbzip3_lock_init(&job->lock, &job->cond);
+    job->generation = extbzip3_executor_generation();
+    job->refcount = 2;
+    job->type = type;
+    job->buf = buf;
+
+    return job;
+}
+
+struct extbzip3_job *
+extbzip3_job_new(int type, const void *src, size_t len, size_t bufsize, size_t origsize)
+{
+    struct extbzip3_job *job = job_alloc(type, (bufsize > len ? bufsize : len));
+    if (src) {
+        memcpy(job->buf, src, len);
+    }
+    job->src = job->buf;
+    job->len = len;
+    job->origsize = origsize;
+
+    return job;
+}
+
+struct extbzip3_job *
+extbzip3_job_new_ref(int type, const void *src, size_t len, size_t origsize)
+{
+    struct extbzip3_job *job = job_alloc(type, 0);
+    job->src = (const uint8_t *)src;
+    job->len = len;
+    job->origsize = origsize;
+
+    return job;
+}
+
+void
+extbzip3_job_release(struct extbzip3_job *job)
+{
+    pthread_mutex_lock(&job->lock.mutex);
+    int refcount = --job->refcount;
+    pthread_mutex_unlock(&job->lock.mutex);
+
+    if (refcount == 0) {
+        extbzip3_lock_destroy(&job->lock);
+        free(job->buf);
+        free(job);
+    }
+}
+
+static void
+job_finish(struct extbzip3_job *job, int32_t ret)
+{
+    pthread_mutex_lock(&job->lock.mutex);
+    job->ret = ret;
+    job->done = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock.mutex);
+}
+
+/*
+ * fork の前に積まれたか実行中だった仕事は、子プロセスでは実行するワーカーが存在しないため、
+ * 取り消しとして完了させます (ワーカーが持っていた参照は解放されずに残ります)。
+ * job->lock.mutex を保持した状態で呼び出します。
+ */
+static int
+job_done_locked(struct extbzip3_job *job)
+{
+    if (!job->done && job->generation != extbzip3_executor_generation()) {
+        job->ret = EXTBZIP3_ERR_CANCELED;
+        job->done = 1;
+    }
+
+    return job->done;
+}
+
+int
+extbzip3_job_done_p(struct extbzip3_job *job)
+{
+    pthread_mutex_lock(&job->lock.mutex);
+    int done = job_done_locked(job);
+    pthread_mutex_unlock(&job->lock.mutex);
+
+    return done;
+}
+
+struct job_waiter
+{
+    struct extbzip3_job *job;
+    int interrupted;
+};
+
+static void *
+job_wait_nogvl(void *opaque)
+{
+    struct job_waiter *w = (struct job_waiter *)opaque;
+
+    pthread_mutex_lock(&w->job->lock.mutex);
+    while (!job_done_locked(w->job) && !w->interrupted) {
+        pthread_cond_wait(&w->job->cond, &w->job->lock.mutex);
+    }
+    pthread_mutex_unlock(&w->job->lock.mutex);
+
+    return NULL;
+}
+
+static void
+job_wait_ubf(void *opaque)
+{
+    struct job_waiter *w = (struct job_waiter *)opaque;
+
+    pthread_mutex_lock(&w->job->lock.mutex);
+    w->interrupted = 1;
+    pthread_cond_broadcast(&w->job->cond);
+    pthread_mutex_unlock(&w->job->lock.mutex);
+}
+
+int32_t
+extbzip3_job_wait(struct extbzip3_job *job)
+{
+    struct job_waiter w = { job, 0 };
+
+    while (!extbzip3_job_done_p(job)) {
+        w.interrupted = 0;
+        rb_thread_call_without_gvl(job_wait_nogvl, &w, job_wait_ubf, &w);
+        rb_thread_check_ints();
+    }
+
+    return job->ret;
+}
+
+/*
+ * GVL を持たないネイティブスレッドから仕事の完了を待ちます。割り込みは受け付けません。
+ */
+int32_t
+extbzip3_job_join(struct extbzip3_job *job)
+{
+    pthread_mutex_lock(&job->lock.mutex);
+    while (!job_done_locked(job)) {
+        pthread_cond_wait(&job->cond, &job->lock.mutex);
+    }
+    pthread_mutex_unlock(&job->lock.mutex);
+
+    return job->ret;
+}
+
+/*
+ * 仕事をキューに積む前に、呼び出し側が直接入力を書き込むための領域を返します。
+ */
+uint8_t *
+extbzip3_job_buffer(struct extbzip3_job *job)
+{
+    return job->buf;
+}
+
+const uint8_t *
+extbzip3_job_result(struct extbzip3_job *job)
+{
+    return job->buf;
+}
+
+static int32_t
+job_process(struct bz3_state *bz3, struct extbzip3_job *job, uint8_t **scratch, size_t scratchsize)
+{
+    int32_t ret;
+
+    switch (job->type) {
+    case EXTBZIP3_JOB_ENCODE:
+        ret = bz3_encode_block(bz3, job->buf, (int32_t)job->len);
+        break;
+    case EXTBZIP3_JOB_DECODE:
+        ret = bz3_decode_block(bz3, job->buf, (int32_t)job->len, (int32_t)job->origsize);
+        break;
+    case EXTBZIP3_JOB_VERIFY:
+        if (*scratch == NULL) {
+            *scratch = (uint8_t *)malloc(scratchsize);
+
+            if (*scratch == NULL) {
+                return BZ3_ERR_INIT;
+            }
+        }
+
+        if (job->len > scratchsize || job->origsize > scratchsize) {
+            return BZ3_ERR_DATA_TOO_BIG;
+        }
+
+        memcpy(*scratch, job->src, job->len);
+        ret = bz3_decode_block(bz3, *scratch, (int32_t)job->len, (int32_t)job->origsize);
+        break;
+    default:
+        return BZ3_ERR_INIT;
+    }
+
+    return (ret < 0 ? bz3_last_error(bz3) : ret);
+}
+
+/*
+ * 実行器のワーカースレッドで呼ばれます。
+ *
+ * 待ち行列は作業領域の数までしか同時に仕事を渡さないため、空いている作業領域が必ずあります。
+ */
+static void *
+job_run(void *opaque)
+{
+    struct extbzip3_job *job = (struct extbzip3_job *)opaque;
+    struct extbzip3_pool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock.mutex);
+    int slot = (pool->nfree > 0 ? pool->freeslots[--pool->nfree] : -1);
+    pthread_mutex_unlock(&pool->lock.mutex);
+
+    if (slot < 0) {
+        // 待ち行列が作業領域の数より多くの仕事を渡した場合 (起こらないはず)
+        job_finish(job, BZ3_ERR_INIT);
+        extbzip3_job_release(job);
+
+        return NULL;
+    }
+
+    int32_t ret = job_process(pool->bzip3[slot], job, &pool->scratch[slot], bz3_bound(pool->blocksize));
+
+    pthread_mutex_lock(&pool->lock.mutex);
+    pool->freeslots[pool->nfree++] = slot;
+    pthread_mutex_unlock(&pool->lock.mutex);
+
+    job_finish(job, ret);
+    extbzip3_job_release(job);
+
+    return NULL;
+}
+
+/*
+ * 実行されずに待ち行列から取り除かれた仕事を、取り消しとして完了させます。
+ */
+static void
+job_cancel(void *opaque)
+{
+    struct extbzip3_job *job = (struct extbzip3_job *)opaque;
+
+    job_finish(job, EXTBZIP3_ERR_CANCELED);
+    extbzip3_job_release(job);
+}
+
+int
+extbzip3_default_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 0 ? (n < EXTBZIP3_THREADS_MAX ? (int)n : EXTBZIP3_THREADS_MAX) : 1);
+#else
+    return 1;
+#endif
+}
+
+/*
+ * GVL を持たない状態でも呼び出せます。
+ *
+ * キューに積まれた仕事をすべて処理し終わるまで待ちます。以降は仕事を積めません。
+ */
+void
+extbzip3_pool_shutdown(struct extbzip3_pool *pool)
+{
+    pool->shutdown = 1;
+    extbzip3_queue_close(&pool->queue);
+}
+
+static void *
+pool_shutdown_nogvl(void *opaque)
+{
+    extbzip3_pool_shutdown((struct extbzip3_pool *)opaque);
+
+    return NULL;
+}
+
+/*
+ * GVL を持たないワーカースレッドから呼ばれることがあるため、xfree は使いません。
+ */
+static void
+pool_destroy(struct extbzip3_pool *pool)
+{
+    for (int i = 0; i < pool->nthreads; i++) {
+        aux_bz3_free(pool->bzip3[i], pool->blocksize);
+        free(pool->scratch[i]);
+    }
+
+    extbzip3_lock_destroy(&pool->lock);
+    free(pool->bzip3);
+    free(pool->scratch);
+    free(pool->freeslots);
+    free(pool);
+}
+
+/*
+ * 子プロセスでは、fork の前に実行中だった仕事が作業領域を返すことはないため、すべて空きに戻します。
+ */
+static void
+pool_atfork_child(struct extbzip3_lock *lock)
+{
+    struct extbzip3_pool *pool = (struct extbzip3_pool *)((char *)lock - offsetof(struct extbzip3_pool, lock));
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        pool->freeslots[i] = i;
+    }
+    pool->nfree = pool->nthreads;
+}
+
+static void
+pool_orphan(struct extbzip3_queue *q)
+{
+    pool_destroy((struct extbzip3_pool *)((char *)q - offsetof(struct extbzip3_pool, queue)));
+}
+
+void
+extbzip3_pool_free(struct extbzip3_pool *pool)
+{
+    if (pool) {
+        extbzip3_pool_shutdown(pool);
+        pool_destroy(pool);
+    }
+}
+
+/*
+ * extbzip3_pool_free と異なり、仕事が終わるのを待ちません。GC の free 関数から呼び出すためのものです。
+ *
+ * まだ実行されていない仕事は EXTBZIP3_ERR_CANCELED で完了させます。
+ * 実行中の仕事があれば、最後の仕事が終わった時にワーカースレッドが pool を解放します。
+ */
+void
+extbzip3_pool_discard(struct extbzip3_pool *pool)
+{
+    if (pool) {
+        pool->shutdown = 1;
+        extbzip3_queue_abandon(&pool->queue, pool_orphan);
+    }
+}
+
+size_t
+extbzip3_pool_memsize(const struct extbzip3_pool *pool)
+{
+    size_t size = sizeof(*pool) + (sizeof(*pool->bzip3) + sizeof(*pool->scratch) + sizeof(*pool->freeslots)) * pool->nthreads;
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        size += aux_bz3_footprint(pool->blocksize);
+        if (pool->scratch[i]) {
+            size += bz3_bound(pool->blocksize);
+        }
+    }
+
+    return size;
+}
+
+/*
+ * nthreads は同時に処理するブロックの数です。
+ * 実際に動くワーカースレッドの数は、共有の実行器の設定 (Bzip3.configure) で決まります。
+ */
+struct extbzip3_pool *
+extbzip3_pool_new(uint32_t blocksize, int nthreads, size_t capacity)
+{
+    extbzip3_executor_prepare();
+
+    // メモリの予算が足りない場合は、確保できた分だけの作業領域で動作する (最低でも1つは空きを待って確保する)
+    struct bz3_state *first = aux_bz3_new(blocksize);
+
+    struct extbzip3_pool *pool = (struct extbzip3_pool *)calloc(1, sizeof(struct extbzip3_pool));
+    if (pool) {
+        pool->bzip3 = (struct bz3_state **)calloc(nthreads, sizeof(struct bz3_state *));
+        pool->scratch = (uint8_t **)calloc(nthreads, sizeof(uint8_t *));
+        pool->freeslots = (int *)calloc(nthreads, sizeof(int));
+    }
+
+    if (!pool || !pool->bzip3 || !pool->scratch || !pool->freeslots) {
+        aux_bz3_free(first, blocksize);
+        if (pool) {
+            free(pool->bzip3);
+            free(pool->scratch);
+            free(pool->freeslots);
+            free(pool);
+        }
+        rb_raise(rb_eNoMemError, "failed to allocate memory for block pool");
+    }
+
+    pool->blocksize = blocksize;
+    pool->nthreads = nthreads;
+    extbzip3_lock_init(&pool->lock, NULL);
+    pool->lock.atfork_child = pool_atfork_child;
+
+    pool->bzip3[0] = first;
+
+    for (int i = 1; i < nthreads; i++) {
+        if (!extbzip3_memory_reserve(aux_bz3_footprint(blocksize))) {
+            pool->nthreads = i;
+            break;
+        }
+
+        pool->bzip3[i] = bz3_new(blocksize);
+
+        if (pool->bzip3[i] == NULL) {
+            extbzip3_memory_release(aux_bz3_footprint(blocksize));
+            pool->nthreads = i;
+            break;
+        }
+    }
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        pool->freeslots[i] = i;
+    }
+    pool->nfree = pool->nthreads;
+
+    extbzip3_queue_init(&pool->queue, pool->nthreads, capacity);
+
+    return pool;
+}
+
+uint32_t
+extbzip3_pool_blocksize(const struct extbzip3_pool *pool)
+{
+    return pool->blocksize;
+}
+
+int
+extbzip3_pool_threads(const struct extbzip3_pool *pool)
+{
+    return pool->nthreads;
+}
+
+int
+extbzip3_pool_closed_p(const struct extbzip3_pool *pool)
+{
+    return pool->shutdown;
+}
+
+struct pool_pusher
+{
+    struct extbzip3_pool *pool;
+    struct extbzip3_job *job;
+    int interrupted;
+    int pushed;
+};
+
+static void *
+pool_push_nogvl(void *opaque)
+{
+    struct pool_pusher *w = (struct pool_pusher *)opaque;
+
+    w->pushed = extbzip3_queue_push(&w->pool->queue, &w->job->task, &w->interrupted);
+
+    return NULL;
+}
+
+static void
+pool_push_ubf(void *opaque)
+{
+    extbzip3_queue_interrupt(&((struct pool_pusher *)opaque)->interrupted);
+}
+
+static VALUE
+pool_push_main(VALUE arg)
+{
+    struct pool_pusher *w = (struct pool_pusher *)arg;
+
+    while (!w->pushed) {
+        if (w->pool->shutdown) {
+            rb_raise(rb_eRuntimeError, "closed pool");
+        }
+
+        extbzip3_executor_prepare();
+        w->interrupted = 0;
+        rb_thread_call_without_gvl(pool_push_nogvl, w, pool_push_ubf, w);
+
+        if (!w->pushed) {
+            rb_thread_check_ints();
+        }
+    }
+
+    return Qnil;
+}
+
+static VALUE
+pool_push_ensure(VALUE arg)
+{
+    struct pool_pusher *w = (struct pool_pusher *)arg;
+
+    if (!w->pushed) {
+        extbzip3_job_release(w->job); // reference for the queue
+    }
+
+    return Qnil;
+}
+
+/*
+ * 仕事をキューに積みます。キューが一杯の場合は GVL を手放して待機します。
+ *
+ * キューに積めなかった場合は、キューのための参照を手放してから例外を発生させます。
+ */
+void
+extbzip3_pool_push(struct extbzip3_pool *pool, struct extbzip3_job *job)
+{
+    job->pool = pool;
+    job->task.func = job_run;
+    job->task.arg = job;
+    job->task.detached = 1;
+    job->task.cancel = job_cancel;
+
+    struct pool_pusher w = { pool, job, 0, 0 };
+    rb_ensure(pool_push_main, (VALUE)&w, pool_push_ensure, (VALUE)&w);
+}
+
+struct block_pool
+{
+    struct extbzip3_pool *pool;
+};
+
+static void
+block_pool_free(void *ptr)
+{
+    struct block_pool *p = (struct block_pool *)ptr;
+
+    if (p) {
+        // GC を止めないように、積まれたままの仕事は処理せずに取り消す
+        extbzip3_pool_discard(p->pool);
+        xfree(p);
+    }
+}
+
+static size_t
+block_pool_memsize(const void *ptr)
+{
+    const struct block_pool *p = (const struct block_pool *)ptr;
+
+    return sizeof(*p) + (p->pool ? extbzip3_pool_memsize(p->pool) : 0);
+}
+
+static const rb_data_type_t block_pool_type = {
+    "extbzip3:block_pool",
+    { NULL, block_pool_free, block_pool_memsize, },
+    0, 0, 0
+};
+
+static VALUE
+block_pool_allocate(VALUE klass)
+{
+    return rb_data_typed_object_zalloc(klass, sizeof(struct block_pool), &block_pool_type);
+}
+
+static struct extbzip3_pool *
+get_block_pool(VALUE obj)
+{
+    struct block_pool *p = (struct block_pool *)rb_check_typeddata(obj, &block_pool_type);
+
+    if (!p || !p->pool) {
+        rb_raise(rb_eArgError, "wrong initialized - %" PRIsVALUE, obj);
+    }
+
+    return p->pool;
+}
+
+static struct extbzip3_pool *
+get_block_pool_alive(VALUE obj)
+{
+    struct extbzip3_pool *pool = get_block_pool(obj);
+
+    if (pool->shutdown) {
+        rb_raise(rb_eRuntimeError, "closed pool - %" PRIsVALUE, obj);
+    }
+
+    return pool;
+}
+
+/*
+ *  @overload initialize(blocksize: (16 << 20), threads: nil, queue: nil)
+ *
+ *  @param  blocksize   [Integer]       maximum block size
+ *  @param  threads     [Integer, nil]
+ *      number of blocks processed concurrently (default: number of online processors).
+ *      ネイティブスレッドはプロセス全体で共有される実行器のものを使います (Bzip3.configure を参照)。
+ *  @param  queue       [Integer, nil]
+ *      maximum number of pending blocks (default: `threads * 2`)
+ */
+static VALUE
+block_pool_initialize(int argc, VALUE argv[], VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    enum { numkw = 3 };
+    ID idtab[numkw] = { rb_intern("blocksize"), rb_intern("threads"), rb_intern("queue") };
+    union { struct { VALUE blocksize, threads, queue; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    struct block_pool *p = (struct block_pool *)rb_check_typeddata(self, &block_pool_type);
+    if (p == NULL || p->pool) {
+        rb_raise(rb_eTypeError, "wrong initialized or re-initializing - %" PRIsVALUE, self);
+    }
+
+    int nthreads = aux_conv_to_threads(kw.threads);
+
+    long capacity = (RB_NIL_OR_UNDEF_P(kw.queue) ? nthreads * 2 : NUM2LONG(kw.queue));
+    if (capacity < 1) {
+        rb_raise(rb_eArgError, "out of range for queue (expect 1.., but given %ld)", capacity);
+    }
+
+    p->pool = extbzip3_pool_new(aux_conv_to_blocksize(kw.blocksize), nthreads, (size_t)capacity);
+
+    return self;
+}
+
+struct block_pool_future
+{
+    struct extbzip3_job *job;
+    VALUE result;
+};
+
+static void
+block_pool_future_free(void *ptr)
+{
+    struct block_pool_future *p = (struct block_pool_future *)ptr;
+
+    if (p) {
+        if (p->job) {
+            extbzip3_job_release(p->job);
+        }
+
+        xfree(p);
+    }
+}
+
+static void
+block_pool_future_mark(void *ptr)
+{
+    rb_gc_mark_movable(((struct block_pool_future *)ptr)->result);
+}
+
+AUX_DEFINE_TYPED_DATA_COMPACT(
+    static void
+    block_pool_future_compact(void *ptr)
+    {
+        struct block_pool_future *p = (struct block_pool_future *)ptr;
+        p->result = rb_gc_location(p->result);
+    }
+)
+
+static const rb_data_type_t block_pool_future_type = {
+    "extbzip3:block_pool_future",
+    {
+        block_pool_future_mark,
+        block_pool_future_free,
+        NULL,
+        AUX_DEFINE_TYPED_DATA_COMPACT(block_pool_future_compact)
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE block_pool_future_class;
+
+static VALUE
+block_pool_submit(struct extbzip3_pool *pool, int type, const char *src, size_t srclen, size_t bufsize, size_t origsize)
+{
+    struct block_pool_future *f;
+    VALUE future = TypedData_Make_Struct(block_pool_future_class, struct block_pool_future, &block_pool_future_type, f);
+    f->result = Qnil;
+    f->job = extbzip3_job_new(type, src, srclen, bufsize, origsize);
+    extbzip3_pool_push(pool, f->job);
+
+    return future;
+}
+
+/*
+ *  @overload submit_encode(src)
+ *
+ *  src を圧縮する仕事をキューに積みます。
+ *
+ *  キューが一杯の場合は空きが出来るまで待機します。
+ *
+ *  @param  src         [String, IO::Buffer]    block data (up to blocksize)
+ *  @return [Bzip3::BlockPool::Future]
+ */
+static VALUE
+block_pool_submit_encode(VALUE self, VALUE src)
+{
+    struct extbzip3_pool *pool = get_block_pool_alive(self);
+    const char *srcptr;
+    size_t srclen;
+    aux_src_bytes(src, &srcptr, &srclen);
+
+    if (srclen > pool->blocksize) {
+        rb_raise(rb_eRuntimeError, "src too big - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(src), src);
+    }
+
+    return block_pool_submit(pool, EXTBZIP3_JOB_ENCODE, srcptr, srclen, bz3_bound(srclen), srclen);
+}
+
+/*
+ *  @overload submit_decode(src, originalsize)
+ *
+ *  src を伸長する仕事をキューに積みます。
+ *
+ *  キューが一杯の場合は空きが出来るまで待機します。
+ *
+ *  @param  src         [String, IO::Buffer]    compressed block data
+ *  @param  originalsize [Integer]
+ *  @return [Bzip3::BlockPool::Future]
+ */
+static VALUE
+block_pool_submit_decode(VALUE self, VALUE src, VALUE originalsize)
+{
+    struct extbzip3_pool *pool = get_block_pool_alive(self);
+
+    size_t origsize = NUM2SIZET(originalsize);
+    if (origsize > (size_t)pool->blocksize) {
+        rb_raise(rb_eRuntimeError, "originalsize too big - %" PRIsVALUE, originalsize);
+    }
+
+    const char *srcptr;
+    size_t srclen;
+    aux_src_bytes(src, &srcptr, &srclen);
+
+    if (srclen > bz3_bound(pool->blocksize)) {
+        rb_raise(rb_eRuntimeError, "src too big - #<%" PRIsVALUE ":0x%" PRIxVALUE ">", rb_class_of(src), src);
+    }
+
+    return block_pool_submit(pool, EXTBZIP3_JOB_DECODE, srcptr, srclen, bz3_bound(origsize), origsize);
+}
+
+static VALUE
+block_pool_blocksize(VALUE self)
+{
+    return UINT2NUM(get_block_pool(self)->blocksize);
+}
+
+static VALUE
+block_pool_threads(VALUE self)
+{
+    return INT2FIX(get_block_pool(self)->nthreads);
+}
+
+/*
+ *  @overload close
+ *
+ *  キューに積まれた仕事をすべて処理し終わるまで待ちます。以降は仕事を積めません。
+ *
+ *  close せずに BlockPool が GC で回収された場合は、まだ処理されていない仕事を取り消します。
+ *  取り消された仕事の Future#value は例外を発生させます。
+ */
+static VALUE
+block_pool_close(VALUE self)
+{
+    struct extbzip3_pool *pool = get_block_pool_alive(self);
+
+    rb_thread_call_without_gvl(pool_shutdown_nogvl, pool, NULL, NULL);
+
+    return Qnil;
+}
+
+static VALUE
+block_pool_closed_p(VALUE self)
+{
+    return (get_block_pool(self)->shutdown ? Qtrue : Qfalse);
+}
+
+static struct block_pool_future *
+get_block_pool_future(VALUE obj)
+{
+    struct block_pool_future *p = (struct block_pool_future *)rb_check_typeddata(obj, &block_pool_future_type);
+
+    if (!p || !p->job) {
+        rb_raise(rb_eArgError, "wrong initialized - %" PRIsVALUE, obj);
+    }
+
+    return p;
+}
+
+/*
+ *  @overload value
+ *
+ *  仕事が終わるまで待機して、その結果を返します。
+ *
+ *  @return [String]    compressed or decompressed block
+ *  @raise  [RuntimeError]  the block could not be processed
+ */
+static VALUE
+block_pool_future_value(VALUE self)
+{
+    struct block_pool_future *p = get_block_pool_future(self);
+    struct extbzip3_job *job = p->job;
+    int32_t ret = extbzip3_job_wait(job);
+
+    // 仕事の本体は Future が解放されるまで残しますが、バッファは結果を取り出した時点で解放します
+    if (job->buf) {
+        if (ret >= 0) {
+            p->result = rb_str_new((const char *)job->buf, ret);
+        }
+
+        free(job->buf);
+        job->buf = NULL;
+    }
+
+    extbzip3_check_error(ret);
+
+    return p->result;
+}
+
+static VALUE
+block_pool_future_done_p(VALUE self)
+{
+    return (extbzip3_job_done_p(get_block_pool_future(self)->job) ? Qtrue : Qfalse);
+}
+
+void
+extbzip3_init_pool(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    VALUE block_pool_class = rb_define_class_under(bzip3_module, "BlockPool", rb_cObject);
+    rb_define_alloc_func(block_pool_class, block_pool_allocate);
+    rb_define_method(block_pool_class, "initialize", block_pool_initialize, -1);
+    rb_define_method(block_pool_class, "submit_encode", block_pool_submit_encode, 1);
+    rb_define_method(block_pool_class, "submit_decode", block_pool_submit_decode, 2);
+    rb_define_method(block_pool_class, "blocksize", block_pool_blocksize, 0);
+    rb_define_method(block_pool_class, "threads", block_pool_threads, 0);
+    rb_define_method(block_pool_class, "close", block_pool_close, 0);
+    rb_define_method(block_pool_class, "closed?", block_pool_closed_p, 0);
+
+    block_pool_future_class = rb_define_class_under(block_pool_class, "Future", rb_cObject);
+    rb_undef_alloc_func(block_pool_future_class);
+    rb_define_method(block_pool_future_class, "value", block_pool_future_value, 0);
+    rb_define_method(block_pool_future_class, "done?", block_pool_future_done_p, 0);
+}
+
+#else // EXTBZIP3_POOL_SUPPORT
+
+void
+extbzip3_init_pool(VALUE bzip3_module)
+{
+}
+
+#endif // EXTBZIP3_POOL_SUPPORT
@@ -0,0 +1,707 @@
+#include "extbzip3.h"
+#include <ruby/encoding.h>
+#include <ruby/re.h>
+
+/*
+ * Bzip3.scan と Bzip3.grep の実装です。
+ *
+ * 各ブロックはネイティブスレッドで並列に伸長され、入力の順に窓 (window) へ連結されます。
+ * 検索は窓の上で直接行い (固定文字列は memmem、正規表現は onig_search)、
+ * 一致した部分 (grep では一致した行) だけを Ruby の文字列として取り出します。
+ *
+ * 窓の末尾にある不完全な行は次のブロックへ持ち越すため、ブロック境界をまたがる一致も見つかります。
+ * ただし改行をまたがる正規表現の一致は、窓の中に収まる場合に限ります。
+ */
+
+static VALUE scan_match_class;
+static int scan_re_fixedencoding;   /* Regexp::FIXEDENCODING */
+static int scan_re_noencoding;      /* Regexp::NOENCODING */
+
+struct scan
+{
+    struct aux_reader in;
+
+    int format;
+    int concat;
+    int nthreads;
+    uint32_t maxblocksize;
+    uint32_t blocksize;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    struct extbzip3_pool *pool;
+    struct extbzip3_job **inflight;
+    size_t inflight_capa;
+    size_t inflight_head;
+    size_t inflight_count;
+#else
+    struct bz3_state *bzip3;
+    char *scratch;
+#endif
+
+    VALUE pattern;
+    VALUE regexp;               /* pattern が Regexp の場合に、検索のために別に作った Regexp */
+    regex_t *regex;             /* regexp のもの */
+    OnigRegion *region;
+    rb_encoding *encoding;
+    int grep;
+    VALUE result;               /* ブロックが与えられた場合は nil */
+    uint64_t count;
+
+    char *window;               /* 伸長済みで、まだ確定していないデータ */
+    size_t window_len;
+    size_t window_capa;
+    size_t window_skip;         /* 窓の先頭からこの位置までは検索済み */
+    uint64_t window_base;       /* 窓の先頭の伸長後のオフセット */
+    uint64_t last_end;          /* 最後に取り出した一致 (grep では行) の終端 */
+};
+
+static const char *
+aux_memrchr(const char *buf, int ch, size_t len)
+{
+    while (len > 0) {
+        len--;
+        if (buf[len] == ch) {
+            return buf + len;
+        }
+    }
+
+    return NULL;
+}
+
+static const char *
+aux_memmem(const char *buf, size_t len, const char *pat, size_t patlen)
+{
+#ifdef HAVE_MEMMEM
+    return (const char *)memmem(buf, len, pat, patlen);
+#else
+    const char *const end = buf + len;
+
+    while ((size_t)(end - buf) >= patlen) {
+        const char *p = (const char *)memchr(buf, *pat, (end - buf) - patlen + 1);
+
+        if (p == NULL) {
+            return NULL;
+        }
+
+        if (memcmp(p, pat, patlen) == 0) {
+            return p;
+        }
+
+        buf = p + 1;
+    }
+
+    return NULL;
+#endif
+}
+
+/*
+ * 窓の pos から range までの位置で始まる最初の一致を探します。
+ */
+static int
+scan_match(struct scan *s, size_t pos, size_t range, size_t *mbeg, size_t *mend)
+{
+    const char *w = s->window;
+
+    if (s->regex) {
+        const UChar *str = (const UChar *)w;
+        OnigPosition r = onig_search(s->regex, str, str + s->window_len, str + pos, str + range,
+                                     s->region, ONIG_OPTION_NONE);
+
+        if (r == ONIG_MISMATCH) {
+            return 0;
+        } else if (r < 0) {
+            UChar message[ONIG_MAX_ERROR_MESSAGE_LEN];
+            onig_error_code_to_str(message, r);
+            rb_raise(rb_eRegexpError, "%s", (const char *)message);
+        }
+
+        *mbeg = (size_t)s->region->beg[0];
+        *mend = (size_t)s->region->end[0];
+
+        return 1;
+    } else {
+        size_t patlen = RSTRING_LEN(s->pattern);
+        size_t limit = range - 1 + patlen;
+        const char *p = aux_memmem(w + pos, (limit < s->window_len ? limit : s->window_len) - pos,
+                                   RSTRING_PTR(s->pattern), patlen);
+
+        if (p == NULL) {
+            return 0;
+        }
+
+        *mbeg = (size_t)(p - w);
+        *mend = *mbeg + patlen;
+
+        return 1;
+    }
+}
+
+static void
+scan_emit(struct scan *s, uint64_t offset, const char *ptr, size_t len)
+{
+    VALUE match = rb_struct_new(scan_match_class, ULL2NUM(offset), rb_enc_str_new(ptr, len, s->encoding));
+
+    s->count++;
+
+    if (RB_NIL_P(s->result)) {
+        rb_yield(match);
+    } else {
+        rb_ary_push(s->result, match);
+    }
+}
+
+/*
+ * 窓の中で確定した範囲を検索し、確定していない末尾を窓の先頭へ詰めます。
+ *
+ * 一致の開始位置は最後の改行の直後 (cut) より前に限ります。
+ * 固定文字列では一致全体が窓に収まる位置までに限り、
+ * 改行のない長いデータが続く場合はブロックサイズを超えたところで強制的に確定します。
+ */
+static void
+scan_search(struct scan *s, int eof)
+{
+    const char *w = s->window;
+    size_t len = s->window_len;
+    size_t overlap = (s->regex ? 0 : RSTRING_LEN(s->pattern) - 1);
+    size_t cut;
+
+    if (eof) {
+        cut = len;
+    } else {
+        const char *nl = aux_memrchr(w, '\n', len);
+        cut = (nl ? (size_t)(nl - w) + 1 : 0);
+
+        if (cut + overlap > len) {
+            cut = (len > overlap ? len - overlap : 0);
+        }
+
+        if (len - cut > s->blocksize && len > overlap) {
+            cut = len - overlap;
+        }
+
+        if (cut < s->window_skip) {
+            cut = s->window_skip;
+        }
+    }
+
+    // 前回の一致が窓の検索済みの範囲を越えていた場合は、その続きから探す
+    size_t pos = s->window_skip;
+    if (s->last_end > s->window_base + pos) {
+        pos = (size_t)(s->last_end - s->window_base);
+    }
+
+    while (pos < cut) {
+        size_t mbeg, mend;
+
+        if (!scan_match(s, pos, cut, &mbeg, &mend)) {
+            break;
+        }
+
+        if (s->grep) {
+            const char *nl = aux_memrchr(w, '\n', mbeg);
+            size_t lbeg = (nl ? (size_t)(nl - w) + 1 : 0);
+            size_t from = (mend > mbeg ? mend - 1 : mbeg);
+            nl = (const char *)memchr(w + from, '\n', len - from);
+            size_t lend = (nl ? (size_t)(nl - w) + 1 : len);
+
+            scan_emit(s, s->window_base + lbeg, w + lbeg, lend - lbeg);
+            s->last_end = s->window_base + lend;
+            pos = lend;
+        } else {
+            scan_emit(s, s->window_base + mbeg, w + mbeg, mend - mbeg);
+            s->last_end = s->window_base + mend;
+            pos = (mend > mbeg ? mend : mbeg + 1);
+        }
+    }
+
+    if (eof) {
+        s->window_base += len;
+        s->window_len = 0;
+        s->window_skip = 0;
+
+        return;
+    }
+
+    // grep のために、cut を含む行の先頭から持ち越す
+    const char *nl = aux_memrchr(w, '\n', cut);
+    size_t keep = (nl ? (size_t)(nl - w) + 1 : 0);
+    if (cut - keep > s->blocksize) {
+        keep = cut;
+    }
+
+    memmove(s->window, s->window + keep, len - keep);
+    s->window_base += keep;
+    s->window_len = len - keep;
+    s->window_skip = cut - keep;
+}
+
+static void
+scan_feed(struct scan *s, const void *buf, size_t len)
+{
+    if (s->window_capa - s->window_len < len) {
+        size_t capa = s->window_len + len;
+        if (capa < s->window_capa * 2) {
+            capa = s->window_capa * 2;
+        }
+
+        s->window = (char *)xrealloc(s->window, capa);
+        s->window_capa = capa;
+    }
+
+    memcpy(s->window + s->window_len, buf, len);
+    s->window_len += len;
+
+    scan_search(s, 0);
+}
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+
+static void
+scan_retire(struct scan *s)
+{
+    struct extbzip3_job *job = s->inflight[s->inflight_head];
+    int32_t ret = extbzip3_job_wait(job);
+
+    // 例外が起きた場合は、仕事を保持したまま scan_cleanup に解放させる
+    if (ret < 0) {
+        extbzip3_check_error(ret);
+    }
+
+    scan_feed(s, extbzip3_job_result(job), ret);
+
+    s->inflight[s->inflight_head] = NULL;
+    s->inflight_head = (s->inflight_head + 1) % s->inflight_capa;
+    s->inflight_count--;
+    extbzip3_job_release(job);
+}
+
+static void
+scan_drain(struct scan *s)
+{
+    while (s->inflight_count > 0) {
+        scan_retire(s);
+    }
+}
+
+static void *
+scan_shutdown_nogvl(void *opaque)
+{
+    extbzip3_pool_shutdown((struct extbzip3_pool *)opaque);
+
+    return NULL;
+}
+
+static void
+scan_prepare(struct scan *s, uint32_t blocksize)
+{
+    if (s->pool && s->blocksize >= blocksize) {
+        return;
+    }
+
+    if (s->pool) {
+        scan_drain(s);
+        rb_thread_call_without_gvl(scan_shutdown_nogvl, s->pool, NULL, NULL);
+        extbzip3_pool_free(s->pool);
+        s->pool = NULL;
+    }
+
+    s->pool = extbzip3_pool_new(blocksize, s->nthreads, (size_t)s->nthreads * 2);
+    s->blocksize = blocksize;
+}
+
+static void
+scan_block(struct scan *s, const char *src, size_t packedsize, uint32_t originsize)
+{
+    if (s->inflight_count >= s->inflight_capa) {
+        scan_retire(s);
+    }
+
+    struct extbzip3_job *job = extbzip3_job_new(EXTBZIP3_JOB_DECODE, src, packedsize, bz3_bound(originsize), originsize);
+    size_t slot = (s->inflight_head + s->inflight_count) % s->inflight_capa;
+    s->inflight[slot] = job;
+    s->inflight_count++;
+
+    extbzip3_pool_push(s->pool, job);
+}
+
+static VALUE
+scan_cleanup(VALUE arg)
+{
+    struct scan *s = (struct scan *)arg;
+
+    if (s->pool) {
+        rb_thread_call_without_gvl(scan_shutdown_nogvl, s->pool, NULL, NULL);
+        extbzip3_pool_free(s->pool);
+        s->pool = NULL;
+    }
+
+    for (; s->inflight_count > 0; s->inflight_count--) {
+        extbzip3_job_release(s->inflight[s->inflight_head]);
+        s->inflight_head = (s->inflight_head + 1) % s->inflight_capa;
+    }
+
+    xfree(s->inflight);
+    s->inflight = NULL;
+    xfree(s->window);
+    s->window = NULL;
+
+    if (s->region) {
+        onig_region_free(s->region, 1);
+        s->region = NULL;
+    }
+
+    return Qnil;
+}
+
+#else // EXTBZIP3_POOL_SUPPORT
+
+static void
+scan_drain(struct scan *s)
+{
+}
+
+static void
+scan_prepare(struct scan *s, uint32_t blocksize)
+{
+    if (s->bzip3 && s->blocksize >= blocksize) {
+        return;
+    }
+
+    if (s->bzip3) {
+        aux_bz3_free(s->bzip3, s->blocksize);
+        s->bzip3 = NULL;
+    }
+
+    s->scratch = (char *)xrealloc(s->scratch, bz3_bound(blocksize));
+    s->bzip3 = aux_bz3_new(blocksize);
+    s->blocksize = blocksize;
+}
+
+static void
+scan_block(struct scan *s, const char *src, size_t packedsize, uint32_t originsize)
+{
+    memcpy(s->scratch, src, packedsize);
+    int32_t ret = aux_bz3_decode_block_nogvl(s->bzip3, s->scratch, packedsize, originsize);
+
+    if (ret < 0) {
+        extbzip3_check_error(bz3_last_error(s->bzip3));
+    }
+
+    scan_feed(s, s->scratch, ret);
+}
+
+static VALUE
+scan_cleanup(VALUE arg)
+{
+    struct scan *s = (struct scan *)arg;
+
+    if (s->bzip3) {
+        aux_bz3_free(s->bzip3, s->blocksize);
+        s->bzip3 = NULL;
+    }
+
+    xfree(s->scratch);
+    s->scratch = NULL;
+    xfree(s->window);
+    s->window = NULL;
+
+    if (s->region) {
+        onig_region_free(s->region, 1);
+        s->region = NULL;
+    }
+
+    return Qnil;
+}
+
+#endif // EXTBZIP3_POOL_SUPPORT
+
+/*
+ * ストリームヘッダを読み込みます。
+ *
+ * 入力の終端に達していた場合は 1 を、ヘッダを読み込めた場合は 0 を返します。
+ * 異常があった場合は例外を発生させます。
+ */
+static int
+scan_read_header(struct scan *s, const char *pre, size_t prelen, uint32_t *blocksize, uint32_t *blockcount)
+{
+    int status = aux_reader_read_header(&s->in, s->format, pre, prelen, blocksize, blockcount);
+
+    if (status != 0) {
+        if (status < 0) {
+            extbzip3_check_error(status);
+        }
+
+        return 1;
+    }
+
+    if (*blocksize > s->maxblocksize) {
+        rb_raise(rb_eRuntimeError,
+                 "blocksize is too big (maxblocksize=%d, but given %d)",
+                 (int)s->maxblocksize, (int)*blocksize);
+    }
+
+    scan_prepare(s, *blocksize);
+
+    return 0;
+}
+
+static VALUE
+scan_main(VALUE arg)
+{
+    struct scan *s = (struct scan *)arg;
+    int first = 1;
+
+    for (;;) {
+        uint32_t chunk_blocksize, blockcount = 0;
+        int frame = (s->format == AUX_BZIP3_V1_FRAME_FORMAT);
+
+        if (scan_read_header(s, NULL, 0, &chunk_blocksize, (frame ? &blockcount : NULL)) != 0) {
+            if (first) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            break;
+        }
+
+        first = 0;
+
+        for (;;) {
+            if (frame && blockcount == 0) {
+                break;
+            }
+
+            const char *ptr;
+            size_t n = aux_reader_read(&s->in, 8, &ptr);
+
+            if (n == 0) {
+                if (frame) {
+                    extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+                }
+
+                goto finish;
+            }
+
+            if (!frame && n >= 5 && memcmp(ptr, aux_bzip3_signature, 5) == 0) {
+                if (!s->concat) {
+                    goto finish;
+                }
+
+                char pre[8];
+                memcpy(pre, ptr, n);
+
+                if (scan_read_header(s, pre, n, &chunk_blocksize, NULL) != 0) {
+                    goto finish;
+                }
+
+                continue;
+            }
+
+            if (n < 8) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            uint32_t packedsize = loadu32le(ptr);
+            uint32_t originsize = loadu32le(ptr + 4);
+
+            if (!aux_bzip3_block_header_p(packedsize, originsize, chunk_blocksize)) {
+                extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+            }
+
+            if (aux_reader_read(&s->in, packedsize, &ptr) < packedsize) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            scan_block(s, ptr, packedsize, originsize);
+
+            if (frame) {
+                blockcount--;
+            }
+        }
+
+        if (!s->concat) {
+            break;
+        }
+    }
+
+finish:
+    scan_drain(s);
+    scan_search(s, 1);
+
+    return Qnil;
+}
+
+/*
+ * Regexp の pattern から、検索に使う Regexp を別に作ります。
+ *
+ * Regexp 自身の regex_t は、同じ Regexp を他の文字コードの文字列に使うと作り直されて解放されることがあります。
+ * 検索の途中でブロックを呼び出すため、利用者から見えない Regexp の regex_t を使います。
+ *
+ * 伸長後のデータはバイナリとして扱います。
+ * ただし文字コードを固定した Regexp (`/é/` や `//u` など) の場合は、その文字コードのデータとして検索します。
+ */
+static void
+scan_compile_regex(struct scan *s)
+{
+    VALUE source = RREGEXP_SRC(s->pattern);
+    int options = rb_reg_options(s->pattern);
+    rb_encoding *enc = rb_enc_get(s->pattern);
+
+    if (!(options & scan_re_fixedencoding)) {
+        source = rb_enc_associate(rb_str_dup(source), rb_ascii8bit_encoding());
+        options = (options & ~scan_re_fixedencoding) | scan_re_noencoding;
+    } else if (!rb_enc_asciicompat(enc)) {
+        rb_raise(rb_eEncCompatError, "incompatible encoding regexp match (%s regexp with binary data)", rb_enc_name(enc));
+    }
+
+    s->regexp = rb_reg_new_str(source, options);
+    s->regex = RREGEXP_PTR(s->regexp);
+    s->encoding = (options & scan_re_fixedencoding ? enc : rb_ascii8bit_encoding());
+    s->region = onig_region_new();
+}
+
+static VALUE
+scan_run(VALUE arg)
+{
+    struct scan *s = (struct scan *)arg;
+
+    if (aux_io_buffer_p(s->in.src)) {
+        aux_src_bytes(s->in.src, &s->in.ptr, &s->in.len);
+    }
+
+    if (RB_TYPE_P(s->pattern, RUBY_T_REGEXP)) {
+        scan_compile_regex(s);
+    }
+
+    return rb_ensure(scan_main, arg, scan_cleanup, arg);
+}
+
+static VALUE
+scan_common(int argc, VALUE argv[], int grep)
+{
+    VALUE src, pattern, opts;
+    rb_scan_args(argc, argv, "2:", &src, &pattern, &opts);
+
+    enum { numkw = 4 };
+    ID idtab[numkw] = { rb_intern("threads"), rb_intern("blocksize"), rb_intern("concat"), rb_intern("format") };
+    union { struct { VALUE threads, blocksize, concat, format; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    struct scan s;
+    memset(&s, 0, sizeof(s));
+    s.format = aux_conv_to_format(kw.format);
+    s.concat = RB_UNDEF_P(kw.concat) || RTEST(kw.concat);
+    s.nthreads = aux_conv_to_threads(kw.threads);
+    s.maxblocksize = aux_conv_to_blocksize(kw.blocksize);
+    s.in.readbuf = Qnil;
+    s.in.tmpbuf = Qnil;
+    s.grep = grep;
+    s.regexp = Qnil;
+    s.result = (rb_block_given_p() ? Qnil : rb_ary_new());
+
+    if (RB_TYPE_P(pattern, RUBY_T_REGEXP)) {
+        s.pattern = pattern;
+    } else {
+        s.pattern = rb_str_new_frozen(StringValue(pattern));
+        s.encoding = rb_enc_get(s.pattern);
+
+        if (RSTRING_LEN(s.pattern) < 1) {
+            rb_raise(rb_eArgError, "empty pattern");
+        }
+    }
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    s.inflight_capa = (size_t)s.nthreads * 3 + 1;
+    s.inflight = ZALLOC_N(struct extbzip3_job *, s.inflight_capa);
+#endif
+
+    if (rb_type_p(src, RUBY_T_STRING)) {
+        s.in.src = rb_str_new_frozen(src);
+        s.in.ptr = RSTRING_PTR(s.in.src);
+        s.in.len = RSTRING_LEN(s.in.src);
+        scan_run((VALUE)&s);
+    } else if (aux_io_buffer_p(src)) {
+        s.in.src = src;
+        aux_io_buffer_locked_call(src, Qnil, scan_run, (VALUE)&s);
+    } else {
+        s.in.src = src;
+        s.in.readbuf = rb_str_buf_new(0);
+        s.in.tmpbuf = rb_str_buf_new(0);
+        scan_run((VALUE)&s);
+    }
+
+    RB_GC_GUARD(s.in.src);
+    RB_GC_GUARD(s.in.readbuf);
+    RB_GC_GUARD(s.in.tmpbuf);
+    RB_GC_GUARD(s.pattern);
+    RB_GC_GUARD(s.regexp);
+
+    return (RB_NIL_P(s.result) ? ULL2NUM(s.count) : s.result);
+}
+
+/*
+ *  @overload scan(src, pattern, threads: nil, blocksize: (16 << 20), concat: true, format: Bzip3::V1_FILE_FORMAT)
+ *  @overload scan(src, pattern, threads: nil, blocksize: (16 << 20), concat: true, format: Bzip3::V1_FILE_FORMAT) { |match| ... }
+ *
+ *  bzip3 データを伸長しながら pattern を検索します。
+ *
+ *  各ブロックはネイティブスレッドで並列に伸長され、伸長結果の上で直接検索されます。
+ *  Ruby のオブジェクトになるのは一致した部分だけです。
+ *
+ *  ブロック境界をまたがる一致も見つかります。
+ *  ただし Regexp による改行をまたがる一致は、ブロックサイズ程度の範囲に収まる場合に限り見つかります。
+ *
+ *  @param  src         [String, IO::Buffer, IO]
+ *      bzip3 sequence, or an object responding to `read(size, buf)`
+ *  @param  pattern     [String, Regexp]
+ *      String の場合はバイト列として一致を探します。
+ *      Regexp の場合も伸長後のデータはバイナリとして扱い、一致した文字列は ASCII-8BIT になります。
+ *      ただし文字コードを固定した Regexp (`/é/` や `//u` など) の場合は、その文字コードのデータとして検索します。
+ *      ASCII 互換でない文字コードの Regexp は Encoding::CompatibilityError 例外を発生させます。
+ *  @option opts        [Integer]       :threads (number of online processors)
+ *  @option opts        [Integer]       :blocksize ((16 << 20))
+ *      最大ブロックサイズを記述します。
+ *  @option opts        [true, false]   :concat (true)
+ *  @option opts                        :format (Bzip3::V1_FILE_FORMAT)
+ *      Bzip3::V1_FILE_FORMAT, Bzip3::V1_FRAME_FORMAT
+ *  @return [Array<Bzip3::ScanMatch>]
+ *      伸長後のオフセットと一致した文字列の組の配列です。
+ *  @return [Integer]
+ *      ブロックを与えた場合は、一致した数を返します。
+ *  @yieldparam match [Bzip3::ScanMatch]
+ */
+static VALUE
+scan_s_scan(int argc, VALUE argv[], VALUE mod)
+{
+    return scan_common(argc, argv, 0);
+}
+
+/*
+ *  @overload grep(src, pattern, threads: nil, blocksize: (16 << 20), concat: true, format: Bzip3::V1_FILE_FORMAT)
+ *  @overload grep(src, pattern, threads: nil, blocksize: (16 << 20), concat: true, format: Bzip3::V1_FILE_FORMAT) { |match| ... }
+ *
+ *  Bzip3.scan と同じですが、一致した部分ではなく一致を含む行 (改行を含む) を返します。
+ *  一つの行に複数の一致があっても、その行は一度だけ返されます。
+ *
+ *  @return [Array<Bzip3::ScanMatch>]
+ *      伸長後の行の先頭のオフセットと行の組の配列です。
+ *  @return [Integer]
+ *      ブロックを与えた場合は、一致した行の数を返します。
+ *  @yieldparam match [Bzip3::ScanMatch]
+ */
+static VALUE
+scan_s_grep(int argc, VALUE argv[], VALUE mod)
+{
+    return scan_common(argc, argv, 1);
+}
+
+void
+extbzip3_init_scan(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    scan_re_fixedencoding = NUM2INT(rb_const_get(rb_cRegexp, rb_intern("FIXEDENCODING")));
+    scan_re_noencoding = NUM2INT(rb_const_get(rb_cRegexp, rb_intern("NOENCODING")));
+    scan_match_class = rb_struct_define_under(bzip3_module, "ScanMatch", "offset", "string", NULL);
+    rb_define_singleton_method(bzip3_module, "scan", scan_s_scan, -1);
+    rb_define_singleton_method(bzip3_module, "grep", scan_s_grep, -1);
+}
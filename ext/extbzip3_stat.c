@@ -0,0 +1,305 @@
+#include "extbzip3.h"
+#include <stdio.h>
+
+/*
+ * Bzip3.stat の実装です。
+ *
+ * ストリームヘッダとブロックヘッダだけを辿り、ブロックの中身は伸長しません。
+ * 入力が IO で seek と size に応答する場合は、ブロックの中身を seek で読み飛ばします。
+ */
+
+static VALUE stat_class;
+static VALUE stat_block_class;
+
+struct stat_context
+{
+    struct aux_reader in;
+    int seekable;
+    uint64_t size;              /* seekable の場合の入力の大きさ */
+
+    int format;
+    int concat;
+    VALUE blocklist;            /* blocks: false の場合は nil */
+
+    uint32_t blocksize;
+    uint64_t members;
+    uint64_t blocks;
+    uint64_t packedsize;
+    uint64_t originalsize;
+};
+
+/*
+ * 入力を size バイト読み飛ばします。
+ * 戻り値は実際に読み飛ばせたバイト数です。
+ */
+static size_t
+stat_skip(struct stat_context *s, size_t size)
+{
+    if (s->in.ptr) {
+        const char *ptr;
+        return aux_reader_read(&s->in, size, &ptr);
+    }
+
+    if (s->seekable) {
+        size_t n = (s->size > s->in.offset ? s->size - s->in.offset : 0);
+        if (n > size) {
+            n = size;
+        }
+
+        rb_funcall(s->in.src, rb_intern("seek"), 2, SIZET2NUM(n), INT2FIX(SEEK_CUR));
+        s->in.offset += n;
+
+        return n;
+    }
+
+    // 読み込み用の文字列が大きくなりすぎないように、ブロックの中身は分割して読み捨てる
+    size_t done = 0;
+    while (done < size) {
+        const char *ptr;
+        size_t req = size - done;
+        if (req > (64 << 10)) {
+            req = 64 << 10;
+        }
+
+        size_t n = aux_reader_read(&s->in, req, &ptr);
+        done += n;
+
+        if (n < req) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * ストリームヘッダを読み込みます。
+ *
+ * 入力の終端に達していた場合は 1 を、ヘッダを読み込めた場合は 0 を返します。
+ * 異常があった場合は例外を発生させます。
+ */
+static int
+stat_read_header(struct stat_context *s, const char *pre, size_t prelen, uint32_t *blocksize, uint32_t *blockcount)
+{
+    int status = aux_reader_read_header(&s->in, s->format, pre, prelen, blocksize, blockcount);
+
+    if (status != 0) {
+        if (status < 0) {
+            extbzip3_check_error(status);
+        }
+
+        return 1;
+    }
+
+    s->members++;
+    if (s->blocksize < *blocksize) {
+        s->blocksize = *blocksize;
+    }
+
+    return 0;
+}
+
+static void
+stat_main(struct stat_context *s)
+{
+    int first = 1;
+
+    for (;;) {
+        uint32_t chunk_blocksize, blockcount = 0;
+        int frame = (s->format == AUX_BZIP3_V1_FRAME_FORMAT);
+
+        if (stat_read_header(s, NULL, 0, &chunk_blocksize, (frame ? &blockcount : NULL)) != 0) {
+            if (first) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            return;
+        }
+
+        first = 0;
+        s->packedsize = s->in.offset;
+
+        for (;;) {
+            if (frame && blockcount == 0) {
+                break;
+            }
+
+            uint64_t offset = s->in.offset;
+            const char *ptr;
+            size_t n = aux_reader_read(&s->in, 8, &ptr);
+
+            if (n == 0) {
+                if (frame) {
+                    extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+                }
+
+                return;
+            }
+
+            if (!frame && n >= 5 && memcmp(ptr, aux_bzip3_signature, 5) == 0) {
+                if (!s->concat) {
+                    return;
+                }
+
+                char pre[8];
+                memcpy(pre, ptr, n);
+                stat_read_header(s, pre, n, &chunk_blocksize, NULL);
+                s->packedsize = s->in.offset;
+
+                continue;
+            }
+
+            if (n < 8) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            uint32_t packedsize = loadu32le(ptr);
+            uint32_t originsize = loadu32le(ptr + 4);
+
+            if (!aux_bzip3_block_header_p(packedsize, originsize, chunk_blocksize)) {
+                extbzip3_check_error(BZ3_ERR_MALFORMED_HEADER);
+            }
+
+            if (stat_skip(s, packedsize) < packedsize) {
+                extbzip3_check_error(BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            s->blocks++;
+            s->packedsize = s->in.offset;
+            s->originalsize += originsize;
+
+            if (!RB_NIL_P(s->blocklist)) {
+                rb_ary_push(s->blocklist, rb_struct_new(stat_block_class,
+                                                        ULL2NUM(offset),
+                                                        UINT2NUM(packedsize + 8),
+                                                        UINT2NUM(originsize)));
+            }
+
+            if (frame) {
+                blockcount--;
+            }
+        }
+
+        if (!s->concat) {
+            return;
+        }
+    }
+}
+
+static VALUE
+stat_run(VALUE arg)
+{
+    struct stat_context *s = (struct stat_context *)arg;
+
+    if (aux_io_buffer_p(s->in.src)) {
+        aux_src_bytes(s->in.src, &s->in.ptr, &s->in.len);
+    } else if (!s->in.ptr) {
+        s->in.readbuf = rb_str_buf_new(0);
+        s->in.tmpbuf = rb_str_buf_new(0);
+
+        // 大きさの分からない入力は seek すると切り詰められたことに気付けないため、読み捨てる
+        if (rb_respond_to(s->in.src, rb_intern("seek")) &&
+            rb_respond_to(s->in.src, rb_intern("pos")) &&
+            rb_respond_to(s->in.src, rb_intern("size"))) {
+            VALUE pos = rb_funcall(s->in.src, rb_intern("pos"), 0);
+            VALUE size = rb_funcall(s->in.src, rb_intern("size"), 0);
+
+            if (RB_INTEGER_TYPE_P(pos) && RB_INTEGER_TYPE_P(size) && NUM2ULL(pos) <= NUM2ULL(size)) {
+                s->seekable = 1;
+                s->size = NUM2ULL(size) - NUM2ULL(pos);
+            }
+        }
+    }
+
+    stat_main(s);
+
+    return Qnil;
+}
+
+static VALUE
+stat_close(VALUE file)
+{
+    return rb_io_close(file);
+}
+
+/*
+ *  @overload stat(src, concat: true, blocks: true, format: Bzip3::V1_FILE_FORMAT)
+ *
+ *  bzip3 データのヘッダだけを読み込み、ブロックサイズやブロックの数、伸長後の大きさを返します。
+ *
+ *  ブロックの中身は伸長も CRC の検査もしません。
+ *  中身を検査する場合は Bzip3.verify を使ってください。
+ *
+ *  src が seek と size に応答する IO の場合は、ブロックの中身を seek で読み飛ばします。
+ *
+ *  @param  src         [String, IO::Buffer, IO, Pathname]
+ *      bzip3 sequence, an object responding to `read(size, buf)`, or a path responding to `to_path`
+ *  @option opts        [true, false]   :concat (true)
+ *  @option opts        [true, false]   :blocks (true)
+ *      false の場合は Bzip3::Stat#blocks を nil にして、ブロックごとの情報を集めません。
+ *  @option opts                        :format (Bzip3::V1_FILE_FORMAT)
+ *      Bzip3::V1_FILE_FORMAT, Bzip3::V1_FRAME_FORMAT
+ *  @return [Bzip3::Stat]
+ */
+static VALUE
+stat_s_stat(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "1:", &src, &opts);
+
+    enum { numkw = 3 };
+    ID idtab[numkw] = { rb_intern("concat"), rb_intern("blocks"), rb_intern("format") };
+    union { struct { VALUE concat, blocks, format; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    struct stat_context s;
+    memset(&s, 0, sizeof(s));
+    s.format = aux_conv_to_format(kw.format);
+    s.concat = RB_UNDEF_P(kw.concat) || RTEST(kw.concat);
+    s.blocklist = (RB_UNDEF_P(kw.blocks) || RTEST(kw.blocks) ? rb_ary_new() : Qnil);
+    s.in.readbuf = Qnil;
+    s.in.tmpbuf = Qnil;
+
+    if (rb_type_p(src, RUBY_T_STRING)) {
+        s.in.src = rb_str_new_frozen(src);
+        s.in.ptr = RSTRING_PTR(s.in.src);
+        s.in.len = RSTRING_LEN(s.in.src);
+        stat_run((VALUE)&s);
+    } else if (aux_io_buffer_p(src)) {
+        s.in.src = src;
+        aux_io_buffer_locked_call(src, Qnil, stat_run, (VALUE)&s);
+    } else if (!rb_obj_is_kind_of(src, rb_cIO) && rb_respond_to(src, rb_intern("to_path"))) {
+        // Pathname は read に応答するが IO としては扱えないため、IO 以外で to_path に応答するものはパスとみなす
+        s.in.src = rb_file_open_str(rb_get_path(src), "rb");
+        rb_ensure(stat_run, (VALUE)&s, stat_close, s.in.src);
+    } else {
+        s.in.src = src;
+        stat_run((VALUE)&s);
+    }
+
+    RB_GC_GUARD(s.in.src);
+    RB_GC_GUARD(s.in.readbuf);
+    RB_GC_GUARD(s.in.tmpbuf);
+
+    return rb_struct_new(stat_class,
+                         INT2FIX(s.format),
+                         UINT2NUM(s.blocksize),
+                         ULL2NUM(s.members),
+                         ULL2NUM(s.blocks),
+                         ULL2NUM(s.packedsize),
+                         ULL2NUM(s.originalsize),
+                         s.blocklist);
+}
+
+void
+extbzip3_init_stat(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    stat_class = rb_struct_define_under(bzip3_module, "Stat",
+                                        "format", "block_size", "members", "block_count",
+                                        "packed_size", "original_size", "blocks", NULL);
+    stat_block_class = rb_struct_define_under(stat_class, "Block",
+                                              "offset", "packed_size", "original_size", NULL);
+    rb_define_singleton_method(bzip3_module, "stat", stat_s_stat, -1);
+}
@@ -0,0 +1,429 @@
+#include "extbzip3.h"
+
+/*
+ * Bzip3.verify の実装です。
+ *
+ * 入力のヘッダを辿りながら各ブロックを作業領域へ伸長し、bz3_decode_block による CRC 検査の結果だけを集めます。
+ * 伸長結果は捨てるため、使用するメモリ量は入力の大きさに依存しません。
+ */
+
+static VALUE verify_report_class;
+
+struct verify
+{
+    struct aux_reader in;
+
+    int format;
+    int concat;
+    int nthreads;
+    uint32_t maxblocksize;
+    uint32_t blocksize;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    struct extbzip3_pool *pool;
+    struct extbzip3_job **inflight;
+    uint64_t *inflight_offset;
+    size_t inflight_capa;
+    size_t inflight_head;
+    size_t inflight_count;
+#else
+    struct bz3_state *bzip3;
+    char *scratch;
+#endif
+
+    uint64_t blocks;
+    uint64_t packedsize;
+    uint64_t originalsize;
+    int error;
+    uint64_t error_offset;
+};
+
+static void
+verify_fail(struct verify *v, uint64_t offset, int status)
+{
+    if (!v->error || offset < v->error_offset) {
+        v->error = status;
+        v->error_offset = offset;
+    }
+}
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+
+static void
+verify_retire(struct verify *v)
+{
+    struct extbzip3_job *job = v->inflight[v->inflight_head];
+    uint64_t offset = v->inflight_offset[v->inflight_head];
+    int32_t ret = extbzip3_job_wait(job);
+
+    v->inflight[v->inflight_head] = NULL;
+    v->inflight_head = (v->inflight_head + 1) % v->inflight_capa;
+    v->inflight_count--;
+    extbzip3_job_release(job);
+
+    if (ret < 0) {
+        verify_fail(v, offset, ret);
+    } else if (!v->error || offset < v->error_offset) {
+        v->blocks++;
+        v->originalsize += ret;
+    }
+}
+
+static void
+verify_drain(struct verify *v)
+{
+    while (v->inflight_count > 0) {
+        verify_retire(v);
+    }
+}
+
+static void *
+verify_shutdown_nogvl(void *opaque)
+{
+    extbzip3_pool_shutdown((struct extbzip3_pool *)opaque);
+
+    return NULL;
+}
+
+static void
+verify_prepare(struct verify *v, uint32_t blocksize)
+{
+    if (v->pool && v->blocksize >= blocksize) {
+        return;
+    }
+
+    if (v->pool) {
+        verify_drain(v);
+        rb_thread_call_without_gvl(verify_shutdown_nogvl, v->pool, NULL, NULL);
+        extbzip3_pool_free(v->pool);
+        v->pool = NULL;
+    }
+
+    v->pool = extbzip3_pool_new(blocksize, v->nthreads, (size_t)v->nthreads * 2);
+    v->blocksize = blocksize;
+}
+
+static void
+verify_block(struct verify *v, const char *src, size_t packedsize, uint32_t originsize, uint64_t offset)
+{
+    if (v->inflight_count >= v->inflight_capa) {
+        verify_retire(v);
+    }
+
+    struct extbzip3_job *job;
+    if (v->in.ptr) {
+        job = extbzip3_job_new_ref(EXTBZIP3_JOB_VERIFY, src, packedsize, originsize);
+    } else {
+        job = extbzip3_job_new(EXTBZIP3_JOB_VERIFY, src, packedsize, 0, originsize);
+    }
+
+    size_t slot = (v->inflight_head + v->inflight_count) % v->inflight_capa;
+    v->inflight[slot] = job;
+    v->inflight_offset[slot] = offset;
+    v->inflight_count++;
+
+    extbzip3_pool_push(v->pool, job);
+}
+
+static VALUE
+verify_cleanup(VALUE arg)
+{
+    struct verify *v = (struct verify *)arg;
+
+    if (v->pool) {
+        // 作業中の仕事は入力のメモリ領域を参照しているため、必ずすべて終わらせてから解放する
+        rb_thread_call_without_gvl(verify_shutdown_nogvl, v->pool, NULL, NULL);
+        extbzip3_pool_free(v->pool);
+        v->pool = NULL;
+    }
+
+    for (; v->inflight_count > 0; v->inflight_count--) {
+        extbzip3_job_release(v->inflight[v->inflight_head]);
+        v->inflight_head = (v->inflight_head + 1) % v->inflight_capa;
+    }
+
+    xfree(v->inflight);
+    xfree(v->inflight_offset);
+    v->inflight = NULL;
+    v->inflight_offset = NULL;
+
+    return Qnil;
+}
+
+#else // EXTBZIP3_POOL_SUPPORT
+
+static void
+verify_drain(struct verify *v)
+{
+}
+
+static void
+verify_prepare(struct verify *v, uint32_t blocksize)
+{
+    if (v->bzip3 && v->blocksize >= blocksize) {
+        return;
+    }
+
+    if (v->bzip3) {
+        aux_bz3_free(v->bzip3, v->blocksize);
+        v->bzip3 = NULL;
+    }
+
+    v->scratch = (char *)xrealloc(v->scratch, bz3_bound(blocksize));
+    v->bzip3 = aux_bz3_new(blocksize);
+    v->blocksize = blocksize;
+}
+
+static void
+verify_block(struct verify *v, const char *src, size_t packedsize, uint32_t originsize, uint64_t offset)
+{
+    memcpy(v->scratch, src, packedsize);
+    int32_t ret = aux_bz3_decode_block_nogvl(v->bzip3, v->scratch, packedsize, originsize);
+
+    if (ret < 0) {
+        verify_fail(v, offset, bz3_last_error(v->bzip3));
+    } else {
+        v->blocks++;
+        v->originalsize += ret;
+    }
+}
+
+static VALUE
+verify_cleanup(VALUE arg)
+{
+    struct verify *v = (struct verify *)arg;
+
+    if (v->bzip3) {
+        aux_bz3_free(v->bzip3, v->blocksize);
+        v->bzip3 = NULL;
+    }
+
+    xfree(v->scratch);
+    v->scratch = NULL;
+
+    return Qnil;
+}
+
+#endif // EXTBZIP3_POOL_SUPPORT
+
+/*
+ * ストリームヘッダを読み込みます。
+ *
+ * 入力の終端に達していた場合は 1 を、ヘッダを読み込めた場合は 0 を、異常があった場合は -1 を返します。
+ */
+static int
+verify_read_header(struct verify *v, const char *pre, size_t prelen, uint32_t *blocksize, uint32_t *blockcount)
+{
+    uint64_t offset = v->in.offset - prelen;
+    int status = aux_reader_read_header(&v->in, v->format, pre, prelen, blocksize, blockcount);
+
+    if (status != 0) {
+        if (status < 0) {
+            verify_fail(v, offset, status);
+        }
+
+        return (status > 0 ? 1 : -1);
+    }
+
+    if (*blocksize > v->maxblocksize) {
+        verify_fail(v, offset, BZ3_ERR_OUT_OF_BOUNDS);
+        return -1;
+    }
+
+    verify_prepare(v, *blocksize);
+
+    return 0;
+}
+
+static VALUE
+verify_main(VALUE arg)
+{
+    struct verify *v = (struct verify *)arg;
+    int first = 1;
+
+    while (!v->error) {
+        uint32_t chunk_blocksize, blockcount = 0;
+        int frame = (v->format == AUX_BZIP3_V1_FRAME_FORMAT);
+        int status = verify_read_header(v, NULL, 0, &chunk_blocksize, (frame ? &blockcount : NULL));
+
+        if (status != 0) {
+            if (status > 0 && first) {
+                verify_fail(v, v->in.offset, BZ3_ERR_TRUNCATED_DATA);
+            }
+
+            break;
+        }
+
+        first = 0;
+
+        for (;;) {
+            if (frame && blockcount == 0) {
+                break;
+            }
+
+            uint64_t offset = v->in.offset;
+            const char *ptr;
+            size_t n = aux_reader_read(&v->in, 8, &ptr);
+
+            if (n == 0) {
+                if (frame) {
+                    verify_fail(v, offset, BZ3_ERR_TRUNCATED_DATA);
+                }
+
+                goto finish;
+            }
+
+            if (!frame && n >= 5 && memcmp(ptr, aux_bzip3_signature, 5) == 0) {
+                if (!v->concat) {
+                    goto finish;
+                }
+
+                char pre[8];
+                memcpy(pre, ptr, n);
+
+                if (verify_read_header(v, pre, n, &chunk_blocksize, NULL) != 0) {
+                    goto finish;
+                }
+
+                continue;
+            }
+
+            if (n < 8) {
+                verify_fail(v, offset, BZ3_ERR_TRUNCATED_DATA);
+                goto finish;
+            }
+
+            uint32_t packedsize = loadu32le(ptr);
+            uint32_t originsize = loadu32le(ptr + 4);
+
+            if (!aux_bzip3_block_header_p(packedsize, originsize, chunk_blocksize)) {
+                verify_fail(v, offset, BZ3_ERR_MALFORMED_HEADER);
+                goto finish;
+            }
+
+            if (aux_reader_read(&v->in, packedsize, &ptr) < packedsize) {
+                verify_fail(v, offset, BZ3_ERR_TRUNCATED_DATA);
+                goto finish;
+            }
+
+            verify_block(v, ptr, packedsize, originsize, offset);
+
+            if (frame) {
+                blockcount--;
+            }
+
+            if (v->error) {
+                goto finish;
+            }
+        }
+
+        if (!v->concat) {
+            break;
+        }
+    }
+
+finish:
+    verify_drain(v);
+    v->packedsize = v->in.offset;
+
+    return Qnil;
+}
+
+static VALUE
+verify_run(VALUE arg)
+{
+    struct verify *v = (struct verify *)arg;
+
+    if (aux_io_buffer_p(v->in.src)) {
+        aux_src_bytes(v->in.src, &v->in.ptr, &v->in.len);
+    }
+
+    return rb_ensure(verify_main, arg, verify_cleanup, arg);
+}
+
+/*
+ *  @overload verify(src, threads: nil, blocksize: (16 << 20), concat: true, format: Bzip3::V1_FILE_FORMAT)
+ *
+ *  bzip3 データを伸長結果を保持せずに検査します。
+ *
+ *  各ブロックは再利用される作業領域へ伸長され、bz3_decode_block による CRC 検査の結果だけが集計されます。
+ *  複数のブロックはネイティブスレッドで並列に伸長されます。
+ *
+ *  最初に異常が見つかった時点で検査を打ち切ります。
+ *
+ *  @param  src         [String, IO::Buffer, IO]
+ *      bzip3 sequence, or an object responding to `read(size, buf)`
+ *  @option opts        [Integer]       :threads (number of online processors)
+ *  @option opts        [Integer]       :blocksize ((16 << 20))
+ *      最大ブロックサイズを記述します。
+ *  @option opts        [true, false]   :concat (true)
+ *  @option opts                        :format (Bzip3::V1_FILE_FORMAT)
+ *      Bzip3::V1_FILE_FORMAT, Bzip3::V1_FRAME_FORMAT
+ *  @return [Bzip3::VerifyReport]
+ */
+static VALUE
+verify_s_verify(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "1:", &src, &opts);
+
+    enum { numkw = 4 };
+    ID idtab[numkw] = { rb_intern("threads"), rb_intern("blocksize"), rb_intern("concat"), rb_intern("format") };
+    union { struct { VALUE threads, blocksize, concat, format; }; VALUE vect[numkw]; } kw;
+    rb_get_kwargs(opts, idtab, 0, numkw, kw.vect);
+
+    struct verify v;
+    memset(&v, 0, sizeof(v));
+    v.format = aux_conv_to_format(kw.format);
+    v.concat = RB_UNDEF_P(kw.concat) || RTEST(kw.concat);
+    v.nthreads = aux_conv_to_threads(kw.threads);
+    v.maxblocksize = aux_conv_to_blocksize(kw.blocksize);
+    v.in.readbuf = Qnil;
+    v.in.tmpbuf = Qnil;
+
+#ifdef EXTBZIP3_POOL_SUPPORT
+    v.inflight_capa = (size_t)v.nthreads * 3 + 1;
+    v.inflight = ZALLOC_N(struct extbzip3_job *, v.inflight_capa);
+    v.inflight_offset = ZALLOC_N(uint64_t, v.inflight_capa);
+#endif
+
+    if (rb_type_p(src, RUBY_T_STRING)) {
+        v.in.src = aux_str_pin(src);
+        v.in.ptr = RSTRING_PTR(v.in.src);
+        v.in.len = RSTRING_LEN(v.in.src);
+        verify_run((VALUE)&v);
+    } else if (aux_io_buffer_p(src)) {
+        v.in.src = src;
+        aux_io_buffer_locked_call(src, Qnil, verify_run, (VALUE)&v);
+    } else {
+        v.in.src = src;
+        v.in.readbuf = rb_str_buf_new(0);
+        v.in.tmpbuf = rb_str_buf_new(0);
+        verify_run((VALUE)&v);
+    }
+
+    RB_GC_GUARD(v.in.src);
+    RB_GC_GUARD(v.in.readbuf);
+    RB_GC_GUARD(v.in.tmpbuf);
+
+    const char *name = aux_bz3_error_name(v.error);
+    VALUE error = (v.error ? (name ? rb_str_new_cstr(name) : rb_sprintf("unknown error (code: %d)", v.error)) : Qnil);
+
+    return rb_struct_new(verify_report_class,
+                         ULL2NUM(v.blocks),
+                         ULL2NUM(v.packedsize),
+                         ULL2NUM(v.originalsize),
+                         error,
+                         (v.error ? ULL2NUM(v.error_offset) : Qnil));
+}
+
+void
+extbzip3_init_verify(VALUE bzip3_module)
+{
+    RDOCFAKE(VALUE bzip3_module = rb_define_module("Bzip3"))
+
+    verify_report_class = rb_struct_define_under(bzip3_module, "VerifyReport",
+                                                 "blocks", "packed_size", "original_size",
+                                                 "error", "error_offset", NULL);
+    rb_define_singleton_method(bzip3_module, "verify", verify_s_verify, -1);
+}
@@ -17,8 +17,78 @@ using Module.new {
 
 MakeMakefile::CONFIG["optflags"] = "-O0 -g3" if ENV["RUBY_EXTBZIP3_DEBUG"].to_i > 0
 
-have_header("libbz3.h") or abort "need libbz3.h header file"
-have_library("bzip3") or abort "need libbzip3 library"
+# --with-bundled-bzip3[=DIR]
+#   DIR (既定値は ext/externals/bzip3) にある bzip3 のソースツリーから libbzip3 を拡張ライブラリと一緒にコンパイルします。
+#   --disable-lto                   リンク時最適化を行いません
+#   --with-bzip3-pgo=generate|use   プロファイルに基づく最適化 (helper/pgo-train.rb を参照)
+#   --with-bzip3-pgo-dir=DIR        プロファイルの置き場所 (既定値は ext/externals/pgo)
+#   --disable-avx2                  AVX2 向けのビルドを作りません
+bundled_bzip3 = with_config("bundled-bzip3")
+bundled_avx2 = false
+
+if bundled_bzip3
+  bzip3dir = File.expand_path(bundled_bzip3 == true ? File.join(__dir__, "externals/bzip3") : bundled_bzip3)
+  File.file?(File.join(bzip3dir, "src/libbz3.c")) or
+    abort "need bzip3 source tree for --with-bundled-bzip3 (#{File.join(bzip3dir, "src/libbz3.c")} is not found)"
+
+  $INCFLAGS << " -I#{File.join(bzip3dir, "include")} -I#{File.join(bzip3dir, "src")}"
+  have_header("libbz3.h") or abort "need libbz3.h header file"
+
+  version = [".tarball-version", ".version"].map { |n| File.join(bzip3dir, n) }.find { |n| File.file?(n) }
+  version = (version ? File.read(version).strip : "bundled")
+  $defs << "-DEXTBZIP3_BUNDLED_BZIP3"
+  $defs << %(-DEXTBZIP3_BUNDLED_BZIP3_VERSION='"#{version}"')
+
+  if enable_config("lto", true) && try_cflags("-flto") && try_ldflags("-flto")
+    $CFLAGS << " -flto"
+    $LDFLAGS << " -flto"
+  end
+
+  case pgo = with_config("bzip3-pgo")
+  when nil, false
+  when "generate", "use"
+    pgodir = File.expand_path(with_config("bzip3-pgo-dir", File.join(__dir__, "externals/pgo")))
+    if pgo == "generate"
+      $CFLAGS << " -fprofile-generate=#{pgodir}"
+      $LDFLAGS << " -fprofile-generate=#{pgodir}"
+    else
+      $CFLAGS << " -fprofile-use=#{pgodir} -fprofile-correction"
+      $CFLAGS << " -Wno-missing-profile" if try_cflags("-Wno-missing-profile")
+    end
+  else
+    abort "unknown value for --with-bzip3-pgo (expect generate or use, but given #{pgo})"
+  end
+
+  if enable_config("avx2", true) &&
+     RbConfig::CONFIG["target_cpu"] =~ /\A(?:x86_64|amd64|x64|i[3-6]86)\z/i &&
+     try_cflags("-mavx2 -mbmi2") &&
+     try_compile(<<~CODE)
+       int
+       main(void)
+       {
+           __builtin_cpu_init();
+           return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+       }
+     CODE
+    $defs << "-DEXTBZIP3_BZ3_DISPATCH"
+    bundled_avx2 = true
+  end
+else
+  have_header("libbz3.h") or abort "need libbz3.h header file"
+  have_library("bzip3") or abort "need libbzip3 library"
+end
+
+have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
+have_header("pthread.h")
+have_func("rb_io_descriptor", "ruby/io.h")
+have_header("poll.h")
+have_func("pread", "unistd.h")
+have_func("pwrite", "unistd.h")
+have_func("memmem", "string.h")
+
+if enable_config("liburing", true) && have_header("liburing.h") && have_library("uring")
+  have_func("io_uring_queue_init", "liburing.h")
+end
 
 if RbConfig::CONFIG["arch"] =~ /mingw/i
   #$LDFLAGS << " -static-libgcc" if try_ldflags("-static-libgcc")
@@ -41,3 +111,10 @@ $defs << %(-DRBEXT_NORETURN='#{mod}')
 
 create_header
 create_makefile File.join(RUBY_VERSION.slice(/\d+\.\d+/), "extbzip3")
+
+if bundled_avx2
+  File.open("Makefile", "ab") do |mk|
+    mk.puts
+    mk.puts "extbzip3_bundled_avx2.#{$OBJEXT}: CFLAGS += -mavx2 -mbmi2"
+  end
+end
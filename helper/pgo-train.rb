@@ -0,0 +1,50 @@
+#!ruby
+#
+# --with-bzip3-pgo=generate でビルドした拡張ライブラリに典型的な圧縮・伸長を行わせ、プロファイルを集めます。
+#
+#   % ruby -I<拡張ライブラリのビルドディレクトリ> -Ilib helper/pgo-train.rb
+#
+# 通常は `rake pgo` から呼ばれます。
+# 入力には sampledata/ の各ファイルの中身と、このソースツリーにあるテキスト、乱数から作ったデータを使います。
+#
+
+require "extbzip3"
+require "stringio"
+
+topdir = File.join(__dir__, "..")
+
+corpus = []
+Dir.glob(File.join(topdir, "sampledata/*")).sort.each do |path|
+  bin = File.binread(path)
+  format = (path.end_with?("-frame") ? Bzip3::V1_FRAME_FORMAT : Bzip3::V1_FILE_FORMAT)
+  Bzip3.verify(bin, format: format)
+  Bzip3.stat(bin, format: format) rescue nil
+  corpus << (Bzip3.decode(bin, format: format, concat: false) rescue bin)
+end
+
+corpus << Dir.glob(File.join(topdir, "{README.md,ext/*.[ch],lib/**/*.rb,test/*.rb}")).sort.map { |path| File.binread(path) }.join
+r = Random.new(40)
+corpus << 40000.times.map { |i| "#{i}: #{r.rand(1 << 30).to_s(36)} " + "." * r.rand(0..60) + "\n" }.join
+corpus << r.bytes(1 << 20)
+corpus << "z" * (2 << 20)
+
+start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+corpus.each do |src|
+  [65 << 10, 1 << 20, 16 << 20].each do |blocksize|
+    bin = Bzip3.encode(src, blocksize: blocksize)
+    Bzip3.decode(bin) == src or abort "round trip failed (blocksize: #{blocksize})"
+
+    io = StringIO.new("".b)
+    Bzip3::Encoder.new(io, blocksize: blocksize, concurrent: 2).tap { |e|
+      0.step(src.bytesize - 1, 100000) { |off| e.write(src.byteslice(off, 100000)) }
+      e.close
+    }
+    Bzip3::Decoder.new(StringIO.new(io.string)).read == src or abort "stream round trip failed (blocksize: #{blocksize})"
+
+    Bzip3.verify(io.string, threads: 2)
+    Bzip3.scan(io.string, "needle").to_a
+  end
+end
+
+$stderr.puts "trained in %.2f seconds" % (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start)
@@ -33,6 +33,36 @@ module Bzip3
     def decode(src, *args, **opts, &block)
       src.bunzip3(*args, **opts, &block)
     end
+
+    unless method_defined?(:encode_file)
+      def encode_file(src, dest, engine: nil, **opts)
+        File.open(src, "rb") { |i| File.open(dest, "wb") { |o| copy_stream(i, o, mode: :encode, **opts) } }
+      end
+    end
+
+    unless method_defined?(:decode_file)
+      def decode_file(src, dest, engine: nil, **opts)
+        File.open(src, "rb") { |i| File.open(dest, "wb") { |o| copy_stream(i, o, mode: :decode, **opts) } }
+      end
+    end
+  end
+
+  class VerifyReport
+    def ok?
+      error.nil?
+    end
+  end
+
+  class Stat
+    def ratio
+      original_size == 0 ? nil : packed_size.fdiv(original_size)
+    end
+
+    class Block
+      def ratio
+        original_size == 0 ? nil : packed_size.fdiv(original_size)
+      end
+    end
   end
 
   class << Decoder
@@ -2,6 +2,12 @@
 
 require "test-unit"
 require "extbzip3"
+require "stringio"
+require "tempfile"
+require "tmpdir"
+require "pathname"
+require "objspace"
+require "io/nonblock"
 
 SAMPLES = File.join(__dir__, "../sampledata")
 
@@ -74,4 +80,841 @@ class TestBzip3 < Test::Unit::TestCase
       }.take
     end
   end
+
+  def test_decoder_lazy_state
+    small = Bzip3.encode("abc" * 1000, blocksize: 1 << 20)
+    large = Bzip3.encode("xyz" * 1000, blocksize: 4 << 20)
+
+    base = Bzip3.memory_usage
+    bz3 = Bzip3::Decoder.new(StringIO.new(small))
+    assert_equal base, Bzip3.memory_usage
+    assert_equal "abc", bz3.read(3)
+    used = Bzip3.memory_usage - base
+    assert_operator used, :>, 1 << 20
+    assert_operator used, :<, 16 << 20
+    bz3.close
+
+    bz3 = Bzip3::Decoder.new(StringIO.new(small + large))
+    assert_equal "abc" * 1000 + "xyz" * 1000, bz3.read
+    bz3.close
+
+    bz3 = Bzip3::Decoder.new(StringIO.new(small + large), blocksize: 2 << 20)
+    assert_raise(RuntimeError) { bz3.read }
+  end
+
+  def test_release_and_trim
+    GC.start
+    base = Bzip3.memory_usage
+    out = "".b
+    enc = Bzip3::Encoder.new(out, blocksize: 1 << 20, idle_trim: 0)
+    assert_operator Bzip3.memory_usage, :>, base
+    enc.write "abc" * 1000
+    enc.flush
+    assert_operator Bzip3.trim_idle, :>=, 1
+    assert_equal base, Bzip3.memory_usage
+    enc.write "def"
+    assert_equal base, Bzip3.memory_usage
+    enc.close
+    assert_equal base, Bzip3.memory_usage
+    assert_raise(RuntimeError) { enc.write "x" }
+    assert_equal "abc" * 1000 + "def", Bzip3.decode(out)
+
+    dec = Bzip3::Decoder.new(StringIO.new(out * 2))
+    assert_equal "abc", dec.read(3)
+    assert_operator Bzip3.memory_usage, :>, base
+    dec.trim
+    assert_equal base, Bzip3.memory_usage
+    assert_equal "abc" * 999 + "def" + "abc" * 1000 + "def", dec.read
+    assert_operator Bzip3.memory_usage, :>, base
+    dec.close
+    assert_equal base, Bzip3.memory_usage
+  end
+
+  # 暖機した後の Encoder#write と Decoder#read(size, buf) が、呼び出しごとにオブジェクトを作らず、
+  # 作業用の文字列を伸ばし続けないことを確かめる
+  def test_steady_state_allocations
+    sink = Object.new
+    def sink.<<(s)
+      self
+    end
+    chunk = ("0123456789abcdef" * 256).b
+    mib = 8
+    count = mib * 256
+
+    measure = ->(&work) do
+      GC.start
+      GC.disable
+      objs = GC.stat(:total_allocated_objects)
+      malloc = GC.stat(:malloc_increase_bytes)
+      work.()
+      [(GC.stat(:total_allocated_objects) - objs).fdiv(mib), (GC.stat(:malloc_increase_bytes) - malloc).fdiv(mib)]
+    ensure
+      GC.enable
+    end
+
+    enc = Bzip3::Encoder.new(sink, blocksize: 256 << 10)
+    256.times { enc.write chunk }
+    objs, malloc = measure.() { count.times { enc.write chunk } }
+    assert_operator objs, :<, 2, "Encoder#write allocated objects per MiB"
+    assert_operator malloc, :<, 16 << 10, "Encoder#write malloc growth per MiB"
+    enc.close
+
+    dec = Bzip3::Decoder.new(StringIO.new(Bzip3.encode(chunk * (count + 256), blocksize: 256 << 10)))
+    buf = "".b
+    256.times { dec.read(chunk.bytesize, buf) }
+    objs, malloc = measure.() { count.times { dec.read(chunk.bytesize, buf) } }
+    assert_operator objs, :<, 2, "Decoder#read allocated objects per MiB"
+    assert_operator malloc, :<, 16 << 10, "Decoder#read malloc growth per MiB"
+    assert_equal chunk, buf
+    dec.close
+  end
+
+  def test_encoder_concurrent
+    out = "".b
+    enc = Bzip3::Encoder.new(out, blocksize: 65 << 10, concurrent: true)
+    records = 8.times.map { |t| 300.times.map { |i| "#{t}:#{i}:#{"x" * (i * 7 % 500)}\n" } }
+    records.map { |recs| Thread.new { recs.each { |r| enc.write r } } }.each(&:join)
+    enc.close
+    assert_raise(RuntimeError) { enc.write "x" }
+
+    lines = Bzip3.decode(out).lines
+    assert_equal records.flatten.sort, lines.sort
+    8.times do |t|
+      assert_equal records[t], lines.select { |l| l.start_with?("#{t}:") }
+    end
+
+    assert_raise(ArgumentError) { Bzip3::Encoder.new("".b, concurrent: true, align: "\n") }
+
+    # outport が書き出しの途中で例外を発生させても、書き出せなかったブロックは失われない
+    out = "".b
+    writes = 0
+    port = Object.new
+    port.define_singleton_method(:<<) do |s|
+      raise IOError, "disk full" if (writes += 1) == 2
+      out << s
+    end
+    src = 4.times.map { |i| "#{i}" * (65 << 10) }.join
+    enc = Bzip3::Encoder.new(port, blocksize: 65 << 10, concurrent: true)
+    assert_raise(IOError) { enc.write src }
+    enc.close
+    assert_equal src, Bzip3.decode(out)
+  end
+
+  def test_encoder_max_latency
+    clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+    wait_until = ->(limit = 10, &cond) {
+      deadline = clock.() + limit
+      sleep 0.01 until cond.() || clock.() > deadline
+      cond.()
+    }
+
+    out = "".b
+    enc = Bzip3::Encoder.new(out, blocksize: 1 << 20, max_latency: 0.1)
+    t = clock.()
+    enc.write "hello\n"
+    assert wait_until.() { !out.empty? }
+    assert_operator clock.() - t, :>=, 0.1
+    assert_equal "hello\n", Bzip3.decode(out)
+    enc.write "world\n"
+    enc.close
+    assert_equal "hello\nworld\n", Bzip3.decode(out)
+
+    # min_block に満たなくても、max_latency で書き出す
+    out = "".b
+    enc = Bzip3::Encoder.new(out, blocksize: 1 << 20, max_latency: 1.0, min_block: 1 << 10)
+    t = clock.()
+    enc.write "small"
+    assert wait_until.() { !out.empty? }
+    assert_operator clock.() - t, :>=, 1.0
+    assert_operator clock.() - t, :<, 2.0
+    assert_equal "small", Bzip3.decode(out)
+
+    # ブロックを書き出した後に残った端数は、それを受け付けた時刻から数える
+    size = out.bytesize
+    t = clock.()
+    enc.write "x" * ((1 << 20) + 100)
+    assert_operator out.bytesize, :>, size
+    size = out.bytesize
+    sleep 0.5
+    assert_equal size, out.bytesize
+    assert wait_until.() { out.bytesize > size }
+    assert_operator clock.() - t, :>=, 1.0
+    assert_operator clock.() - t, :<, 2.0
+    enc.close
+    assert_equal "small" + "x" * ((1 << 20) + 100), Bzip3.decode(out)
+
+    # close されずに回収された Encoder の内部スレッドは終了する
+    nthreads = Thread.list.size
+    Thread.new { Bzip3::Encoder.new("".b, max_latency: 0.1); nil }.join
+    assert wait_until.() { GC.start; Thread.list.size <= nthreads }
+
+    assert_raise(ArgumentError) { Bzip3::Encoder.new("".b, max_latency: 0) }
+  end
+
+  def test_oneshot_single_release
+    src = Random.new(7).bytes(64 << 10) * 40
+    bz3 = Bzip3.encode(src, blocksize: 65 << 10)
+    assert_equal src, Bzip3.decode(bz3)
+
+    # 後ろのストリームの方がブロックサイズが大きいため、途中で作業領域を確保し直す
+    small = Bzip3.encode("a" * 100, blocksize: 65 << 10)
+    large = Bzip3.encode("b" * (2 << 20), blocksize: 4 << 20)
+    assert_equal "a" * 100 + "b" * (2 << 20) + "a" * 100, Bzip3.decode(small + large + small)
+
+    # 書き込み先は処理中だけロックされ、処理後は元に戻る
+    dest = "".b
+    Bzip3.decode(bz3, dest)
+    dest << "x"
+    assert_equal src + "x", dest
+
+    # 割り込みはブロックの間で受け付け、例外にならなければ続きから再開する
+    clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC) }
+    big = Random.new(8).bytes(1 << 20) * 48
+    t = clock.()
+    th = Thread.new { Bzip3.encode(big, blocksize: 65 << 10) }
+    10.times { sleep 0.01; th.wakeup rescue nil }
+    packed = th.value
+    full = clock.() - t
+    th = Thread.new { Bzip3.decode(packed) }
+    10.times { sleep 0.01; th.wakeup rescue nil }
+    assert_equal big, th.value
+
+    [-> { Bzip3.encode(big, blocksize: 65 << 10) }, -> { Bzip3.decode(packed) }].each do |oneshot|
+      th = Thread.new(&oneshot)
+      sleep 0.05
+      t = clock.()
+      th.kill
+      assert_not_nil th.join(10)
+      assert_operator clock.() - t, :<, full / 2
+    end
+  end
+
+  def test_oneshot_output_sizing
+    src = 20.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+    bin = Bzip3.encode(src, blocksize: 65 << 10)
+    assert_equal src, Bzip3.decode(bin)
+    assert_operator ObjectSpace.memsize_of(bin), :<, bin.bytesize + 4096
+
+    # 書き込み先の残りが bz3_bound に満たなくても、収まるなら圧縮できる
+    assert_equal bin, Bzip3.encode(src, bin.bytesize, blocksize: 65 << 10)
+    assert_raise(RuntimeError) { Bzip3.encode(src, bin.bytesize - 1, blocksize: 65 << 10) }
+
+    dest = "".b
+    assert_same dest, Bzip3.encode(src, dest, blocksize: 65 << 10)
+    assert_equal bin, dest
+
+    frame = Bzip3.encode(src, blocksize: 65 << 10, format: Bzip3::V1_FRAME_FORMAT)
+    assert_equal src, Bzip3.decode(frame, format: Bzip3::V1_FRAME_FORMAT)
+    assert_equal 9, Bzip3.encode("").bytesize
+  end
+
+  def test_encoder_align
+    r = Random.new(36)
+    src = 20000.times.map { |i| "#{i}:" + "x" * r.rand(0..40) + "\n" }.join
+    out = "".b
+    Bzip3::Encoder.new(out, blocksize: 65 << 10, align: "\n").tap { |e|
+      src.each_char.each_slice(7777) { |s| e.write(s.join) }
+      e.close
+    }
+    assert_equal src, Bzip3.decode(out)
+
+    pos = 0
+    sizes = block_sizes(out)
+    assert_operator sizes.size, :>, 1
+    sizes.each do |orig|
+      assert_operator orig, :<=, 65 << 10
+      assert_equal "\n", src.byteslice(pos + orig - 1, 1)
+      pos += orig
+    end
+
+    out = "".b
+    Bzip3::Encoder.new(out, blocksize: 65 << 10, align: "\r\n").tap { |e| e << ("z" * 200000); e.close }
+    assert_equal "z" * 200000, Bzip3.decode(out)
+    assert_raise(ArgumentError) { Bzip3::Encoder.new("".b, align: "") }
+  end
+
+  def test_encoder_append
+    a = "first part\n" * 10000
+    b = "second part\n" * 10000
+    io = StringIO.new("".b)
+    Bzip3::Encoder.new(io, blocksize: 65 << 10).tap { |e| e << a; e.close }
+    base = io.string.dup
+
+    io = StringIO.new(base.dup)
+    Bzip3::Encoder.new(io, append: true).tap { |e| e << b; e.close }
+    assert_equal a + b, Bzip3.decode(io.string, concat: false)
+    assert_equal base, io.string.byteslice(0, base.bytesize)
+    assert_equal 1, io.string.scan("BZ3v1").size
+
+    io = StringIO.new(base.dup)
+    Bzip3::Encoder.new(io, append: :reblock).tap { |e| e << b; e.close }
+    assert_equal a + b, Bzip3.decode(io.string, concat: false)
+    sizes = block_sizes(io.string)
+    assert_equal [65 << 10] * ((a + b).bytesize / (65 << 10)) + [(a + b).bytesize % (65 << 10)], sizes
+
+    io = StringIO.new(base.dup)
+    e = Bzip3::Encoder.new(io, append: :reblock)
+    e << "third part\n"
+    assert_equal base, io.string
+    e.close
+    assert_equal a + "third part\n", Bzip3.decode(io.string)
+
+    io = StringIO.new("".b)
+    Bzip3::Encoder.new(io, append: true).tap { |e| e << b; e.close }
+    assert_equal b, Bzip3.decode(io.string)
+
+    assert_raise(ArgumentError) { Bzip3::Encoder.new(StringIO.new(base.dup), append: true, blocksize: 1 << 20) }
+    assert_raise(RuntimeError) { Bzip3::Encoder.new(StringIO.new("garbage!!"), append: true) }
+  end
+
+  def test_io_buffer
+    omit "IO::Buffer is not available" unless defined?(IO::Buffer)
+
+    src = "123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 5
+    bin = Bzip3.encode(src)
+
+    srcbuf = IO::Buffer.for(src)
+    assert_equal bin, Bzip3::Encoder.encode(srcbuf)
+    assert_equal src, Bzip3::Decoder.decode(IO::Buffer.for(bin))
+
+    destbuf = IO::Buffer.new(1000)
+    ret = Bzip3::Encoder.encode(srcbuf, destbuf)
+    assert_kind_of IO::Buffer, ret
+    assert_equal bin, ret.get_string
+    assert_equal src, Bzip3::Decoder.decode(ret, IO::Buffer.new(1000)).get_string
+
+    bp = Bzip3::BlockProcessor.new(1 << 20)
+    packed = bp.encode(srcbuf, IO::Buffer.new(1000))
+    assert_equal src, bp.decode(packed, IO::Buffer.new(1000), src.bytesize).get_string
+    assert_equal src, bp.decode(packed.get_string, "", src.bytesize)
+    assert_raise(RuntimeError) { bp.encode(srcbuf, IO::Buffer.new(10)) }
+
+    dest = "".b
+    Bzip3::Encoder.open(dest) { |bz3| bz3.write srcbuf }
+    assert_equal bin, dest
+
+    srcbuf.locked { assert_raise(IO::Buffer::LockedError) { Bzip3::Encoder.encode(srcbuf) } }
+    assert_raise(TypeError) { Bzip3::Encoder.encode(1234) }
+  end
+
+  def test_block_processor
+    bp = Bzip3::BlockProcessor.new(1 << 20)
+    src = "123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 5
+    packed = bp.encode(src, "")
+    assert_equal src, bp.decode(packed, "", src.bytesize)
+
+    buf = src.dup
+    assert_same buf, bp.encode!(buf)
+    assert_equal packed, buf
+    assert_same buf, bp.decode!(buf, src.bytesize)
+    assert_equal src, buf
+
+    buf = src.dup
+    assert_same buf, bp.encode(buf, buf)
+    assert_equal packed, buf
+    assert_same buf, bp.decode(buf, buf, src.bytesize)
+    assert_equal src, buf
+
+    srcs = [src, "", "abc", src * 3]
+    blocks = bp.encode_blocks(srcs)
+    assert_equal srcs.size, blocks.size
+    assert_equal srcs, blocks.zip(srcs).map { |b, s| bp.decode(b, "", s.bytesize) }
+    assert_raise(TypeError) { bp.encode_blocks([src, 1]) }
+    assert_raise(TypeError) { bp.encode_blocks("x") }
+    assert_raise(TypeError) { bp.encode_blocks(nil) }
+  end
+
+  def test_block_pool
+    omit "Bzip3::BlockPool is not available" unless defined?(Bzip3::BlockPool)
+
+    pool = Bzip3::BlockPool.new(blocksize: 1 << 20, threads: 3, queue: 2)
+    assert_equal 3, pool.threads
+    srcs = 20.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * (i + 1) }
+    futures = srcs.map { |s| pool.submit_encode(s) }
+    blocks = futures.map(&:value)
+    assert futures.all?(&:done?)
+    assert_equal Bzip3::BlockProcessor.new(1 << 20).encode_blocks(srcs), blocks
+    assert_equal srcs, blocks.zip(srcs).map { |b, s| pool.submit_decode(b, s.bytesize) }.map(&:value)
+
+    broken = blocks[0].dup
+    broken[-1] = (broken[-1].ord ^ 1).chr
+    assert_raise(RuntimeError) { pool.submit_decode(broken, srcs[0].bytesize).value }
+
+    assert_operator ObjectSpace.memsize_of(pool), :>, 3 << 20
+
+    pool.close
+    assert pool.closed?
+    assert_raise(RuntimeError) { pool.submit_encode("abc") }
+
+    # close しないまま回収された BlockPool の仕事は、処理されるか取り消される
+    futures = 5.times.map { Bzip3::BlockPool.new(blocksize: 1 << 20, threads: 1, queue: 4).submit_encode(srcs[-1]) }
+    GC.start
+    futures.each do |f|
+      assert_equal blocks[-1], f.value
+    rescue RuntimeError => e
+      assert_match(/CANCELED/, e.message)
+    end
+  end
+
+  def test_block_cache
+    omit "Bzip3::BlockCache is not available" unless defined?(Bzip3::BlockCache)
+
+    cache = Bzip3::BlockCache.new
+    doc = 8.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+    expect = Bzip3.encode(doc, blocksize: 65 << 10)
+    assert_equal expect, Bzip3.encode(doc, blocksize: 65 << 10, cache: cache)
+    assert_equal [0, 10, 10], [cache.hits, cache.misses, cache.size]
+    assert_equal expect, Bzip3.encode(doc, blocksize: 65 << 10, cache: cache)
+    assert_equal 10, cache.hits
+
+    changed = doc.dup
+    changed[100000] = "!"
+    Bzip3.encode(changed, blocksize: 65 << 10, cache: cache)
+    assert_equal [19, 11], [cache.hits, cache.misses]
+
+    out = StringIO.new("".b)
+    Bzip3::Encoder.open(out, blocksize: 65 << 10, cache: cache) { |e| e << doc }
+    assert_equal expect, out.string
+    assert_equal 29, cache.hits
+
+    assert_equal doc, Bzip3.decode(expect, cache: cache)
+    assert_equal doc, Bzip3.decode(expect, cache: cache)
+    assert_equal doc, Bzip3::Decoder.open(StringIO.new(expect), cache: cache) { |d| d.read }
+    assert_equal 29 + 10 * 2, cache.hits
+
+    bp = Bzip3::BlockProcessor.new(65 << 10, cache: cache)
+    block = doc.byteslice(0, 65 << 10).b
+    packed = bp.encode(block, "".b)
+    assert_equal packed, bp.encode!(block.dup)
+    assert_equal [packed], bp.encode_blocks([block])
+    assert_equal block, bp.decode(packed, "", block.bytesize)
+    assert_equal block, bp.decode!(packed.dup, block.bytesize)
+
+    small = Bzip3::BlockCache.new(expect.bytesize / 3)
+    Bzip3.encode(doc, blocksize: 65 << 10, cache: small)
+    assert_operator small.bytesize, :<=, expect.bytesize / 3
+    assert_operator small.size, :<, 10
+    Bzip3.encode(doc, blocksize: 65 << 10, cache: small)
+    assert_equal 0, small.hits # 先頭から順に使うため、LRU では常に追い出された後になる
+    assert_same small, small.clear
+    assert_equal [0, 0], [small.size, small.bytesize]
+
+    assert_raise(TypeError) { Bzip3.encode(doc, cache: "cache") }
+    assert_raise(TypeError) { Bzip3::Decoder.new(StringIO.new(expect), cache: 1) }
+  end
+
+  def test_verify
+    report = Bzip3.verify(SAMPLES.load_file("double.bz3"))
+    assert_kind_of Bzip3::VerifyReport, report
+    assert report.ok?
+    assert_equal 2, report.blocks
+    assert_equal 72, report.original_size
+    assert_equal SAMPLES.load_file("double.bz3").bytesize, report.packed_size
+
+    assert_equal 1, Bzip3.verify(SAMPLES.load_file("double.bz3"), concat: false).blocks
+    assert_equal 1, Bzip3.verify(SAMPLES.load_file("single.bz3-frame"), format: Bzip3::V1_FRAME_FORMAT).blocks
+    SAMPLES.open_file("single.bz3") { |f| assert Bzip3.verify(f, threads: 1).ok? }
+
+    report = Bzip3.verify(SAMPLES.load_file("single+junks.bz3"))
+    assert_equal "BZ3_ERR_MALFORMED_HEADER", report.error
+    assert_equal 1, report.blocks
+
+    src = 10.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+    bin = Bzip3.encode(src, blocksize: 65 << 10)
+    assert_equal [1, src.bytesize], Bzip3.verify(bin, threads: 3).then { |r| [r.ok? ? 1 : 0, r.original_size] }
+    broken = bin.dup
+    broken.setbyte(100000, broken.getbyte(100000) ^ 1)
+    report = Bzip3.verify(broken, threads: 3)
+    assert_equal "BZ3_ERR_CRC", report.error
+    assert_operator report.error_offset, :<=, 100000
+    assert_equal report.blocks * (65 << 10), report.original_size
+  end
+
+  def test_stat
+    bin = SAMPLES.load_file("double.bz3")
+    st = Bzip3.stat(bin)
+    assert_kind_of Bzip3::Stat, st
+    assert_equal [2, 2, 72, bin.bytesize], [st.members, st.block_count, st.original_size, st.packed_size]
+    assert_equal 72, st.blocks.sum(&:original_size)
+    assert_equal 9, st.blocks[0].offset
+    assert_equal st.blocks[0].packed_size + 9, st.blocks[1].offset - 9
+    assert_equal 1, Bzip3.stat(bin, concat: false).block_count
+    assert_nil Bzip3.stat(bin, blocks: false).blocks
+
+    frame = Bzip3.stat(SAMPLES.load_file("single.bz3-frame"), format: Bzip3::V1_FRAME_FORMAT)
+    assert_equal [Bzip3::V1_FRAME_FORMAT, 1], [frame.format, frame.block_count]
+
+    src = 10.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+    bin = Bzip3.encode(src, blocksize: 65 << 10)
+    expect = Bzip3.stat(bin)
+    assert_equal [65 << 10, src.bytesize, bin.bytesize], [expect.block_size, expect.original_size, expect.packed_size]
+    assert_in_delta bin.bytesize.fdiv(src.bytesize), expect.ratio, 0.0001
+    assert_equal expect, Bzip3.stat(StringIO.new(bin))
+    r, w = IO.pipe
+    Thread.new { w << bin; w.close }
+    assert_equal expect, Bzip3.stat(r)
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.bz3")
+      File.binwrite(path, bin)
+      assert_equal expect, Bzip3.stat(Pathname(path))
+      File.open(path, "rb") { |f| assert_equal expect, Bzip3.stat(f) }
+      File.binwrite(path, bin.byteslice(0, bin.bytesize - 1))
+      assert_raise(RuntimeError) { Bzip3.stat(Pathname(path)) }
+    end
+
+    assert_raise(RuntimeError) { Bzip3.stat(bin.byteslice(0, bin.bytesize - 1)) }
+    assert_raise(RuntimeError) { Bzip3.stat(SAMPLES.load_file("single+junks.bz3")) }
+    assert_raise(RuntimeError) { Bzip3.stat("") }
+
+    # 求めた大きさより多く返す `read` は、ヘッダを読む段階で拒否する
+    greedy = Object.new
+    def greedy.read(size, buf = nil)
+      "BZ3v1".b + "\0".b * 195
+    end
+    assert_raise(RuntimeError) { Bzip3.stat(greedy) }
+    assert_raise(RuntimeError) { Bzip3.verify(greedy) }
+    assert_raise(RuntimeError) { Bzip3.scan(greedy, "x") }
+  end
+
+  def test_estimate
+    est = Bzip3.estimate("ABCD" * 100000)
+    assert_kind_of Bzip3::Estimate, est
+    assert_equal 400000, est.size
+    assert_operator est.order0, :<=, 2.01
+    assert_operator est.order1, :<, 0.01
+    assert_operator est.repeats, :>, 0.9
+    assert_operator est.encode_us, :>, 0
+    assert_equal 400000, est.blocksize
+    assert_equal 4 * 16384, est.sampled
+
+    rand = Random.new(1).bytes(100000)
+    est = Bzip3.estimate(IO::Buffer.for(rand), trial: false, samples: 2, sample: 4096)
+    assert_equal 8192, est.sampled
+    assert_operator est.order0, :>, 7.0
+    assert_operator est.ratio, :>, 0.8
+    assert_equal Bzip3::BLOCKSIZE_MIN, Bzip3.estimate("abc").blocksize
+    assert_equal 3, Bzip3.estimate("abc").sampled
+    assert_equal 0, Bzip3.estimate("").sampled
+    assert_raise(ArgumentError) { Bzip3.estimate("abc", samples: 0) }
+  end
+
+  def test_scan
+    r = Random.new(37)
+    lines = 30000.times.map { |i| "req-#{r.rand(1 << 30).to_s(36)} #{i} " + "." * r.rand(0..60) + "\n" }
+    lines[12345] = "req-needle 12345 found\n"
+    lines[29999] = "tail needle"
+    src = lines.join
+    bz3 = "".b
+    Bzip3::Encoder.new(bz3, blocksize: 65 << 10).tap { |e| e << src; e.close }
+
+    expect = []
+    src.scan("needle") { expect << [$~.begin(0), "needle"] }
+    [1, 3].each do |threads|
+      assert_equal expect, Bzip3.scan(bz3, "needle", threads: threads).map(&:to_a)
+    end
+
+    pos = src.index("needle 12345")
+    line = src.rindex("\n", pos) + 1
+    assert_equal [[line, lines[12345]], [src.rindex("\n") + 1, "tail needle"]],
+                 Bzip3.grep(bz3, /needle/, threads: 2).map(&:to_a)
+    assert_equal src.scan(/\.{59}\n/).size, Bzip3.scan(StringIO.new(bz3), /\.{59}\n/).size
+
+    n = 0
+    assert_equal src.count("\n"), Bzip3.grep(bz3, "\n") { |m| n += 1 if src.byteslice(m.offset, m.string.bytesize) == m.string }
+    assert_equal src.count("\n"), n
+
+    assert_raise(ArgumentError) { Bzip3.scan(bz3, "") }
+
+    # ブロックの中で同じ Regexp を別の文字コードの文字列に使っても、検索は続けられる
+    re = /needle/
+    found = []
+    Bzip3.scan(bz3, re) { |m| found << m.string.encoding; "ａ".encode("EUC-JP") =~ re; "x".b =~ re }
+    assert_equal [Encoding::BINARY] * 2, found
+
+    utf8 = "café crème\n".encode("UTF-8") * 3
+    packed = Bzip3.encode(utf8)
+    assert_equal [[3, "é"], [8, "è"]], Bzip3.scan(packed, /[éè]/).first(2).map(&:to_a)
+    assert_equal Encoding::UTF_8, Bzip3.scan(packed, /\u00e9/).first.string.encoding
+    assert_equal 3, Bzip3.scan(packed, /\p{Alpha}+ /).size
+    assert_equal 3, Bzip3.scan(Bzip3.encode("\xff\xfe".b * 3), /\xff/n).size
+    assert_raise(Encoding::CompatibilityError) { Bzip3.scan(packed, Regexp.new("a".encode("UTF-16LE"))) }
+  end
+
+  def test_copy_stream
+    src = 10.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+
+    Tempfile.create("extbzip3") do |plain|
+      plain.binmode
+      plain.write src
+      plain.rewind
+      Tempfile.create("extbzip3") do |packed|
+        packed.binmode
+        count = Bzip3.copy_stream(plain, packed, blocksize: 65 << 10, threads: 3)
+        assert_equal [src.bytesize, packed.size], count
+        packed.rewind
+        assert_equal src, Bzip3.decode(packed.read)
+        packed.rewind
+        out = StringIO.new("".b)
+        assert_equal [packed.size, src.bytesize], Bzip3.copy_stream(packed, out, mode: :decode, threads: 2)
+        assert_equal src, out.string
+      end
+    end
+
+    out = StringIO.new("".b)
+    Bzip3.copy_stream(StringIO.new(SAMPLES.load_file("double.bz3")), out, mode: :decode)
+    assert_equal Bzip3.decode(SAMPLES.load_file("double.bz3")), out.string
+    out = StringIO.new("".b)
+    Bzip3.copy_stream(StringIO.new(SAMPLES.load_file("double.bz3")), out, mode: :decode, concat: false)
+    assert_equal Bzip3.decode(SAMPLES.load_file("double.bz3"), concat: false), out.string
+
+    IO.pipe do |r, w|
+      th = Thread.new { Bzip3.copy_stream(StringIO.new(src), w, threads: 2); w.close }
+      assert_equal src, Bzip3.decode(r.read)
+      th.join
+    end
+
+    # 読み手が止まったブロッキングのパイプへの書き込みでも中断できる
+    IO.pipe do |r, w|
+      w.nonblock = false
+      th = Thread.new { Bzip3.copy_stream(StringIO.new(Random.bytes(4 << 20)), w, blocksize: 1 << 20, threads: 2) }
+      r.wait_readable
+      sleep 0.3 # 書き込みスレッドが write(2) で止まるまで待つ (早すぎても検査が甘くなるだけ)
+      assert_false w.nonblock?
+      th.kill
+      assert_not_nil th.join(10)
+      assert_false w.nonblock?
+    end
+
+    out = StringIO.new("".b)
+    Bzip3.copy_stream(StringIO.new(""), out)
+    assert_equal "", Bzip3.decode(out.string)
+
+    broken = Bzip3.encode(src, blocksize: 65 << 10)
+    broken.setbyte(100000, broken.getbyte(100000) ^ 1)
+    assert_raise(RuntimeError) { Bzip3.copy_stream(StringIO.new(broken), StringIO.new, mode: :decode) }
+    assert_raise(RuntimeError) { Bzip3.copy_stream(StringIO.new("junk"), StringIO.new, mode: :decode) }
+    assert_raise(ArgumentError) { Bzip3.copy_stream(StringIO.new, StringIO.new, mode: :bogus) }
+  end
+
+  def test_file_engine
+    src = 10.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+
+    Dir.mktmpdir do |dir|
+      plain = File.join(dir, "plain")
+      packed = File.join(dir, "plain.bz3")
+      restored = File.join(dir, "restored")
+      File.binwrite plain, src
+
+      [:auto, :pread].each do |engine|
+        count = Bzip3.encode_file(plain, packed, blocksize: 65 << 10, threads: 3, engine: engine)
+        assert_equal [src.bytesize, File.size(packed)], count
+        assert_equal src, Bzip3.decode(File.binread(packed))
+        assert_equal [File.size(packed), src.bytesize], Bzip3.decode_file(packed, restored, threads: 2, engine: engine)
+        assert_equal src, File.binread(restored)
+      end
+
+      File.binwrite plain, ""
+      Bzip3.encode_file(plain, packed)
+      assert_equal "", Bzip3.decode(File.binread(packed))
+      assert_equal [9, 0], Bzip3.decode_file(packed, restored)
+
+      File.binwrite packed, SAMPLES.load_file("double.bz3")
+      Bzip3.decode_file(packed, restored)
+      assert_equal Bzip3.decode(SAMPLES.load_file("double.bz3")), File.binread(restored)
+      Bzip3.decode_file(packed, restored, concat: false)
+      assert_equal Bzip3.decode(SAMPLES.load_file("double.bz3"), concat: false), File.binread(restored)
+
+      broken = Bzip3.encode(src, blocksize: 65 << 10)
+      broken.setbyte(100000, broken.getbyte(100000) ^ 1)
+      File.binwrite packed, broken
+      assert_raise(RuntimeError) { Bzip3.decode_file(packed, restored) }
+      File.binwrite packed, broken.byteslice(0, 100000)
+      assert_raise(RuntimeError) { Bzip3.decode_file(packed, restored) }
+      assert_raise(Errno::ENOENT) { Bzip3.encode_file(File.join(dir, "missing"), restored) }
+      assert_raise(ArgumentError) { Bzip3.encode_file(plain, packed, engine: :bogus) }
+
+      File.binwrite plain, src
+      assert_raise(ArgumentError) { Bzip3.encode_file(plain, plain) }
+      assert_raise(ArgumentError) { Bzip3.decode_file(packed, Pathname(packed)) }
+      assert_equal src, File.binread(plain)
+      if File.respond_to?(:mkfifo)
+        fifo = File.join(dir, "fifo")
+        File.mkfifo(fifo)
+        assert_raise(ArgumentError) { Bzip3.encode_file(fifo, restored) }
+      end
+    end
+  end
+
+  def test_configure
+    config = Bzip3.configure(threads: 2, queue_depth: 3)
+    assert_equal({ threads: 2, queue_depth: 3 }, config)
+    assert_raise(ArgumentError) { Bzip3.configure(queue_depth: 0) }
+    assert_equal config, Bzip3.configure
+
+    src = (0...20).map { |i| ("%06d\n" % i) * 20000 }
+    out = src.map { |s| Thread.new { Bzip3.decode(Bzip3.encode(s, blocksize: 65 << 10)) } }.map(&:value)
+    assert_equal src, out
+
+    pool = Bzip3::BlockPool.new(blocksize: 65 << 10, threads: 4)
+    blocks = src.map { |s| s.byteslice(0, 65 << 10) }
+    futures = blocks.map { |s| pool.submit_encode(s) }
+    bp = Bzip3::BlockProcessor.new(65 << 10)
+    assert_equal blocks, futures.zip(blocks).map { |f, s| bp.decode(f.value, "", s.bytesize) }
+    pool.close
+
+    if Process.respond_to?(:fork)
+      r, w = IO.pipe
+      pid = fork {
+        r.close
+        w.write(Bzip3.decode(Bzip3.encode(src[0], blocksize: 65 << 10)) == src[0] ? "ok" : "ng")
+        w.close
+        exit!(0)
+      }
+      w.close
+      assert_equal "ok", r.read
+      Process.wait(pid)
+      r.close
+
+      # fork の前に積まれた仕事は、子プロセスでは取り消しとして完了する
+      Bzip3.configure(threads: 1, queue_depth: 16)
+      pool = Bzip3::BlockPool.new(blocksize: 1 << 20, threads: 1)
+      futures = 8.times.map { pool.submit_encode(Random.bytes(1 << 20)) }
+      r, w = IO.pipe
+      pid = fork {
+        r.close
+        results = futures.map { |f| f.value.bytesize rescue $!.message[/CANCELED/] }
+        # 親プロセスで実行中だった仕事の作業領域は、子プロセスで再び使える
+        reused = (pool.submit_encode("abc" * 1000).value rescue nil)
+        w.write(results.include?("CANCELED") && reused ? "ok" : "ng")
+        w.close
+        exit!(0)
+      }
+      w.close
+      assert r.wait_readable(30), "futures hung in the forked child"
+      assert_equal "ok", r.read
+      Process.wait(pid)
+      r.close
+      futures.each(&:value)
+      pool.close
+    end
+  ensure
+    Bzip3.configure(threads: nil, queue_depth: nil)
+  end
+
+  def test_memory_limit
+    GC.start
+    base = Bzip3.memory_usage
+    assert_nil Bzip3.memory_limit
+    enc = Bzip3::Encoder.new("".b, blocksize: 1 << 20)
+    assert_operator Bzip3.memory_usage, :>, base + (1 << 20)
+    per = Bzip3.memory_usage - base
+
+    archive = Bzip3.encode("abc", blocksize: 1 << 20)
+
+    Bzip3.memory_limit = Bzip3.memory_usage + per / 2
+    dec = Bzip3::Decoder.new(StringIO.new(archive))
+    assert_raise(Bzip3::MemoryLimitError) { dec.read }
+    assert_kind_of RuntimeError, Bzip3::MemoryLimitError.new
+
+    out = "".b
+    small = Bzip3::Encoder.new(out, blocksize: 1 << 20)
+    small.write "abc"
+    small.close
+    assert_operator out.byteslice(5, 4).unpack1("V"), :<, 1 << 20
+
+    Bzip3.memory_limit = Bzip3.memory_usage + per + per / 2
+    pool = Bzip3::BlockPool.new(blocksize: 1 << 20, threads: 4)
+    assert_equal 1, pool.threads
+    pool.close
+
+    Bzip3.memory_timeout = 1.0
+    th = Thread.new { Bzip3::BlockProcessor.new(1 << 20) }
+    sleep 0.1
+    Bzip3.memory_limit = nil
+    assert_kind_of Bzip3::BlockProcessor, th.value
+
+    # 待機中の確保は返却で起こされ、GC は待機ごとに一度まで
+    Bzip3.memory_timeout = 30
+    before = Bzip3.memory_usage
+    holder = Bzip3::Encoder.new("".b, blocksize: 65 << 10)
+    Bzip3.memory_limit = Bzip3.memory_usage + (Bzip3.memory_usage - before) / 2
+    gc = GC.count
+    th = Thread.new { Bzip3::BlockProcessor.new(65 << 10) }
+    Thread.pass until th.status == "sleep"
+    holder.close
+    assert_kind_of Bzip3::BlockProcessor, th.value
+    assert_operator GC.count - gc, :<=, 1
+    assert_equal "abc", Bzip3.decode(out)
+  ensure
+    Bzip3.memory_limit = nil
+    Bzip3.memory_timeout = 0
+    enc = small = pool = th = nil
+  end
+
+  def test_oneshot_limits
+    src = 10.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 2000 }.join
+    bin = Bzip3.encode(src, blocksize: 65 << 10)
+    assert_equal src, Bzip3.decode(bin)
+    assert_equal src, Bzip3.decode(bin, format: Bzip3::V1_FILE_FORMAT, max_output: src.bytesize)
+
+    assert_equal src.byteslice(0, 100), Bzip3.decode(bin, 100, partial: true)
+    assert_equal src.byteslice(0, 70000), Bzip3.decode(bin, 70000, partial: true, max_output: 70000)
+    assert_equal src, Bzip3.decode(bin, src.bytesize * 2, partial: true)
+    assert_raise(RuntimeError) { Bzip3.decode(bin, 100) }
+
+    assert_raise_message(/max_output/) { Bzip3.decode(bin, max_output: src.bytesize - 1) }
+
+    frame = Bzip3.encode(src, blocksize: 65 << 10, format: Bzip3::V1_FRAME_FORMAT)
+    assert_equal src.byteslice(0, 200000), Bzip3.decode(frame, 200000, partial: true, format: Bzip3::V1_FRAME_FORMAT)
+  end
+
+  def test_library_build
+    assert_include %w(system bundled bundled-avx2), Bzip3::LIBRARY_BUILD
+    assert_predicate Bzip3::LIBRARY_BUILD, :frozen?
+  end
+
+  def test_command
+    cmd = [RbConfig.ruby, *$LOAD_PATH.map { |e| "-I#{e}" }, File.join(__dir__, "../bin/extbzip3")]
+    env = { "LANG" => "C.UTF-8" }
+    src = 10.times.map { |i| "#{i}: 123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ\n" * 20000 }.join
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.txt")
+      File.binwrite(path, src)
+      assert system(env, *cmd, "-j", "3", "-b", "1", "--rm", path)
+      assert_false File.exist?(path)
+      assert_equal src, Bzip3.decode(File.binread("#{path}.bz3"))
+      assert system(env, *cmd, "-t", "#{path}.bz3")
+      assert system(env, *cmd, "-d", "#{path}.bz3")
+      assert_equal src, File.binread(path)
+      assert_false system(env, *cmd, "-d", "#{path}.bz3", err: File::NULL)
+      out = IO.popen(env, [*cmd, "-d", "-c", "#{path}.bz3"], "rb", &:read)
+      assert_equal src, out
+      out = IO.popen(env, [*cmd, "-c"], "r+b") { |io| io << src; io.close_write; io.read }
+      assert_equal src, Bzip3.decode(out)
+      File.binwrite("#{path}.bz3", out.byteslice(0, out.bytesize - 1))
+      assert_false system(env, *cmd, "-t", "#{path}.bz3", err: File::NULL)
+
+      if File.respond_to?(:mkfifo)
+        fifo = File.join(dir, "fifo")
+        File.mkfifo(fifo)
+        assert_false system(env, *cmd, "--rm", fifo, err: File::NULL)
+        assert File.exist?(fifo)
+        assert_false File.exist?("#{fifo}.bz3")
+      end
+    end
+  end
+
+  private
+
+  # ストリーム形式の各ブロックヘッダから伸長後の大きさを取り出す
+  def block_sizes(bin)
+    off = 9
+    sizes = []
+    while off < bin.bytesize
+      packed, orig = bin.byteslice(off, 8).unpack("VV")
+      sizes << orig
+      off += 8 + packed
+    end
+    sizes
+  end
 end